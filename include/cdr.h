@@ -0,0 +1,79 @@
+#ifndef CDR_H
+#define CDR_H
+
+#include <stdint.h>
+
+/*
+ * Call detail records.
+ *
+ * When a call ends, the TU code produces one fixed-size record describing
+ * it.  Records are pushed into a ring buffer owned by the calling thread,
+ * which never blocks and takes no lock; a background writer thread drains
+ * all rings periodically and appends the records to a file with batched
+ * write() and fdatasync() calls.  If a ring is full because the writer
+ * has fallen behind, the record is dropped and counted.
+ */
+
+/*
+ * Why a call ended.
+ */
+typedef enum cdr_reason {
+    CDR_CALLER_HANGUP = 1,  //answered call, ended by the caller
+    CDR_CALLEE_HANGUP,      //answered call, ended by the callee
+    CDR_CANCELLED,          //the caller hung up while the callee was ringing
+    CDR_REJECTED,           //the callee hung up while ringing
+    CDR_BUSY                //the callee was busy, the call never rang
+} CDR_REASON;
+
+/*
+ * A call detail record, as written to the file (in host byte order).
+ * Times are nanoseconds since the epoch; answer_ns is 0 for a call that was
+ * never answered, and the duration of an answered call is end_ns-answer_ns.
+ */
+typedef struct cdr_record {
+    uint64_t call_id;
+    int64_t ring_ns;
+    int64_t answer_ns;
+    int64_t end_ns;
+    int32_t caller;   //extension of the calling TU
+    int32_t callee;   //extension of the called TU
+    uint32_t reason;  //a CDR_REASON
+    uint32_t reserved;
+} CDR_RECORD;
+
+/*
+ * Start recording calls to a file.  Records are appended to the file if
+ * it exists.
+ *
+ * @param path  The file.
+ * @return 0 if successful, otherwise -1.
+ */
+int cdr_open(const char *path);
+
+/*
+ * @return nonzero if calls are being recorded.
+ */
+int cdr_enabled(void);
+
+/*
+ * @return a new call identifier, unique for the life of the process.
+ */
+uint64_t cdr_new_call_id(void);
+
+/*
+ * @return the current time, in nanoseconds since the epoch.
+ */
+int64_t cdr_now(void);
+
+/*
+ * Record a call.  Never blocks; the record is dropped if the calling
+ * thread's ring is full.
+ */
+void cdr_log(const CDR_RECORD *rec);
+
+/*
+ * Write out all pending records, sync the file and stop recording.
+ */
+void cdr_close(void);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef CONF_H
+#define CONF_H
+
+#include <stddef.h>
+
+#include "outq.h"
+
+/*
+ * Conference bridges.
+ *
+ * A bridge is reached at an extension of its own, which the PBX never hands
+ * out to a TU.  A TU that dials it joins the conference, and every chat
+ * line of a member goes to all the other members.  The line is built once,
+ * as a shared message, and the same bytes are queued on the output queue
+ * of each member.
+ *
+ * A bridge has a lock of its own, which is only held to change or walk the
+ * list of members.  Joining or leaving never locks any other member, and
+ * delivering a line only locks the output queue of each member in turn.
+ *
+ * A bridge may instead relay the lines of its members elsewhere, as the
+ * paging extension does with the PBX's idle TUs.
+ */
+
+typedef struct conf CONF;
+typedef struct conf_member CONF_MEMBER;
+
+/*
+ * Delivers a line of a relaying bridge.
+ *
+ * @param arg  As given to conf_new().
+ * @param msg  The line, without its EOL.
+ * @param len  The length of the line.
+ * @return the number of clients it was delivered to, or -1 on failure.
+ */
+typedef int (*CONF_RELAY)(void *arg, const char *msg, size_t len);
+
+/*
+ * Create a bridge.
+ *
+ * @param ext  The extension of the bridge.
+ * @param limit  The most members the bridge takes at once, or 0 for no limit.
+ * @param relay  What the lines of the members are given to, or NULL to have
+ * them sent to the other members.
+ * @param arg  Passed to relay.
+ * @return the bridge, or NULL if memory is exhausted.
+ */
+CONF *conf_new(int ext, int limit, CONF_RELAY relay, void *arg);
+
+/*
+ * Free a bridge, which must no longer have any members.
+ */
+void conf_free(CONF *conf);
+
+/*
+ * @return the extension of a bridge.
+ */
+int conf_extension(CONF *conf);
+
+/*
+ * Add a member to a bridge.
+ *
+ * @param conf  The bridge.
+ * @param q  The output queue of the member, which the bridge references
+ * until the member leaves.
+ * @return the membership, or NULL with errno set to EBUSY if the bridge
+ * is full, or to ENOMEM.
+ */
+CONF_MEMBER *conf_join(CONF *conf, OUTQ *q);
+
+/*
+ * Remove a member from a bridge.
+ */
+void conf_leave(CONF *conf, CONF_MEMBER *m);
+
+/*
+ * Send a chat line to every member of a bridge but its sender, or hand it
+ * to the relay of the bridge.  The line is built once, as a shared message,
+ * which is queued on each member's output queue in the same order as every
+ * other line of the bridge.
+ *
+ * @param conf  The bridge.
+ * @param from  The membership of the sender, which must not leave meanwhile.
+ * @param msg  The text of the line.
+ * @param len  The length of the text.
+ * @param flush  Called once the bridge is unlocked, for every queue the
+ * line was queued on, to send it; it must release the reference to the
+ * queue that it is given.
+ * @return the number of members the line was queued for, or that the relay
+ * delivered it to, or -1 if memory is exhausted.
+ */
+int conf_chat(CONF *conf, CONF_MEMBER *from, const char *msg, size_t len,
+              void (*flush)(OUTQ *q));
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef FMUTEX_H
+#define FMUTEX_H
+
+/*
+ * Minimal mutex built directly on futex(2).
+ *
+ * The whole lock is a single int, so it can be placed next to the data it
+ * protects without dragging a larger structure into the same cache line.
+ * Taking a free lock and releasing an uncontended one are a single atomic
+ * instruction each; the kernel is only entered when threads actually have
+ * to wait.  The lock is not recursive and has no owner checking.
+ */
+typedef struct fmutex {
+    int state; //0 unlocked, 1 locked, 2 locked with (possible) waiters
+} FMUTEX;
+
+#define FMUTEX_INITIALIZER { 0 }
+
+void fmutex_init(FMUTEX *m);
+void fmutex_lock(FMUTEX *m);
+
+/*
+ * @return 0 if the lock was taken, -1 if it is held by someone else.
+ */
+int fmutex_trylock(FMUTEX *m);
+
+void fmutex_unlock(FMUTEX *m);
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#include "tu_ext.h"
+
+/*
+ * Hot restart: handing a running server over to a newly started one
+ * without disconnecting any client.
+ *
+ * The running server accepts requests to hand over on a Unix domain socket.
+ * When a new server connects to it, the old one stops accepting and pauses
+ * the reactor, then sends the listening socket and every client socket over
+ * the Unix socket with SCM_RIGHTS, along with a snapshot of each client's
+ * TU (extension, state, peer, details of the current call), the partial
+ * line the client was in the middle of sending and the output it had not
+ * been sent yet.  The new server rebuilds the registry from the snapshots,
+ * holding back any output, and says it is ready.  The old server then
+ * commits, after which it exits without touching the connections, and only
+ * on the commit does the new server start serving them.  Should either
+ * side fail or time out before the commit, the new server gives the
+ * connections up without sending anything and the old one resumes service.
+ *
+ * Connections can only be handed over by the reactor (see reactor.h), and
+ * only a single listening socket is supported.
+ */
+
+#define HANDOFF_MAGIC 0x48584250 //"PBXH"
+#define HANDOFF_VERSION 2
+//descriptors passed by one message, the kernel takes at most 253
+#define HANDOFF_FDS_PER_MSG 250
+//bytes of state passed by one message
+#define HANDOFF_CHUNK (64*1024)
+#define HANDOFF_READY 'R'
+#define HANDOFF_COMMIT 'C'
+
+/*
+ * The protocol, over a SOCK_SEQPACKET socket:
+ *   a HANDOFF_HEADER, carrying the listening socket;
+ *   messages holding a uint32_t count and that many client sockets, until
+ *     all of them have been passed;
+ *   the state, in chunks: a HANDOFF_RECORD for each client socket, in the
+ *     same order, each followed by its partial line and its unsent output;
+ * to which the new server replies with HANDOFF_READY once it has rebuilt the
+ * TUs, with their output held back.  The old server, which from then on
+ * leaves the connections alone, confirms with HANDOFF_COMMIT, and only then
+ * does the new one start serving them.  Without the confirmation the new
+ * server gives the connections up again, and the old one resumes.
+ */
+typedef struct handoff_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;     //client connections
+    uint32_t reserved;
+    uint64_t state_len; //bytes of state
+} HANDOFF_HEADER;
+
+typedef struct handoff_record {
+    TU_SNAPSHOT tu;
+    uint32_t pending_len;
+    uint32_t out_len;
+} HANDOFF_RECORD;
+
+/*
+ * Accept requests to hand over on a Unix domain socket, from a background
+ * thread.  Any file at the path is replaced.  Must be called by the thread
+ * that runs the accept loop, which is interrupted with SIGUSR1 once a
+ * request has arrived.
+ *
+ * @param path  The path of the socket.
+ * @return 0 if successful, otherwise -1.
+ */
+int handoff_listen(const char *path);
+
+/*
+ * @return nonzero if a new server is waiting to take over.
+ */
+int handoff_requested(void);
+
+/*
+ * Hand everything over to the server that is waiting to take over.
+ * Accepting must have stopped.  On success the reactor is left paused,
+ * and the caller should exit without shutting any connection down.
+ *
+ * @param listenfd  The listening socket.
+ * @return 0 if the new server has taken over, -1 if the handoff failed,
+ * in which case service has been resumed.
+ */
+int handoff_send(int listenfd);
+
+/*
+ * Take over from a running server.  The reactor must have been started.
+ * Every connection handed over is restored, registered and given to the
+ * reactor.
+ *
+ * @param path  The path of the socket the running server accepts requests on.
+ * @param listenfd  Receives the listening socket.
+ * @return 0 if successful, otherwise -1.
+ */
+int handoff_receive(const char *path, int *listenfd);
+
+#endif
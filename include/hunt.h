@@ -0,0 +1,99 @@
+#ifndef HUNT_H
+#define HUNT_H
+
+#include "pbx.h"
+
+/*
+ * Hunt groups.
+ *
+ * A hunt group is reached at an extension of its own and rings one of a
+ * fixed set of agents, the TUs at the member extensions.  A group keeps the
+ * agents that are on hook in an idle list, in the order they became idle,
+ * and callers that find no idle agent in a queue, in the order they called.
+ * An agent is taken off the list as soon as it leaves the TU_ON_HOOK state
+ * and put back when it returns to it, so a call always goes to the agent
+ * that has been idle longest, and finding it takes constant time however
+ * large the group is.  Likewise an agent that becomes idle takes the caller
+ * that has waited longest.
+ *
+ * Each TU has one link, on an idle list while it is an idle agent or on a
+ * queue while it is a waiting caller, never both.  The lists have a lock of
+ * their own, which may be taken while holding TU locks but not the other
+ * way around.
+ */
+
+typedef struct hunt HUNT;
+
+typedef struct hunt_link {
+    struct hunt_link *prev;
+    struct hunt_link *next;
+    TU *tu;
+    int listed; //on an idle list or a queue
+} HUNT_LINK;
+
+/*
+ * Create a hunt group.
+ *
+ * @param ext  The extension of the group.
+ * @param agents  The extensions of the agents.
+ * @param nagents  The number of agents.
+ * @return the group, or NULL if memory is exhausted.
+ */
+HUNT *hunt_new(int ext, const int *agents, int nagents);
+
+/*
+ * Free a group, which must no longer have idle agents or waiting callers.
+ */
+void hunt_free(HUNT *hunt);
+
+/*
+ * @return the extension of a group.
+ */
+int hunt_extension(HUNT *hunt);
+
+/*
+ * @return nonzero if an extension is one of the agents of a group.
+ */
+int hunt_is_agent(HUNT *hunt, int ext);
+
+/*
+ * Report that an agent has become idle.  If a caller is waiting, it is
+ * taken off the queue for the agent, otherwise the agent goes on the idle
+ * list.
+ *
+ * @param hunt  The group.
+ * @param agent  The link of the agent, which must be locked.
+ * @return the caller, whose reference held by the queue passes to the
+ * caller of this function, or NULL.
+ */
+TU *hunt_agent_idle(HUNT *hunt, HUNT_LINK *agent);
+
+/*
+ * Take an agent that is no longer idle off the idle list, if it is on it.
+ */
+void hunt_agent_busy(HUNT *hunt, HUNT_LINK *agent);
+
+/*
+ * Have a caller wait for an agent.  If an agent is idle, it is taken off
+ * the idle list for the caller, otherwise the caller is queued.  A caller
+ * that is already queued stays where it is.
+ *
+ * @param hunt  The group.
+ * @param caller  The link of the caller, which must be locked.
+ * @param front  Queue the caller ahead of all the others, e.g. when the
+ * agent it was given turned out to be busy.
+ * @return the agent, with a reference that the caller of this function
+ * must release, or NULL if the caller is queued (in which case the queue
+ * holds a reference to it).
+ */
+TU *hunt_caller_wait(HUNT *hunt, HUNT_LINK *caller, int front);
+
+/*
+ * Take a caller that gives up off the queue, if it is on it.
+ *
+ * @return 1 if the caller was queued, in which case the reference of the
+ * queue must be released, otherwise 0.
+ */
+int hunt_caller_cancel(HUNT *hunt, HUNT_LINK *caller);
+
+#endif
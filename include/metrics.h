@@ -0,0 +1,100 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/*
+ * Run-time metrics.
+ *
+ * Every thread that updates a metric gets its own slot, so an update is a
+ * plain relaxed store to a line no other thread writes: no lock, no atomic
+ * read-modify-write and no cache line bouncing between CPUs.  Readers sum
+ * the slots of all threads; the slot of a thread that exits is folded into
+ * a shared total first, so nothing is lost.
+ *
+ * The metrics are served in the Prometheus text exposition format over
+ * HTTP on an admin port, see metrics_serve().
+ */
+
+/*
+ * Counters, which only ever increase.
+ */
+typedef enum metric {
+    METRIC_REGISTRATIONS,   //TUs registered
+    METRIC_UNREGISTRATIONS, //TUs unregistered
+    METRIC_DIALS,           //dial commands executed
+    METRIC_BUSY,            //dials answered with a busy signal
+    METRIC_DIAL_ERRORS,     //dials of an extension that does not exist
+    METRIC_CONNECTS,        //calls answered
+    METRIC_HANGUPS,         //hangup commands executed
+    METRIC_CHATS,           //chat messages delivered to a peer
+    METRIC_BYTES_IN,        //bytes of commands received from clients
+    METRIC_BYTES_OUT,       //bytes sent to clients
+    METRIC_PAGES,           //pages sent from the paging extension
+    METRIC_HUNT_QUEUED,     //hunt group calls that had to wait for an agent
+    METRIC_PRESENCE,        //presence notifications sent to watchers
+    METRIC_PRESENCE_COALESCED, //state changes superseded before a watcher was sent them
+    METRIC_COUNT
+} METRIC;
+
+/*
+ * Add to a counter.
+ */
+void metrics_add(METRIC m, unsigned long n);
+
+static inline void metrics_inc(METRIC m) {
+    metrics_add(m, 1);
+}
+
+/*
+ * Account for a TU changing state, for the per-state gauges.
+ *
+ * @param from  The state the TU leaves, or -1 for a new TU.
+ * @param to  The state the TU enters, or -1 for a TU that is freed.
+ */
+void metrics_state_change(int from, int to);
+
+/*
+ * @return nonzero if command latencies are being measured, which is only
+ * the case while the metrics are served.
+ */
+int metrics_timing(void);
+
+/*
+ * @return a monotonic time in nanoseconds, for measuring latencies.
+ */
+uint64_t metrics_now(void);
+
+/*
+ * Record the time from receiving a command to having its notifications
+ * sent or queued.
+ *
+ * @param cmd  The command, a TU_COMMAND below TU_NO_CMD.
+ * @param ns  The latency in nanoseconds.
+ */
+void metrics_command_time(int cmd, uint64_t ns);
+
+/*
+ * Record the time taken to deliver a page to every TU on hook.
+ *
+ * @param ns  The time in nanoseconds.
+ */
+void metrics_page_time(uint64_t ns);
+
+/*
+ * Serve the metrics on a port from a background thread.  Any request on
+ * the port is answered with the current metrics, as text in the Prometheus
+ * exposition format, after which the connection is closed.
+ *
+ * @param port  The port to listen on.
+ * @return 0 if successful, otherwise -1.
+ */
+int metrics_serve(char *port);
+
+/*
+ * Stop serving the metrics and close the port, so that another process can
+ * serve them there.  Counting goes on.
+ */
+void metrics_stop(void);
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+/*
+ * Outbound queue for a client connection.
+ *
+ * Notifications are appended to the queue (typically while the owning TU is
+ * locked) and written to the socket later with non-blocking sends, so that a
+ * slow client never stalls the thread that generated the notification.
+ * Whatever cannot be written immediately is drained in the background by a
+ * dedicated thread once the socket becomes writable again.
+ *
+ * The queue owns the socket: the file descriptor is closed when the last
+ * reference to the queue is released.  This guarantees that a descriptor
+ * number is never reused while anyone might still write to it.
+ */
+
+/*
+ * What to do when appending would make a queue exceed its limit.
+ *   OUTQ_DROP: the new message is discarded.
+ *   OUTQ_DISCONNECT: the connection is shut down.
+ */
+typedef enum outq_policy {
+    OUTQ_DROP, OUTQ_DISCONNECT
+} OUTQ_POLICY;
+
+/*
+ * Default maximum number of unsent bytes held for one connection.
+ */
+#define OUTQ_DEFAULT_LIMIT (64*1024)
+
+typedef struct outq OUTQ;
+
+/*
+ * Set the per-connection limit and the overflow policy used by all queues.
+ * Must be called before any queue is created.
+ */
+void outq_configure(size_t limit, OUTQ_POLICY policy);
+
+/*
+ * Create a queue for a connection.  The queue takes ownership of fd.
+ *
+ * @return the queue, with a reference count of 1, or NULL on failure.
+ */
+OUTQ *outq_new(int fd);
+
+OUTQ *outq_ref(OUTQ *q);
+void outq_unref(OUTQ *q);
+
+/*
+ * Append a message to a queue.  The message is only queued; it is sent by a
+ * subsequent outq_flush() or by the background drainer.
+ *
+ * @return 0 if the message was queued, -1 if it was refused because the queue
+ * is closed or full (in which case the overflow policy has been applied).
+ */
+int outq_append(OUTQ *q, const void *data, size_t len);
+
+/*
+ * Lock a queue, so that nothing else can be queued on it until it is
+ * unlocked.  Taking the lock while the state that decides what is sent is
+ * still locked, and only then releasing that state, keeps the message
+ * written with outq_write_locked() in order with everything else.
+ */
+void outq_lock(OUTQ *q);
+void outq_unlock(OUTQ *q);
+
+/*
+ * Send a message made of several pieces to a locked queue.  If nothing is
+ * queued ahead of it, the message goes straight from the caller's buffers
+ * to the socket; only the part the socket does not take is copied into the
+ * queue, to be sent by a subsequent outq_flush().
+ *
+ * @return 0 if the message was sent or queued, -1 if the queue is closed or
+ * full (in which case the overflow policy has been applied; a partly sent
+ * message closes the queue).
+ */
+int outq_write_locked(OUTQ *q, const struct iovec *iov, int iovcnt);
+
+/*
+ * Append a message made of several pieces to a locked queue, without trying
+ * to send it.
+ *
+ * @return as for outq_append().
+ */
+int outq_append_iov_locked(OUTQ *q, const struct iovec *iov, int iovcnt);
+
+/*
+ * A message that is queued on several queues without being copied for each
+ * of them, e.g. a line sent to every member of a conference.  The queues
+ * share the bytes and the last one to send them releases them.
+ */
+typedef struct obuf OUTQ_MSG;
+
+/*
+ * Build a shared message from several pieces.
+ *
+ * @return the message, with a reference count of 1, or NULL if memory is
+ * exhausted.
+ */
+OUTQ_MSG *outq_msg_new(const struct iovec *iov, int iovcnt);
+void outq_msg_unref(OUTQ_MSG *msg);
+
+/*
+ * Append a shared message to a queue, which takes its own reference.
+ *
+ * @return as for outq_append().
+ */
+int outq_append_msg(OUTQ *q, OUTQ_MSG *msg);
+
+/*
+ * Write as much queued output as the socket accepts without blocking.
+ * Anything left over is handed to the background drainer.
+ *
+ * @return 0 if the queue is now empty, 1 if output remains pending,
+ * -1 if the connection has failed and the queue was closed.
+ */
+int outq_flush(OUTQ *q);
+
+/*
+ * Shut down the connection behind a queue and discard any unsent output.
+ */
+void outq_close(OUTQ *q);
+
+/*
+ * Have a queue call a function whenever output that had to wait for the
+ * socket has all been sent, so that a producer that held back while the
+ * client was slow can queue what it has now.  It is called by whichever
+ * thread finished the output, with the queue unlocked but referenced.
+ * This may only be done once for a queue.
+ *
+ * @param q  The queue.
+ * @param drained  Called when the output has been sent.
+ * @param release  Called when the queue is freed, e.g. to free arg.
+ * @param arg  Passed to both functions.
+ */
+void outq_set_drained(OUTQ *q, void (*drained)(void *arg), void (*release)(void *arg),
+                      void *arg);
+
+/*
+ * @return nonzero if output of a queue is waiting for the socket to take it,
+ * or is being held back, in which case anything queued now will be late.
+ */
+int outq_busy(OUTQ *q);
+
+/*
+ * Have the sends of the calling thread submitted to an io_uring instead of
+ * made with sendmsg(), so that the output of many queues costs a single
+ * io_uring_enter().  Nothing is sent until the thread submits the ring, and
+ * a send that the socket does not take at once is finished by the kernel
+ * rather than by the drainer.  The thread must be the only one to use the
+ * ring, and must pass every completion whose user_data has the tag in its
+ * low bits to outq_uring_complete().
+ *
+ * @param ring  The ring, or NULL to go back to sendmsg().
+ * @param tag  Low bits set in the user_data of the sends, which are
+ * otherwise aligned to 8 bytes.
+ */
+void outq_use_uring(URING *ring, unsigned long tag);
+
+/*
+ * Finish a send submitted to an io_uring.
+ *
+ * @param req  The user_data of the completion, with the tag cleared.
+ * @param res  The result of the completion.
+ */
+void outq_uring_complete(void *req, int res);
+
+/*
+ * Hold back the output of a queue, e.g. while its connection is being
+ * handed over to another process.  Nothing is sent until outq_release(),
+ * although output may still be queued.
+ *
+ * @param q  The queue.
+ * @param data  Receives a copy of the output queued so far, which the
+ * caller must free(), or NULL if no copy is wanted.
+ * @return the number of bytes copied, or -1 if memory is exhausted (in
+ * which case the queue is not held).
+ */
+ssize_t outq_hold(OUTQ *q, char **data);
+
+/*
+ * Resume sending the output of a held queue, and call the function set with
+ * outq_set_drained() once what was queued meanwhile has been sent, so that
+ * what a producer held back while the queue was held is not left behind.
+ */
+void outq_release(OUTQ *q);
+
+#endif
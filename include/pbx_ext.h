@@ -0,0 +1,119 @@
+#ifndef PBX_EXT_H
+#define PBX_EXT_H
+
+#include "pbx.h"
+#include "conf.h"
+#include "hunt.h"
+
+/*
+ * Extensions beyond the interface in pbx.h.
+ */
+
+/*
+ * Pass as the extension to pbx_register() to have the PBX assign the next
+ * free extension number.  Extension numbers are independent of the file
+ * descriptors of the underlying connections, and the number of extensions
+ * is limited only by memory.
+ */
+#define PBX_ANY_EXTENSION (-1)
+
+/*
+ * The lowest extension number handed out by the PBX.
+ */
+#define PBX_FIRST_EXTENSION 1
+
+/*
+ * Most conference bridges, and most hunt groups, a PBX may have.
+ */
+#define PBX_MAX_BRIDGES 64
+#define PBX_MAX_HUNTS 64
+
+/*
+ * Provide a conference bridge at an extension, see conf.h.  Dialing the
+ * extension joins the conference instead of calling a TU, and the PBX never
+ * assigns it to a TU.  Bridges must be added before any TU is registered.
+ *
+ * @param pbx  The PBX.
+ * @param ext  The extension of the bridge.
+ * @return 0 if successful, -1 if the extension is invalid or taken, or
+ * there are too many bridges.
+ */
+int pbx_add_bridge(PBX *pbx, int ext);
+
+/*
+ * Provide a paging extension.  It is a bridge that takes one member at a
+ * time, and each chat line of that member is sent as a page, "PAGE <msg>",
+ * to every TU that is on hook.  Like bridges, it must be added before any
+ * TU is registered.
+ *
+ * @param pbx  The PBX.
+ * @param ext  The extension to page from.
+ * @return as for pbx_add_bridge().
+ */
+int pbx_add_paging(PBX *pbx, int ext);
+
+/*
+ * @return the conference bridge at an extension, or NULL if there is none.
+ */
+CONF *pbx_bridge(PBX *pbx, int ext);
+
+/*
+ * Provide a hunt group, see hunt.h.  Dialing its extension rings the agent
+ * that has been idle longest, or waits for one to become idle.  The PBX
+ * never assigns the extension to a TU, and a TU registered at one of the
+ * agent extensions becomes an agent of the group.  An extension can be an
+ * agent of one group only.  Groups must be added before any TU is
+ * registered.
+ *
+ * @param pbx  The PBX.
+ * @param ext  The extension of the group.
+ * @param agents  The extensions of the agents.
+ * @param nagents  The number of agents.
+ * @return 0 if successful, -1 if an extension is invalid or taken, or
+ * there are too many groups.
+ */
+int pbx_add_hunt(PBX *pbx, int ext, const int *agents, int nagents);
+
+/*
+ * How long pbx_shutdown() waits for clients to disconnect, unless the PBX
+ * has been drained beforehand.
+ */
+#define PBX_DRAIN_TIMEOUT_MS 5000
+
+/*
+ * Drain a PBX ahead of shutting it down.  New registrations are refused,
+ * the connection of every registered TU is shut down, and the call waits
+ * until every TU has been unregistered or the timeout expires, whichever
+ * comes first.  The PBX remains usable for lookups and unregistrations.
+ *
+ * @param pbx  The PBX.
+ * @param timeout_ms  The longest time to wait, in milliseconds.
+ * @param elapsed_ms  If not NULL, receives the time the drain took.
+ * @return the number of TUs still registered, 0 if the PBX is drained.
+ */
+long pbx_drain(PBX *pbx, long timeout_ms, long *elapsed_ms);
+
+/*
+ * Have a TU watch the state of an extension, see tu_watch().  The extension
+ * need not be registered yet: its watchers are told when it is.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The watching TU.
+ * @param ext  The extension to watch.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_watch(PBX *pbx, TU *tu, int ext);
+
+/*
+ * Register a TU that has been handed over by another server process, see
+ * tu_restore(), at the extension it had there.  Unlike pbx_register(), no
+ * notification is sent to the client.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU.
+ * @param ext  The extension.
+ * @return 0 if successful, -1 if the extension is taken.
+ */
+int pbx_restore(PBX *pbx, TU *tu, int ext);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Fixed-size object pools.
+ *
+ * Objects of one size are carved out of large slabs that are never returned
+ * to the system, so that connecting and disconnecting clients does not
+ * fragment the heap.  Every thread keeps a small cache of free objects for
+ * each pool and only takes the pool lock to move a batch of objects between
+ * its cache and the pool; a thread's cache is returned to the pool when the
+ * thread exits.
+ *
+ * Pools are statically allocated with POOL_INITIALIZER and come into use
+ * with their first allocation.
+ */
+
+//number of distinct pools a program may use
+#define POOL_MAX 16
+//shards of the in-use counter, so that threads rarely update the same line
+#define POOL_COUNTER_SHARDS 8
+
+typedef struct pool {
+    const char *name;
+    size_t size;            //requested object size
+    size_t align;           //alignment of every object
+    //the rest is private to pool.c
+    int id;                 //index of the pool's per-thread caches, -1 until first use
+    size_t slot;            //object size rounded up to the alignment
+    int batch;              //most objects moved between a thread's cache and the pool at once
+    pthread_mutex_t lock;
+    void *free;             //objects not cached by any thread
+    size_t nfree;
+    size_t capacity;        //objects carved out of slabs so far
+    size_t slabs;
+    struct {
+        long n;
+    } __attribute__((aligned(64))) in_use[POOL_COUNTER_SHARDS];
+} POOL;
+
+/*
+ * Static initializer for a pool of objects of the given size and alignment.
+ * Use an alignment of 64 for objects that are written by several threads,
+ * so that no two of them share a cache line.
+ */
+#define POOL_INITIALIZER(name, size, align) \
+    { (name), (size), (align), -1, 0, 0, PTHREAD_MUTEX_INITIALIZER }
+
+/*
+ * Allocate an object from a pool.
+ *
+ * @return the object, uninitialized, or NULL if memory is exhausted.
+ */
+void *pool_alloc(POOL *pool);
+
+/*
+ * Allocate an object from a pool and fill it with zeroes.
+ */
+void *pool_zalloc(POOL *pool);
+
+/*
+ * Return an object to the pool it was allocated from.  NULL is ignored.
+ */
+void pool_free(POOL *pool, void *obj);
+
+/*
+ * Occupancy of a pool.
+ *   capacity: objects carved out of slabs so far.
+ *   in_use: objects currently allocated.
+ *   pooled: free objects held by the pool itself; the remaining
+ *     capacity-in_use-pooled are in per-thread caches.
+ */
+typedef struct pool_stats {
+    const char *name;
+    size_t slot_size;
+    size_t slabs;
+    size_t capacity;
+    size_t in_use;
+    size_t pooled;
+} POOL_STATS;
+
+/*
+ * Get the occupancy of every pool in use.
+ *
+ * @param stats  Array that receives the statistics.
+ * @param max  Number of elements of stats.
+ * @return the number of pools reported.
+ */
+int pool_stats(POOL_STATS *stats, int max);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "pbx.h"
+#include "outq.h"
+
+/*
+ * Presence: clients watching the state of extensions.
+ *
+ * A watcher is the subscribing side of a client, with a watch for each
+ * extension it follows.  The watches are indexed by extension, so that a
+ * state change only looks at the watches of the extension that changed,
+ * and costs nothing but a check of an empty slot when nobody watches it.
+ *
+ * A change is not queued on the watcher's output straight away: each watch
+ * only keeps the latest state of its extension, and the watchers that have
+ * changes to report are sent them once the TUs are unlocked.  A watcher
+ * whose client is not taking its output has nothing more queued until the
+ * output has been sent, so that while it is slow its changes are coalesced
+ * and it then gets a single line for every extension that changed, with
+ * the state the extension is in by then.  Each line is
+ *   PRESENCE <ext> <state>
+ * with the name of the state as in tu_state_names[].
+ *
+ * Locks are taken in the order TU, index, watcher, output queue.
+ */
+
+typedef struct watcher WATCHER;
+
+//most extensions a single watcher may watch
+#define PRESENCE_MAX_WATCHES 1024
+
+/*
+ * Create the watcher of a client, which lasts as long as its output queue.
+ *
+ * @param q  The output queue of the client.
+ * @return the watcher, or NULL if memory is exhausted.
+ */
+WATCHER *presence_watcher_new(OUTQ *q);
+
+/*
+ * Start watching an extension, or report its state again if it is already
+ * watched.  A watcher's watches must only be changed by one thread at a
+ * time.
+ *
+ * @param w  The watcher.
+ * @param ext  The extension.
+ * @param state  The current state of the TU at the extension, which must
+ * be locked so that none of its changes is missed, or -1 if none is
+ * registered.
+ * @return 0 if successful, -1 if the watcher has too many watches or memory
+ * is exhausted.
+ */
+int presence_watch(WATCHER *w, int ext, int state);
+
+/*
+ * Stop watching an extension.
+ *
+ * @return 0 if it was watched, otherwise -1.
+ */
+int presence_unwatch(WATCHER *w, int ext);
+
+/*
+ * Stop watching every extension, e.g. as the client goes away.
+ */
+void presence_unwatch_all(WATCHER *w);
+
+/*
+ * Note a change of the state of a TU for its watchers, if it has any.
+ *
+ * @param ext  The extension of the TU, which must be locked.
+ * @param state  Its new state.
+ */
+void presence_changed(int ext, TU_STATE state);
+
+/*
+ * Send the watchers whose watches the calling thread has changed what they
+ * have to report, unless their output is still waiting for the socket.
+ * Must be called without holding any TU lock.
+ *
+ * @param flush  Called for the queue of each watcher that was sent
+ * anything; it must release the reference to the queue that it is given.
+ */
+void presence_dispatch(void (*flush)(OUTQ *q));
+
+#endif
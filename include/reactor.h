@@ -0,0 +1,80 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "pbx.h"
+
+/*
+ * Event-driven alternative to the thread-per-connection server.
+ * A fixed number of loop threads each own an epoll set, and every accepted
+ * client socket is handed to exactly one of them for its whole lifetime.
+ *
+ * Alternatively each loop thread owns an io_uring (see uring.h), which keeps
+ * a receive armed on each of its sockets and sends the output generated by
+ * the thread, so that all the I/O of a burst of commands costs one
+ * io_uring_enter() per loop iteration instead of a system call for every
+ * read and every notification.
+ *
+ * If the worker pool (see workers.h) is started before the reactor, the loop
+ * threads only read from the sockets and the commands received are executed
+ * by the workers, in order for each connection.
+ */
+
+/*
+ * How the loop threads wait for and perform I/O.
+ */
+typedef enum reactor_backend {
+    REACTOR_EPOLL, REACTOR_URING
+} REACTOR_BACKEND;
+
+/*
+ * Start the reactor with the specified number of loop threads.
+ *
+ * @param nloops  Number of loop threads (must be at least 1).
+ * @param backend  The backend to use.  If io_uring is asked for but the
+ * kernel does not provide what it takes, epoll is used instead.
+ * @return the backend in use if successful, otherwise -1.
+ */
+int reactor_init(int nloops, REACTOR_BACKEND backend);
+
+/*
+ * @return nonzero if the kernel provides what the loops need to do their
+ * I/O with io_uring, that is if reactor_init() would not fall back to epoll.
+ */
+int reactor_uring_available(void);
+
+/*
+ * Hand a newly accepted client connection to the reactor.
+ * A TU is created and registered for the connection, and the connection
+ * is assigned to one of the loop threads.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if successful, otherwise -1 (in which case connfd is closed).
+ */
+int reactor_add(int connfd);
+
+/*
+ * Take over a connection handed over by another server process.
+ *
+ * @param tu  The TU of the connection, restored and registered.
+ * @param pending  The start of a line the client has not finished sending.
+ * @param len  The length of that partial line.
+ * @return 0 if successful, otherwise -1.
+ */
+int reactor_adopt(TU *tu, const char *pending, int len);
+
+/*
+ * Bring all activity on client connections to a halt (epoll backend only): the loop threads stop
+ * reading, and the call returns once the workers have executed every
+ * command already read.  Nothing happens to any TU until reactor_resume().
+ * Connections may still be added while paused.
+ */
+void reactor_pause(void);
+void reactor_resume(void);
+
+/*
+ * Call a function for every connection while the reactor is paused, with
+ * the connection's TU and the partial line received from its client.
+ */
+void reactor_foreach(void (*fn)(TU *tu, const char *pending, int len, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "pbx.h"
+#include "server.h"
+#include "pool.h"
+
+/*
+ * Commands beyond those of server.h, numbered after them:
+ *   watch <ext>    Watch the state of an extension, see tu_watch().
+ *   unwatch <ext>  Stop watching it.
+ */
+#define TU_WATCH_CMD (TU_CHAT_CMD+1)
+#define TU_UNWATCH_CMD (TU_CHAT_CMD+2)
+
+/*
+ * A command parsed from a client message.
+ * The argument of a chat points into the message buffer, which is
+ * NUL-terminated at the end of the chat text.
+ */
+typedef struct client_cmd {
+    int type;     //a TU_COMMAND, or one of the commands above
+    int ext;      //extension to dial or watch, for TU_DIAL_CMD and the watch commands
+                  //(-1 for a dial of a number that names no TU)
+    char *arg;    //chat text, for TU_CHAT_CMD
+    int arglen;
+} CLIENT_CMD;
+
+/*
+ * Parse a single message received from a TU.
+ *
+ * @param buf  The message, which must end with the EOL sequence.
+ * @param len  The number of bytes in the message.
+ * @param cmd  Filled in with the parsed command.
+ * @return 0 if the message is a well-formed command, otherwise -1.
+ */
+int parse_client_message(char *buf, int len, CLIENT_CMD *cmd);
+
+/*
+ * Parse and execute a single message received from a TU.
+ * The buffer holds one complete line, including the EOL sequence.
+ *
+ * @param curTU  The TU that sent the message.
+ * @param buf  The message.
+ * @param messageSize  The number of bytes in the message.
+ * @return 0 if successful, -1 if the message could not be executed.
+ */
+int execute_client_message(TU *curTU, char *buf, int messageSize);
+
+/*
+ * Pools shared by the front ends: MAXLINE byte line buffers, and the
+ * descriptors passed to pbx_client_service(), which frees its argument
+ * to service_fd_pool.
+ */
+extern POOL service_line_pool;
+extern POOL service_fd_pool;
+
+#endif
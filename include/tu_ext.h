@@ -0,0 +1,191 @@
+#ifndef TU_EXT_H
+#define TU_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pbx.h"
+#include "conf.h"
+#include "hunt.h"
+
+/*
+ * Extensions beyond the TU interface in pbx.h.
+ */
+
+/*
+ * Lock statistics, kept separately by every thread so that collecting them
+ * adds no sharing between threads.
+ *   acquired: number of times the thread locked a TU.
+ *   contended: how many of those found the TU already locked by another thread.
+ *   wait_ns: total time spent waiting for contended locks.
+ */
+typedef struct tu_lock_stats {
+    unsigned long long acquired;
+    unsigned long long contended;
+    unsigned long long wait_ns;
+} TU_LOCK_STATS;
+
+/*
+ * Get the lock statistics of the calling thread.
+ *
+ * @param stats  Receives the statistics.
+ * @param reset  If nonzero, the thread's counters are reset to 0 afterwards.
+ */
+void tu_lock_stats(TU_LOCK_STATS *stats, int reset);
+
+/*
+ * Same as tu_chat(), for a message whose length is known.  The message need
+ * not be NUL-terminated and is not copied unless the peer's connection can't
+ * take it immediately.
+ */
+int tu_chat_len(TU *tu, const char *msg, size_t len);
+
+/*
+ * Dial a conference bridge.  If the TU is in the TU_DIAL_TONE state, it
+ * joins the conference and transitions to the TU_CONNECTED state, with the
+ * extension of the bridge in its notification, or to the TU_BUSY_SIGNAL
+ * state if the bridge is full; there is no effect otherwise.  While
+ * connected to a bridge, the chat messages of the TU go to every other
+ * member, and tu_hangup() leaves the conference.
+ *
+ * @param tu  The TU that is dialing.
+ * @param conf  The bridge.
+ * @return 0 if successful, -1 if the TU could not join and transitioned to
+ * the TU_ERROR state.
+ */
+int tu_dial_bridge(TU *tu, CONF *conf);
+
+/*
+ * Dial a hunt group.  If the TU is in the TU_DIAL_TONE state, it
+ * transitions to the TU_RING_BACK state and the agent of the group that has
+ * been idle longest transitions to the TU_RINGING state, as with
+ * tu_dial().  If no agent is idle, the TU waits in the group's queue,
+ * still in the TU_RING_BACK state, until an agent goes on hook, or until
+ * it hangs up itself.  There is no effect if the TU is in any other state.
+ *
+ * @param tu  The TU that is dialing.
+ * @param hunt  The group.
+ * @return 0 if successful, otherwise -1.
+ */
+int tu_dial_hunt(TU *tu, HUNT *hunt);
+
+/*
+ * Make a TU an agent of a hunt group, which it is while it is registered.
+ * An agent on hook is idle and may take a waiting caller at once.
+ */
+void tu_join_hunt(TU *tu, HUNT *hunt);
+
+/*
+ * Stop a TU from taking calls for its hunt group, if it is an agent of one.
+ * This has to be done before the TU is unregistered.
+ */
+void tu_leave_hunt(TU *tu);
+
+/*
+ * Queue a page, a message shared by all the TUs it goes to, for a TU that
+ * is on hook.  The message is sent as for a notification, so within a
+ * batch it goes out when the batch ends or is flushed.
+ *
+ * @param tu  The TU.
+ * @param msg  The page, with its EOL.
+ * @return 1 if the page was queued, 0 if the TU is not on hook, -1 if its
+ * queue refused the page.
+ */
+int tu_page(TU *tu, OUTQ_MSG *msg);
+
+/*
+ * Watch the state of an extension: the client of the TU is sent a presence
+ * notification (see presence.h) with the current state of the TU at the
+ * extension, if there is one, and then whenever the state of the TU
+ * registered at that extension changes.  The TU itself does not change
+ * state, and is notified of its current state as after tu_chat().
+ *
+ * @param tu  The watching TU.
+ * @param ext  The extension to watch.
+ * @param target  The TU registered at the extension, or NULL if there is none.
+ * @return 0 if successful, -1 if the TU watches too many extensions or
+ * memory is exhausted.
+ */
+int tu_watch(TU *tu, int ext, TU *target);
+
+/*
+ * Stop watching the state of an extension.  The TU is notified of its
+ * current state.
+ *
+ * @return 0 if successful, -1 if the extension was not watched.
+ */
+int tu_unwatch(TU *tu, int ext);
+
+/*
+ * Batch the output of several calls made by the calling thread.
+ * Until the matching tu_batch_end(), notifications and chat messages are
+ * only queued, and tu_batch_end() then sends everything queued for each
+ * affected client with a single write.  Batches may be nested; output is
+ * sent when the outermost one ends.
+ */
+void tu_batch_begin(void);
+void tu_batch_end(void);
+
+/*
+ * Send everything queued during the calling thread's batch so far, without
+ * ending the batch.
+ */
+void tu_batch_flush(void);
+
+/*
+ * The state of a TU, as handed from one server process to another.
+ */
+typedef struct tu_snapshot {
+    int32_t ext;
+    int32_t state;     //a TU_STATE
+    int32_t peer_ext;  //extension of the peer or of the bridge, or -1
+    int32_t caller;    //the TU placed the current call
+    uint64_t call_id;  //details of the current call, for call detail records
+    int64_t ring_ns;
+    int64_t answer_ns;
+} TU_SNAPSHOT;
+
+/*
+ * Take a snapshot of a TU and hold back its output, which must not change
+ * while the snapshot is in use: no other thread may be operating on the TU.
+ *
+ * @param tu  The TU.
+ * @param snap  Receives the state of the TU.
+ * @param out  Receives a copy of the output not yet sent to the client,
+ * which the caller must free().
+ * @param outlen  Receives the length of the output.
+ * @return 0 if successful, -1 if memory is exhausted.
+ */
+int tu_snapshot(TU *tu, TU_SNAPSHOT *snap, char **out, size_t *outlen);
+
+/*
+ * Hold back the output of a TU, e.g. of one being restored whose connection
+ * the other process has not given up yet.
+ */
+void tu_hold_output(TU *tu);
+
+/*
+ * Resume sending the output held back by tu_snapshot() or tu_hold_output().
+ */
+void tu_resume_output(TU *tu);
+
+/*
+ * Put a TU newly created by tu_init() into the state of a snapshot, taken by
+ * another process, and queue the output that process did not get to send.
+ * No notification is sent, unless the call of the TU could not be restored
+ * for want of the other party, which then counts as having hung up.  The
+ * TU is not registered; that is left to pbx_restore().
+ *
+ * @param tu  The TU.
+ * @param snap  The snapshot.
+ * @param peer  The TU restored from the snapshot of the peer, or NULL.
+ * @param conf  The bridge of the conference the TU rejoins, if it has no
+ * peer, or NULL.
+ * @param out  Output to be sent to the client.
+ * @param outlen  Length of the output.
+ * @return 0 if successful, otherwise -1.
+ */
+int tu_restore(TU *tu, const TU_SNAPSHOT *snap, TU *peer, CONF *conf,
+               const char *out, size_t outlen);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, driven with the raw system calls.
+ *
+ * Requests are prepared in submission queue entries, which are only handed
+ * to the kernel by uring_submit(), so that any number of requests prepared
+ * in between costs a single io_uring_enter().  A ring is meant to be used
+ * by one thread only.
+ *
+ * A ring may also have a group of provided buffers (IORING_OP_RECV with
+ * IOSQE_BUFFER_SELECT), from which the kernel picks a buffer for every
+ * chunk of data received.
+ */
+
+typedef struct uring URING;
+
+//the buffer group of a ring's provided buffers
+#define URING_BUFFER_GROUP 0
+
+/*
+ * Create a ring.
+ *
+ * @param entries  The size of the submission queue, a power of 2.
+ * @param nbufs  The number of provided buffers, a power of 2, or 0 for none.
+ * @param bufsize  The size of each provided buffer.
+ * @return the ring, or NULL if the kernel does not support what is needed,
+ * with errno set.
+ */
+URING *uring_new(unsigned entries, unsigned nbufs, unsigned bufsize);
+
+/*
+ * Close a ring, abandoning whatever requests it has in flight.
+ */
+void uring_free(URING *r);
+
+/*
+ * Get a cleared submission queue entry for a request.  If the queue is
+ * full, whatever is in it is submitted first.
+ *
+ * @return the entry, or NULL if the queue could not be submitted.
+ */
+struct io_uring_sqe *uring_get_sqe(URING *r);
+
+/*
+ * Submit every request prepared since the last call and, if wait is set,
+ * wait for at least one completion.
+ *
+ * @return 0 if successful, otherwise -1 (EINTR included).
+ */
+int uring_submit(URING *r, int wait);
+
+/*
+ * @return the oldest unseen completion, or NULL if there is none.  It stays
+ * valid until uring_cqe_seen().
+ */
+struct io_uring_cqe *uring_peek_cqe(URING *r);
+void uring_cqe_seen(URING *r);
+
+/*
+ * @return the provided buffer a completion was given, or NULL if it has none.
+ */
+char *uring_cqe_buffer(URING *r, struct io_uring_cqe *cqe);
+
+/*
+ * Give the provided buffer of a completion back to the kernel, once its
+ * data has been consumed.
+ */
+void uring_cqe_buffer_done(URING *r, struct io_uring_cqe *cqe);
+
+#endif
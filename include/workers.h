@@ -0,0 +1,49 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/*
+ * Fixed-size pool of worker threads.
+ *
+ * Every worker owns a deque of runnable tasks.  A task is queued on the
+ * deque of the worker that last ran it (or of its home worker, when it is
+ * submitted from outside the pool), so that the data it touches tends to
+ * stay in one worker's cache.  A worker whose deque is empty steals from
+ * the other end of another worker's deque before going to sleep.
+ *
+ * The pool never runs the same task on two workers at once as long as a
+ * task is only submitted again once it has been taken off a deque; it is up
+ * to the owner of the task to ensure that (e.g. with a "scheduled" flag).
+ */
+
+typedef struct task {
+    void (*run)(struct task *task);
+    int home; //worker whose deque the task is queued on when submitted from outside
+} TASK;
+
+/*
+ * Start the pool.
+ *
+ * @param nworkers  Number of worker threads (must be at least 1).
+ * @return 0 if successful, otherwise -1.
+ */
+int workers_init(int nworkers);
+
+/*
+ * @return nonzero if the pool has been started.
+ */
+int workers_running(void);
+
+/*
+ * Initialize a task, assigning it a home worker.
+ *
+ * @param task  The task.
+ * @param run  Function that the worker executing the task calls.
+ */
+void workers_task_init(TASK *task, void (*run)(TASK *task));
+
+/*
+ * Queue a task for execution by the pool.
+ */
+void workers_submit(TASK *task);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * CDR: call detail records, collected in per-thread rings and written by a
+ * background thread.
+ */
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "cdr.h"
+#include "debug.h"
+#include "csapp.h"
+
+//records held by one thread's ring, a power of 2
+#define CDR_RING_SIZE 128
+//how often the writer drains the rings
+#define CDR_INTERVAL_MS 10
+//records written by one write()
+#define CDR_WRITE_BATCH 1024
+
+/*
+ * Single-producer single-consumer ring.  The producer (the owning thread)
+ * only advances tail, the consumer (the writer) only advances head, each
+ * on its own cache line.
+ */
+typedef struct cdr_ring {
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int tail __attribute__((aligned(64)));
+    unsigned long dropped; //written by the producer only
+    int dead;              //owning thread has exited
+    struct cdr_ring *next;
+    CDR_RECORD recs[CDR_RING_SIZE];
+} CDR_RING;
+
+static int cdr_fd = -1;
+static int cdr_on;
+static uint64_t next_call_id = 1;
+
+//all rings, for the writer; a ring is pushed by its thread with a CAS and
+//removed by the writer, which is the only thread that walks the list, so
+//neither ever waits for the other
+static CDR_RING *rings;
+static pthread_key_t ring_key;
+static __thread CDR_RING *my_ring;
+
+static pthread_t writer_tid;
+static int writer_stop;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+//records and drops accounted for by the writer
+static unsigned long written;
+static unsigned long dropped;
+
+//the ring of a thread that exits is freed by the writer once it is empty
+static void ring_release(void *arg) {
+    CDR_RING *ring = arg;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static CDR_RING *ring_create(void) {
+    CDR_RING *ring = aligned_alloc(64, sizeof(CDR_RING));
+    if (ring==NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(CDR_RING));
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+//unlink a ring from the list, while other threads may push rings in front of it
+static void ring_unlink(CDR_RING **prev, CDR_RING *ring) {
+    if (prev==&rings) {
+        CDR_RING *first = ring;
+        if (__atomic_compare_exchange_n(&rings, &first, ring->next, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        //no longer first, but only the writer unlinks, so it is further on
+        for (prev = &first->next; *prev!=ring; prev = &(*prev)->next)
+            ;
+    }
+    *prev = ring->next;
+}
+
+/*
+ * Move every record from the rings into buf and write them out, freeing the
+ * rings of exited threads on the way.  Nothing is locked, so a thread that
+ * creates its ring meanwhile does not wait for the write.
+ * @return the number of records written.
+ */
+static unsigned long drain(CDR_RECORD *buf) {
+    unsigned long total = 0;
+    int n = 0;
+    CDR_RING **prev = &rings;
+    CDR_RING *ring;
+    while ((ring = __atomic_load_n(prev, __ATOMIC_ACQUIRE))!=NULL) {
+        int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+        unsigned int head = ring->head;
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        while (head!=tail) {
+            buf[n++] = ring->recs[head%CDR_RING_SIZE];
+            head++;
+            if (n==CDR_WRITE_BATCH) {
+                if (rio_writen(cdr_fd, buf, n*sizeof(CDR_RECORD))<0) {
+                    debug("Failed to write call detail records: %s", strerror(errno));
+                }
+                total += n;
+                n = 0;
+            }
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        if (dead) {
+            //the thread is gone, so this is the last look at the ring
+            dropped += ring->dropped;
+            ring_unlink(prev, ring);
+            free(ring);
+        }
+        else {
+            prev = &ring->next;
+        }
+    }
+    if (n>0) {
+        if (rio_writen(cdr_fd, buf, n*sizeof(CDR_RECORD))<0) {
+            debug("Failed to write call detail records: %s", strerror(errno));
+        }
+        total += n;
+    }
+    return total;
+}
+
+static void *writer_thread(void *arg) {
+    CDR_RECORD *buf = Malloc(CDR_WRITE_BATCH*sizeof(CDR_RECORD));
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    int stop = 0;
+    while (!stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += CDR_INTERVAL_MS*1000000L;
+        if (ts.tv_nsec>=1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&writer_lock);
+        if (!writer_stop) {
+            pthread_cond_timedwait(&writer_cond, &writer_lock, &ts);
+        }
+        stop = writer_stop;
+        pthread_mutex_unlock(&writer_lock);
+
+        unsigned long n = drain(buf);
+        if (n>0) {
+            fdatasync(cdr_fd);
+            written += n;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Start recording calls to a file.
+ */
+int cdr_open(const char *path) {
+    if ((cdr_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644))<0) {
+        return -1;
+    }
+    pthread_key_create(&ring_key, ring_release);
+    Pthread_create(&writer_tid, NULL, writer_thread, NULL);
+    __atomic_store_n(&cdr_on, 1, __ATOMIC_RELEASE);
+    debug("Recording calls to %s", path);
+    return 0;
+}
+
+int cdr_enabled(void) {
+    return __atomic_load_n(&cdr_on, __ATOMIC_RELAXED);
+}
+
+uint64_t cdr_new_call_id(void) {
+    return __atomic_fetch_add(&next_call_id, 1, __ATOMIC_RELAXED);
+}
+
+int64_t cdr_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Push a record into the calling thread's ring.
+ */
+void cdr_log(const CDR_RECORD *rec) {
+    if (!cdr_enabled()) {
+        return;
+    }
+    CDR_RING *ring = my_ring;
+    if (ring==NULL && (ring = my_ring = ring_create())==NULL) {
+        return;
+    }
+    unsigned int tail = ring->tail;
+    if (tail-__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)==CDR_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped+1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring->recs[tail%CDR_RING_SIZE] = *rec;
+    __atomic_store_n(&ring->tail, tail+1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write out all pending records, sync the file and stop recording.
+ * Calls that end afterwards are not recorded.
+ */
+void cdr_close(void) {
+    if (!cdr_enabled()) {
+        return;
+    }
+    __atomic_store_n(&cdr_on, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&writer_lock);
+    writer_stop = 1;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_lock);
+    //the writer drains once more after seeing the stop flag
+    Pthread_join(writer_tid, NULL);
+    for (CDR_RING *ring = rings; ring!=NULL; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    debug("Wrote %lu call detail records, dropped %lu", written, dropped);
+    Close(cdr_fd);
+    cdr_fd = -1;
+}
@@ -0,0 +1,143 @@
+/*
+ * Conference bridges: one line delivered to many members.
+ */
+#include <stdlib.h>
+
+#include "conf.h"
+#include "pbx.h"
+#include "pool.h"
+#include "debug.h"
+#include "csapp.h"
+
+//members whose queues a line is collected for on the stack; more need malloc()
+#define CONF_FANOUT_STACK 64
+
+typedef struct conf_member {
+    OUTQ *q;
+    struct conf_member *prev;
+    struct conf_member *next;
+} CONF_MEMBER;
+
+typedef struct conf {
+    pthread_mutex_t lock;
+    int ext;
+    int count;
+    int limit;
+    CONF_MEMBER *members;
+    CONF_RELAY relay;
+    void *relay_arg;
+} CONF;
+
+static POOL member_pool = POOL_INITIALIZER("conf_member", sizeof(CONF_MEMBER), sizeof(void *));
+
+CONF *conf_new(int ext, int limit, CONF_RELAY relay, void *arg) {
+    CONF *conf = calloc(1, sizeof(CONF));
+    if (conf==NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&conf->lock, NULL);
+    conf->ext = ext;
+    conf->limit = limit;
+    conf->relay = relay;
+    conf->relay_arg = arg;
+    return conf;
+}
+
+void conf_free(CONF *conf) {
+    pthread_mutex_destroy(&conf->lock);
+    free(conf);
+}
+
+int conf_extension(CONF *conf) {
+    return conf->ext;
+}
+
+CONF_MEMBER *conf_join(CONF *conf, OUTQ *q) {
+    CONF_MEMBER *m = pool_alloc(&member_pool);
+    if (m==NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&conf->lock);
+    if (conf->limit>0 && conf->count>=conf->limit) {
+        pthread_mutex_unlock(&conf->lock);
+        pool_free(&member_pool, m);
+        errno = EBUSY;
+        return NULL;
+    }
+    m->q = outq_ref(q);
+    m->prev = NULL;
+    m->next = conf->members;
+    if (m->next!=NULL) {
+        m->next->prev = m;
+    }
+    conf->members = m;
+    conf->count++;
+    pthread_mutex_unlock(&conf->lock);
+    debug("Member joined bridge %d (%d members)", conf->ext, conf->count);
+    return m;
+}
+
+void conf_leave(CONF *conf, CONF_MEMBER *m) {
+    pthread_mutex_lock(&conf->lock);
+    if (m->prev!=NULL) {
+        m->prev->next = m->next;
+    }
+    else {
+        conf->members = m->next;
+    }
+    if (m->next!=NULL) {
+        m->next->prev = m->prev;
+    }
+    conf->count--;
+    pthread_mutex_unlock(&conf->lock);
+    outq_unref(m->q);
+    pool_free(&member_pool, m);
+}
+
+/*
+ * Queue one shared copy of a line on every other member, then have the
+ * queues flushed.  The flushing is left until the bridge is unlocked, so
+ * that no system call is made while members are kept from joining or
+ * leaving, or other lines from being sent.
+ */
+int conf_chat(CONF *conf, CONF_MEMBER *from, const char *text, size_t len,
+              void (*flush)(OUTQ *q)) {
+    if (conf->relay!=NULL) {
+        return conf->relay(conf->relay_arg, text, len);
+    }
+    struct iovec iov[3] = {
+        { "CHAT ", 5 },
+        { (void *)text, len },
+        { EOL, 2 }
+    };
+    OUTQ_MSG *msg = outq_msg_new(iov, 3);
+    if (msg==NULL) {
+        return -1;
+    }
+    OUTQ *stackq[CONF_FANOUT_STACK];
+    OUTQ **queues = stackq;
+    int n = 0;
+    pthread_mutex_lock(&conf->lock);
+    if (conf->count>CONF_FANOUT_STACK &&
+        (queues = malloc(conf->count*sizeof(OUTQ *)))==NULL) {
+        pthread_mutex_unlock(&conf->lock);
+        outq_msg_unref(msg);
+        return -1;
+    }
+    for (CONF_MEMBER *m = conf->members; m!=NULL; m = m->next) {
+        if (m!=from && outq_append_msg(m->q, msg)==0) {
+            queues[n++] = outq_ref(m->q);
+        }
+    }
+    pthread_mutex_unlock(&conf->lock);
+    //the queues now hold the line between them
+    outq_msg_unref(msg);
+    for (int i=0;i<n;i++) {
+        flush(queues[i]);
+    }
+    if (queues!=stackq) {
+        free(queues);
+    }
+    return n;
+}
@@ -0,0 +1,62 @@
+/*
+ * Fmutex: futex-based mutex, following "Futexes Are Tricky" (Drepper), mutex 2.
+ */
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "fmutex.h"
+
+//attempts to take a held lock before sleeping, in case it is held only briefly
+#define FMUTEX_SPIN 100
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void futex_wait(int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void fmutex_init(FMUTEX *m) {
+    m->state = 0;
+}
+
+int fmutex_trylock(FMUTEX *m) {
+    int c = 0;
+    return __atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+void fmutex_lock(FMUTEX *m) {
+    int c = 0;
+    if (__atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    for (int i=0;i<FMUTEX_SPIN && c==1;i++) {
+        cpu_relax();
+        c = 0;
+        if (__atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+    //mark the lock as contended, so that the holder wakes us when it unlocks
+    if (c!=2) {
+        c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c!=0) {
+        futex_wait(&m->state, 2);
+        c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void fmutex_unlock(FMUTEX *m) {
+    if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE)==2) {
+        futex_wake(&m->state);
+    }
+}
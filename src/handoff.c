@@ -0,0 +1,571 @@
+/*
+ * Handoff: passing the listener and client connections to a new server.
+ */
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/un.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+#include "reactor.h"
+#include "handoff.h"
+#include "debug.h"
+#include "csapp.h"
+
+//how long each server waits for the reply of the other
+#define HANDOFF_REPLY_TIMEOUT_MS 5000
+//how often the accept loop is interrupted until it notices a request
+#define HANDOFF_KICK_MS 10
+
+//what the old server collects from the paused reactor
+typedef struct handoff_state {
+    char *buf;
+    size_t len;
+    size_t cap;
+    TU **tus;
+    int *fds;
+    int count;
+    int max;
+    int failed;
+} HANDOFF_STATE;
+
+static int listen_fd = -1;
+static pthread_t main_tid;
+
+//connection of a new server waiting to take over, or -1
+static int request_fd = -1;
+//the accept loop has stopped for the request, see handoff_send()
+static int request_taken;
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+
+static void kick_handler(int sig) {
+    //only here to interrupt accept()
+}
+
+static void *handoff_thread(void *arg) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd<0) {
+            if (errno==EINTR || errno==ECONNABORTED) {
+                continue;
+            }
+            debug("Handoff socket failed: %s", strerror(errno));
+            return NULL;
+        }
+        debug("New server asks to take over");
+        pthread_mutex_lock(&request_lock);
+        __atomic_store_n(&request_fd, fd, __ATOMIC_SEQ_CST);
+        //the signal is lost if the accept loop is just about to call accept(),
+        //so keep sending it until the request has been taken up
+        while (request_fd>=0 && !request_taken) {
+            pthread_kill(main_tid, SIGUSR1);
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += HANDOFF_KICK_MS*1000000L;
+            if (ts.tv_nsec>=1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&request_cond, &request_lock, &ts);
+        }
+        while (request_fd>=0) {
+            pthread_cond_wait(&request_cond, &request_lock);
+        }
+        pthread_mutex_unlock(&request_lock);
+    }
+}
+
+static int unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path)>=sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (unix_address(path, &addr)<0) {
+        return -1;
+    }
+    if ((listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0))<0) {
+        return -1;
+    }
+    //left behind by the server this one took over from, or by a crash
+    unlink(path);
+    if (bind(listen_fd, (SA *)&addr, sizeof(addr))<0 || listen(listen_fd, 1)<0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    struct sigaction action;
+    action.sa_handler = kick_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0; //no SA_RESTART, so that accept() fails with EINTR
+    if (sigaction(SIGUSR1, &action, NULL)<0) {
+        unix_error("Signal error");
+    }
+    main_tid = pthread_self();
+    pthread_t tid;
+    Pthread_create(&tid, NULL, handoff_thread, NULL);
+    Pthread_detach(tid);
+    debug("Accepting handoff requests on %s", path);
+    return 0;
+}
+
+int handoff_requested(void) {
+    return __atomic_load_n(&request_fd, __ATOMIC_SEQ_CST)>=0;
+}
+
+//room for the descriptors of one message, aligned for a cmsghdr
+typedef union control {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(HANDOFF_FDS_PER_MSG*sizeof(int))];
+} CONTROL;
+
+//send a message with descriptors attached
+static int send_fds(int sock, const void *data, size_t len, const int *fds, int nfds) {
+    CONTROL control;
+    struct iovec iov = { (void *)data, len };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds>0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds*sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n<0 && errno==EINTR);
+    return n==(ssize_t)len ? 0 : -1;
+}
+
+//receive a message of exactly len bytes with up to max descriptors attached
+//return the number of descriptors, or -1
+static int recv_fds(int sock, void *data, size_t len, int *fds, int max) {
+    CONTROL control;
+    struct iovec iov = { data, len };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n<0 && errno==EINTR);
+    if (n<0) {
+        return -1;
+    }
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg!=NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_RIGHTS) {
+            int got = (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+            int *in = (int *)CMSG_DATA(cmsg);
+            for (int i=0;i<got;i++) {
+                if (nfds<max) {
+                    fds[nfds++] = in[i];
+                }
+                else {
+                    close(in[i]);
+                }
+            }
+        }
+    }
+    if (n!=(ssize_t)len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        for (int i=0;i<nfds;i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return nfds;
+}
+
+//set a deadline some milliseconds from now, on the monotonic clock
+static void deadline_after(struct timespec *deadline, long ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms/1000;
+    deadline->tv_nsec += ms%1000*1000000L;
+    if (deadline->tv_nsec>=1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static int send_reply(int sock, char reply) {
+    ssize_t n;
+    do {
+        n = send(sock, &reply, 1, MSG_NOSIGNAL);
+    } while (n<0 && errno==EINTR);
+    return n==1 ? 0 : -1;
+}
+
+//wait until a deadline for the one byte reply of the other server, however
+//often signals interrupt the wait
+//return 0 if it is the expected reply, otherwise -1
+static int recv_reply(int sock, char expected, const struct timespec *deadline) {
+    while (1) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (deadline->tv_sec-now.tv_sec)*1000 + (deadline->tv_nsec-now.tv_nsec)/1000000;
+        if (ms<=0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        int n = poll(&pfd, 1, ms);
+        if (n<0 && errno!=EINTR) {
+            return -1;
+        }
+        if (n<=0) {
+            continue;
+        }
+        char reply;
+        ssize_t got = recv(sock, &reply, 1, MSG_DONTWAIT);
+        if (got<0 && (errno==EINTR || errno==EAGAIN)) {
+            continue;
+        }
+        if (got!=1 || reply!=expected) {
+            errno = EPROTO;
+            return -1;
+        }
+        return 0;
+    }
+}
+
+static int state_append(HANDOFF_STATE *st, const void *data, size_t len) {
+    if (len==0) {
+        return 0;
+    }
+    if (st->len+len>st->cap) {
+        size_t cap = st->cap ? st->cap : HANDOFF_CHUNK;
+        while (cap<st->len+len) {
+            cap *= 2;
+        }
+        char *buf = realloc(st->buf, cap);
+        if (buf==NULL) {
+            return -1;
+        }
+        st->buf = buf;
+        st->cap = cap;
+    }
+    memcpy(st->buf+st->len, data, len);
+    st->len += len;
+    return 0;
+}
+
+//add a connection to the state, called for each one by reactor_foreach()
+static void collect(TU *tu, const char *pending, int len, void *arg) {
+    HANDOFF_STATE *st = arg;
+    if (st->failed) {
+        return;
+    }
+    if (st->count==st->max) {
+        int max = st->max ? 2*st->max : 256;
+        TU **tus = realloc(st->tus, max*sizeof(TU *));
+        int *fds = tus!=NULL ? realloc(st->fds, max*sizeof(int)) : NULL;
+        if (tus!=NULL) {
+            st->tus = tus;
+        }
+        if (fds==NULL) {
+            st->failed = 1;
+            return;
+        }
+        st->fds = fds;
+        st->max = max;
+    }
+    HANDOFF_RECORD rec = {0};
+    char *out;
+    size_t outlen;
+    if (tu_snapshot(tu, &rec.tu, &out, &outlen)<0) {
+        st->failed = 1;
+        return;
+    }
+    st->tus[st->count] = tu;
+    st->fds[st->count] = tu_fileno(tu);
+    st->count++;
+    rec.pending_len = len;
+    rec.out_len = outlen;
+    if (state_append(st, &rec, sizeof(rec))<0 || state_append(st, pending, len)<0 ||
+        state_append(st, out, outlen)<0) {
+        st->failed = 1;
+    }
+    free(out);
+}
+
+static int send_state(int sock, int listenfd, HANDOFF_STATE *st) {
+    HANDOFF_HEADER hdr = {
+        .magic = HANDOFF_MAGIC,
+        .version = HANDOFF_VERSION,
+        .count = st->count,
+        .state_len = st->len
+    };
+    if (send_fds(sock, &hdr, sizeof(hdr), &listenfd, 1)<0) {
+        return -1;
+    }
+    for (int i=0;i<st->count;i+=HANDOFF_FDS_PER_MSG) {
+        uint32_t n = st->count-i<HANDOFF_FDS_PER_MSG ? st->count-i : HANDOFF_FDS_PER_MSG;
+        if (send_fds(sock, &n, sizeof(n), st->fds+i, n)<0) {
+            return -1;
+        }
+    }
+    for (size_t off=0;off<st->len;off+=HANDOFF_CHUNK) {
+        size_t n = st->len-off<HANDOFF_CHUNK ? st->len-off : HANDOFF_CHUNK;
+        if (send_fds(sock, st->buf+off, n, NULL, 0)<0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int handoff_send(int listenfd) {
+    int sock = __atomic_load_n(&request_fd, __ATOMIC_SEQ_CST);
+    struct timespec start, end, deadline;
+    //accepting has stopped, so the handoff thread can stop interrupting it
+    pthread_mutex_lock(&request_lock);
+    request_taken = 1;
+    pthread_cond_signal(&request_cond);
+    pthread_mutex_unlock(&request_lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    reactor_pause();
+
+    HANDOFF_STATE st = {0};
+    reactor_foreach(collect, &st);
+    int ret = st.failed ? -1 : send_state(sock, listenfd, &st);
+    if (ret==0) {
+        //once the commit is out, the connections are the new server's
+        deadline_after(&deadline, HANDOFF_REPLY_TIMEOUT_MS);
+        if (recv_reply(sock, HANDOFF_READY, &deadline)<0 ||
+            send_reply(sock, HANDOFF_COMMIT)<0) {
+            ret = -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (ret<0) {
+        debug("Handoff failed, resuming service");
+        for (int i=0;i<st.count;i++) {
+            tu_resume_output(st.tus[i]);
+        }
+        reactor_resume();
+    }
+    else {
+        debug("Handed over %d connections in %ld us", st.count,
+              (end.tv_sec-start.tv_sec)*1000000 + (end.tv_nsec-start.tv_nsec)/1000);
+    }
+    free(st.buf);
+    free(st.tus);
+    free(st.fds);
+    close(sock);
+
+    pthread_mutex_lock(&request_lock);
+    __atomic_store_n(&request_fd, -1, __ATOMIC_SEQ_CST);
+    request_taken = 0;
+    pthread_cond_signal(&request_cond);
+    pthread_mutex_unlock(&request_lock);
+    return ret;
+}
+
+//index of a record by extension, for pairing peers
+typedef struct ext_index {
+    int ext;
+    int idx;
+} EXT_INDEX;
+
+static int ext_compare(const void *a, const void *b) {
+    int x = ((const EXT_INDEX *)a)->ext, y = ((const EXT_INDEX *)b)->ext;
+    return x<y ? -1 : x>y;
+}
+
+//find the record of an extension, return its index or -1
+static int ext_find(EXT_INDEX *index, int count, int ext) {
+    EXT_INDEX key = { ext, 0 };
+    EXT_INDEX *found = bsearch(&key, index, count, sizeof(EXT_INDEX), ext_compare);
+    return found!=NULL ? found->idx : -1;
+}
+
+/*
+ * Rebuild the TUs from the state, with their output held back, and tell the
+ * old server.  Once it confirms that it has given the connections up, they
+ * are given to the reactor; otherwise the TUs are unregistered again, which
+ * sends nothing to the clients.  Every descriptor is either taken over by a
+ * TU or closed.
+ */
+static int restore(int sock, int *fds, int count, char *buf, size_t len) {
+    //records are copied out, as they are not aligned within the state
+    HANDOFF_RECORD *recs = Calloc(count ? count : 1, sizeof(HANDOFF_RECORD));
+    char **data = Calloc(count ? count : 1, sizeof(char *));
+    TU **tus = Calloc(count ? count : 1, sizeof(TU *));
+    EXT_INDEX *index = Calloc(count ? count : 1, sizeof(EXT_INDEX));
+    int ret = 0, restored = 0;
+
+    size_t off = 0;
+    for (int i=0;i<count;i++) {
+        if (len-off<sizeof(HANDOFF_RECORD)) {
+            ret = -1;
+            break;
+        }
+        memcpy(&recs[i], buf+off, sizeof(HANDOFF_RECORD));
+        off += sizeof(HANDOFF_RECORD);
+        if (len-off<(size_t)recs[i].pending_len+recs[i].out_len) {
+            ret = -1;
+            break;
+        }
+        data[i] = buf+off;
+        index[i].ext = recs[i].tu.ext;
+        index[i].idx = i;
+        off += recs[i].pending_len+recs[i].out_len;
+    }
+    if (ret<0) {
+        for (int i=0;i<count;i++) {
+            close(fds[i]);
+        }
+        goto out;
+    }
+    qsort(index, count, sizeof(EXT_INDEX), ext_compare);
+
+    for (int i=0;i<count;i++) {
+        if ((tus[i] = tu_init(fds[i]))==NULL) {
+            close(fds[i]);
+            continue;
+        }
+        //the old server may still be the one serving the client
+        tu_hold_output(tus[i]);
+        if (pbx_restore(pbx, tus[i], recs[i].tu.ext)<0) {
+            //never registered, so nobody else can hold a reference; this frees it
+            tu_ref(tus[i], "Discarding unrestored TU");
+            tu_unref(tus[i], "Discarding unrestored TU");
+            tus[i] = NULL;
+        }
+    }
+    for (int i=0;i<count;i++) {
+        if (tus[i]==NULL) {
+            continue;
+        }
+        HANDOFF_RECORD *rec = &recs[i];
+        //only a pairing that both parties agree on is restored
+        int p = rec->tu.peer_ext>=0 ? ext_find(index, count, rec->tu.peer_ext) : -1;
+        TU *peer = p>=0 && tus[p]!=NULL && recs[p].tu.peer_ext==rec->tu.ext ? tus[p] : NULL;
+        CONF *conf = peer==NULL && rec->tu.peer_ext>=0 ? pbx_bridge(pbx, rec->tu.peer_ext) : NULL;
+        if (tu_restore(tus[i], &rec->tu, peer, conf, data[i]+rec->pending_len, rec->out_len)<0) {
+            debug("Failed to restore the output of extension %d", rec->tu.ext);
+        }
+    }
+
+    struct timespec deadline;
+    deadline_after(&deadline, HANDOFF_REPLY_TIMEOUT_MS);
+    if (send_reply(sock, HANDOFF_READY)<0 || recv_reply(sock, HANDOFF_COMMIT, &deadline)<0) {
+        debug("Old server did not give the connections up: %s", strerror(errno));
+        for (int i=0;i<count;i++) {
+            if (tus[i]!=NULL) {
+                pbx_unregister(pbx, tus[i]);
+            }
+        }
+        ret = -1;
+        goto out;
+    }
+    for (int i=0;i<count;i++) {
+        if (tus[i]==NULL) {
+            continue;
+        }
+        if (reactor_adopt(tus[i], data[i], recs[i].pending_len)<0) {
+            pbx_unregister(pbx, tus[i]);
+            continue;
+        }
+        tu_resume_output(tus[i]);
+        restored++;
+    }
+    debug("Took over %d of %d connections", restored, count);
+out:
+    free(recs);
+    free(data);
+    free(tus);
+    free(index);
+    return ret;
+}
+
+int handoff_receive(const char *path, int *listenfd) {
+    struct sockaddr_un addr;
+    if (unix_address(path, &addr)<0) {
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock<0) {
+        return -1;
+    }
+    if (connect(sock, (SA *)&addr, sizeof(addr))<0) {
+        close(sock);
+        return -1;
+    }
+    HANDOFF_HEADER hdr;
+    int lfd = -1;
+    int n = recv_fds(sock, &hdr, sizeof(hdr), &lfd, 1);
+    if (n!=1 || hdr.magic!=HANDOFF_MAGIC || hdr.version!=HANDOFF_VERSION) {
+        if (n==1) {
+            close(lfd);
+        }
+        close(sock);
+        errno = EPROTO;
+        return -1;
+    }
+    int *fds = Malloc((hdr.count ? hdr.count : 1)*sizeof(int));
+    char *buf = Malloc(hdr.state_len ? hdr.state_len : 1);
+    uint32_t got = 0;
+    int ret = 0;
+    while (got<hdr.count) {
+        uint32_t batch;
+        int max = hdr.count-got<HANDOFF_FDS_PER_MSG ? hdr.count-got : HANDOFF_FDS_PER_MSG;
+        n = recv_fds(sock, &batch, sizeof(batch), fds+got, max);
+        if (n>0) {
+            got += n;
+        }
+        if (n<=0 || (uint32_t)n!=batch) {
+            ret = -1;
+            break;
+        }
+    }
+    for (uint64_t off=0;ret==0 && off<hdr.state_len;) {
+        size_t want = hdr.state_len-off<HANDOFF_CHUNK ? hdr.state_len-off : HANDOFF_CHUNK;
+        if (recv_fds(sock, buf+off, want, NULL, 0)<0) {
+            ret = -1;
+        }
+        off += want;
+    }
+    if (ret<0) {
+        for (uint32_t i=0;i<got;i++) {
+            close(fds[i]);
+        }
+        close(lfd);
+        errno = EPROTO;
+    }
+    else if ((ret = restore(sock, fds, hdr.count, buf, hdr.state_len))==0) {
+        *listenfd = lfd;
+    }
+    else {
+        int err = errno;
+        close(lfd);
+        errno = err==ETIMEDOUT ? err : EPROTO;
+    }
+    free(fds);
+    free(buf);
+    close(sock);
+    return ret;
+}
@@ -0,0 +1,137 @@
+/*
+ * Hunt groups: idle agents and waiting callers, matched in constant time.
+ */
+#include <stdlib.h>
+
+#include "hunt.h"
+#include "debug.h"
+#include "csapp.h"
+
+typedef struct hunt {
+    pthread_mutex_t lock;
+    int ext;
+    int nagents;
+    int *agents; //sorted
+    //circular lists around a sentinel, oldest entry first
+    HUNT_LINK idle;
+    HUNT_LINK queue;
+} HUNT;
+
+static void link_init(HUNT_LINK *head) {
+    head->prev = head->next = head;
+}
+
+static int list_empty(HUNT_LINK *head) {
+    return head->next==head;
+}
+
+static void list_push(HUNT_LINK *head, HUNT_LINK *l, int front) {
+    HUNT_LINK *prev = front ? head : head->prev;
+    l->prev = prev;
+    l->next = prev->next;
+    prev->next->prev = l;
+    prev->next = l;
+    l->listed = 1;
+}
+
+static void list_remove(HUNT_LINK *l) {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    l->prev = l->next = NULL;
+    l->listed = 0;
+}
+
+static HUNT_LINK *list_pop(HUNT_LINK *head) {
+    HUNT_LINK *l = head->next;
+    list_remove(l);
+    return l;
+}
+
+static int ext_compare(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x<y ? -1 : x>y;
+}
+
+HUNT *hunt_new(int ext, const int *agents, int nagents) {
+    HUNT *hunt = calloc(1, sizeof(HUNT));
+    if (hunt==NULL) {
+        return NULL;
+    }
+    if ((hunt->agents = malloc((nagents>0 ? nagents : 1)*sizeof(int)))==NULL) {
+        free(hunt);
+        return NULL;
+    }
+    memcpy(hunt->agents, agents, nagents*sizeof(int));
+    qsort(hunt->agents, nagents, sizeof(int), ext_compare);
+    hunt->nagents = nagents;
+    hunt->ext = ext;
+    pthread_mutex_init(&hunt->lock, NULL);
+    link_init(&hunt->idle);
+    link_init(&hunt->queue);
+    return hunt;
+}
+
+void hunt_free(HUNT *hunt) {
+    pthread_mutex_destroy(&hunt->lock);
+    free(hunt->agents);
+    free(hunt);
+}
+
+int hunt_extension(HUNT *hunt) {
+    return hunt->ext;
+}
+
+int hunt_is_agent(HUNT *hunt, int ext) {
+    return bsearch(&ext, hunt->agents, hunt->nagents, sizeof(int), ext_compare)!=NULL;
+}
+
+TU *hunt_agent_idle(HUNT *hunt, HUNT_LINK *agent) {
+    TU *caller = NULL;
+    pthread_mutex_lock(&hunt->lock);
+    if (!list_empty(&hunt->queue)) {
+        caller = list_pop(&hunt->queue)->tu;
+    }
+    else if (!agent->listed) {
+        list_push(&hunt->idle, agent, 0);
+    }
+    pthread_mutex_unlock(&hunt->lock);
+    return caller;
+}
+
+void hunt_agent_busy(HUNT *hunt, HUNT_LINK *agent) {
+    pthread_mutex_lock(&hunt->lock);
+    if (agent->listed) {
+        list_remove(agent);
+    }
+    pthread_mutex_unlock(&hunt->lock);
+}
+
+TU *hunt_caller_wait(HUNT *hunt, HUNT_LINK *caller, int front) {
+    TU *agent = NULL;
+    pthread_mutex_lock(&hunt->lock);
+    if (caller->listed) {
+        //already waiting again, after a stale match
+    }
+    else if (!list_empty(&hunt->idle)) {
+        agent = list_pop(&hunt->idle)->tu;
+        //an agent leaves the group only after taking itself off the list,
+        //which it can't do while the list is locked
+        tu_ref(agent, "Taken from idle list");
+    }
+    else {
+        tu_ref(caller->tu, "Queued for hunt group");
+        list_push(&hunt->queue, caller, front);
+    }
+    pthread_mutex_unlock(&hunt->lock);
+    return agent;
+}
+
+int hunt_caller_cancel(HUNT *hunt, HUNT_LINK *caller) {
+    int queued;
+    pthread_mutex_lock(&hunt->lock);
+    if ((queued = caller->listed)) {
+        list_remove(caller);
+    }
+    pthread_mutex_unlock(&hunt->lock);
+    return queued;
+}
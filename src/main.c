@@ -1,24 +1,90 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
 
 #include "pbx.h"
+#include "pbx_ext.h"
 #include "server.h"
+#include "reactor.h"
+#include "workers.h"
+#include "service.h"
+#include "cdr.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "outq.h"
 #include "debug.h"
 #include "csapp.h"
 
 volatile sig_atomic_t sighup_called = 0;
 
 static void terminate(int status);
+static int open_listener(char *port, int reuseport);
+static int accept_loop(int listenfd);
+static void serve_sharded(char *port, int n);
+static int add_hunt_group(char *spec);
+
+//number of reactor loop threads, 0 for a thread per connection
+static int nloops = 0;
+//number of worker threads executing commands, 0 to execute them where they are read
+static int nworkers = 0;
+//how long to wait for clients to disconnect on shutdown
+static long drain_ms = PBX_DRAIN_TIMEOUT_MS;
+
+//back-off between accept() retries when out of descriptors or memory
+#define ACCEPT_BACKOFF_MIN_MS 10
+#define ACCEPT_BACKOFF_MAX_MS 1000
 
 void sighup_handler(int sig) {
     //don't call termiante in handler
     sighup_called = 1;
 }
 
+static void usage(void) {
+    fprintf(stderr,"Usage: bin/pbx -p <port> [-e <loops>] [-w <workers>] [-a <listeners>]\n"
+                   "           [-q <bytes>] [-Q drop|disconnect] [-c <file>] [-m <port>]\n"
+                   "           [-d <ms>] [-H <path>] [-R <path>] [-u] [-b <ext>]...\n"
+                   "           [-P <ext>] [-G <ext>:<agent>[,<agent>]...]...\n");
+    exit(EXIT_SUCCESS);
+}
+
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-e <loops>] [-w <workers>] [-a <listeners>] [-q <bytes>]
+ *            [-Q drop|disconnect] [-c <file>] [-m <port>] [-d <ms>]
+ *            [-H <path>] [-R <path>] [-u] [-b <ext>]... [-P <ext>]
+ *            [-G <ext>:<agent>[,<agent>]...]...
+ *
+ *   -e <loops>  Serve clients from <loops> epoll event loop threads instead
+ *               of starting one thread per connection.
+ *   -w <workers>  Execute client commands on a pool of <workers> threads, with
+ *               the loop threads only reading from the sockets.  Implies -e 1
+ *               unless -e is given.
+ *   -a <listeners>  Accept connections on <listeners> SO_REUSEPORT sockets,
+ *               each with its own accept thread (0 for one per CPU).
+ *   -q <bytes>  Limit on the output queued for a client that is not keeping up.
+ *   -Q <policy>  What to do with a client that exceeds the limit: drop the
+ *               message ("drop", the default) or disconnect the client.
+ *   -c <file>   Append a call detail record for every call to <file>.
+ *   -m <port>   Serve metrics in the Prometheus text format on <port>.
+ *   -d <ms>     On SIGHUP, wait at most <ms> milliseconds for clients to be
+ *               disconnected before exiting (default 5000).
+ *   -H <path>   Hand the server over to a new one that asks on the Unix
+ *               socket <path>, then exit.  Implies -e 1 unless -e is given.
+ *   -R <path>   Take over from the server that accepts handoffs on <path>,
+ *               instead of listening on a port (-p is then not needed).
+ *               Implies -e 1 unless -e is given.
+ *   -u          Do the I/O of the reactor with io_uring rather than epoll, if
+ *               the kernel supports it.  Implies -e 1 unless -e is given.
+ *   -b <ext>    Provide a conference bridge at extension <ext>: clients that
+ *               dial it are all connected together, and the chat of each goes
+ *               to the others.  May be given several times.
+ *   -P <ext>    Provide a paging extension at <ext>: the one client at a
+ *               time that is connected to it pages every client on hook
+ *               with each of its chat lines.
+ *   -G <ext>:<agent>,...  Provide a hunt group at <ext>, whose calls go to
+ *               the agent extension that has been idle longest, or wait in
+ *               a queue until one goes on hook.  May be given several times.
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
@@ -26,16 +92,184 @@ int main(int argc, char* argv[]){
     // on which the server should listen.
 
 
-    int c = getopt(argc,argv,"p:");
-    if (c!='p') {
-        fprintf(stderr,"Usage: bin/pbx -p <port>\n");
-        exit(EXIT_SUCCESS);
+    char *port = NULL;
+    int nlisteners = -1;
+    long qlimit = OUTQ_DEFAULT_LIMIT;
+    OUTQ_POLICY qpolicy = OUTQ_DROP;
+    char *cdr_path = NULL;
+    char *metrics_port = NULL;
+    char *handoff_path = NULL;
+    char *restore_path = NULL;
+    REACTOR_BACKEND backend = REACTOR_EPOLL;
+    int bridges[PBX_MAX_BRIDGES];
+    int nbridges = 0;
+    int paging = -1;
+    char *hunts[PBX_MAX_HUNTS];
+    int nhunts = 0;
+    char *end;
+    int c;
+    while ((c = getopt(argc,argv,"p:e:w:a:q:Q:c:m:d:H:R:ub:P:G:"))!=-1) {
+        switch (c) {
+            case 'p':
+                port = optarg;
+                break;
+            case 'e':
+                nloops = atoi(optarg);
+                if (nloops<1) {
+                    usage();
+                }
+                break;
+            case 'w':
+                nworkers = atoi(optarg);
+                if (nworkers<1) {
+                    usage();
+                }
+                break;
+            case 'a':
+                nlisteners = atoi(optarg);
+                if (nlisteners<0) {
+                    usage();
+                }
+                break;
+            case 'q':
+                qlimit = atol(optarg);
+                if (qlimit<1) {
+                    usage();
+                }
+                break;
+            case 'Q':
+                if (strcmp(optarg,"drop")==0) {
+                    qpolicy = OUTQ_DROP;
+                }
+                else if (strcmp(optarg,"disconnect")==0) {
+                    qpolicy = OUTQ_DISCONNECT;
+                }
+                else {
+                    usage();
+                }
+                break;
+            case 'c':
+                cdr_path = optarg;
+                break;
+            case 'm':
+                metrics_port = optarg;
+                break;
+            case 'd':
+                errno = 0;
+                drain_ms = strtol(optarg,&end,10);
+                if (end==optarg || *end!='\0' || errno==ERANGE || drain_ms<0) {
+                    usage();
+                }
+                break;
+            case 'H':
+                handoff_path = optarg;
+                break;
+            case 'R':
+                restore_path = optarg;
+                break;
+            case 'u':
+                backend = REACTOR_URING;
+                break;
+            case 'b':
+                if (nbridges==PBX_MAX_BRIDGES) {
+                    usage();
+                }
+                bridges[nbridges++] = atoi(optarg);
+                break;
+            case 'G':
+                if (nhunts==PBX_MAX_HUNTS) {
+                    usage();
+                }
+                hunts[nhunts++] = optarg;
+                break;
+            case 'P':
+                paging = atoi(optarg);
+                if (paging<PBX_FIRST_EXTENSION) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (port==NULL && restore_path==NULL) {
+        usage();
+    }
+    if (handoff_path!=NULL || restore_path!=NULL) {
+        //only the reactor can hand connections over, through a single listener
+        if (nlisteners>=0) {
+            usage();
+        }
+        if (nloops==0) {
+            nloops = 1;
+        }
+    }
+    if (backend==REACTOR_URING) {
+        //the connections of a paused io_uring loop are not quiet enough to hand over
+        if (handoff_path!=NULL || restore_path!=NULL) {
+            usage();
+        }
+        if (nloops==0) {
+            nloops = 1;
+        }
     }
     
     
     // Perform required initialization of the PBX module.
     debug("Initializing PBX...");
+    outq_configure(qlimit, qpolicy);
+    if (cdr_path!=NULL && cdr_open(cdr_path)<0) {
+        fprintf(stderr,"Failed to open %s: %s\n",cdr_path,strerror(errno));
+        exit(EXIT_FAILURE);
+    }
     pbx = pbx_init();
+    //ahead of any registration, restored ones included
+    for (int i=0;i<nbridges;i++) {
+        if (pbx_add_bridge(pbx,bridges[i])<0) {
+            fprintf(stderr,"Invalid bridge extension %d\n",bridges[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (paging>=0 && pbx_add_paging(pbx,paging)<0) {
+        fprintf(stderr,"Invalid paging extension %d\n",paging);
+        exit(EXIT_FAILURE);
+    }
+    for (int i=0;i<nhunts;i++) {
+        if (add_hunt_group(hunts[i])<0) {
+            fprintf(stderr,"Invalid hunt group %s\n",hunts[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (nworkers>0) {
+        //the pool is fed by the reactor
+        if (nloops==0) {
+            nloops = 1;
+        }
+        if (workers_init(nworkers)<0) {
+            fprintf(stderr,"Failed to start worker pool\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (nloops>0) {
+        int ret = reactor_init(nloops, backend);
+        if (ret<0) {
+            fprintf(stderr,"Failed to start reactor\n");
+            exit(EXIT_FAILURE);
+        }
+        if ((REACTOR_BACKEND)ret!=backend) {
+            fprintf(stderr,"io_uring is not available, using epoll\n");
+        }
+    }
+    int listenfd = -1;
+    if (restore_path!=NULL && handoff_receive(restore_path, &listenfd)<0) {
+        fprintf(stderr,"Failed to take over from %s: %s\n",restore_path,strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    //after taking over, as the old server only gives the port up then
+    if (metrics_port!=NULL && metrics_serve(metrics_port)<0) {
+        fprintf(stderr,"Failed to serve metrics on port %s\n",metrics_port);
+        exit(EXIT_FAILURE);
+    }
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -62,13 +296,76 @@ int main(int argc, char* argv[]){
     if (sigaction(SIGPIPE, &ignoreaction, NULL) < 0)
 	    unix_error("Signal error");
 
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid; 
+    if (nlisteners>=0) {
+        serve_sharded(port, nlisteners);
+        terminate(EXIT_SUCCESS);
+    }
 
+    if (listenfd<0) {
+        listenfd = open_listener(port, 0);
+    }
+    if (handoff_path!=NULL && handoff_listen(handoff_path)<0) {
+        fprintf(stderr,"Failed to accept handoffs on %s: %s\n",handoff_path,strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    listenfd = Open_listenfd(optarg);
+    //check if error and not eintr caused by interrupted signal
+    int ret;
+    while ((ret = accept_loop(listenfd))==0 && !sighup_called && handoff_requested()) {
+        //the new server serves the metrics once it has taken over
+        metrics_stop();
+        if (handoff_send(listenfd)==0) {
+            //the connections are the new server's now, so they are left alone
+            cdr_close();
+            debug("PBX server handed over");
+            exit(EXIT_SUCCESS);
+        }
+        if (metrics_port!=NULL && metrics_serve(metrics_port)<0) {
+            debug("Failed to serve metrics on port %s again", metrics_port);
+        }
+    }
+    //connections must not queue up while draining
+    Close(listenfd);
+    terminate(ret<0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Add the hunt group given as "<ext>:<agent>,<agent>,..." to the PBX.
+ */
+static int add_hunt_group(char *spec) {
+    char *end;
+    long ext = strtol(spec,&end,10);
+    if (end==spec || *end!=':' || ext<PBX_FIRST_EXTENSION || ext>INT_MAX) {
+        return -1;
+    }
+    int cap = 16, n = 0;
+    int *agents = Malloc(cap*sizeof(int));
+    for (char *p = end+1;;p = end+1) {
+        long agent = strtol(p,&end,10);
+        if (end==p || (*end!=',' && *end!='\0') || agent<PBX_FIRST_EXTENSION || agent>INT_MAX) {
+            free(agents);
+            return -1;
+        }
+        if (n==cap) {
+            cap *= 2;
+            agents = Realloc(agents,cap*sizeof(int));
+        }
+        agents[n++] = agent;
+        if (*end=='\0') {
+            break;
+        }
+    }
+    int ret = pbx_add_hunt(pbx,ext,agents,n);
+    free(agents);
+    return ret;
+}
+
+/*
+ * Open a listening socket on the given port, with keepalive enabled for
+ * the connections accepted on it.
+ */
+static int open_listener(char *port, int reuseport) {
+    int listenfd = reuseport ? Open_listenfd_reuseport(port) : Open_listenfd(port);
     int optval;
     socklen_t optlen = sizeof(optval);
     /* Check the status for the keepalive option */
@@ -90,26 +387,134 @@ int main(int argc, char* argv[]){
         exit(EXIT_FAILURE);
     }
     //printf("SO_KEEPALIVE set on socket\n");
+    return listenfd;
+}
 
-    while(!sighup_called) {
+/*
+ * Accept connections on a listening socket until SIGHUP is received or
+ * accept() fails, handing each connection to the reactor or to a new thread.
+ * Running out of descriptors or memory does not end the loop: accepting is
+ * retried after a back-off, by when some connections may have gone away.
+ *
+ * @return 0 if the loop ended because of SIGHUP or the listener being shut down,
+ * -1 if it ended because of an error.
+ */
+static int accept_loop(int listenfd) {
+    int connfd, *connfdp;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    pthread_t tid; 
+    int err = 0;
+    long backoff_ms = ACCEPT_BACKOFF_MIN_MS;
+
+    while(!sighup_called && !handoff_requested()) {
         clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));                              // line:conc:echoservert:beginmalloc
-        *connfdp = accept(listenfd, (SA *)&clientaddr, &clientlen); // line:conc:echoservert:endmalloc
-        if (*connfdp < 0) {
-            if (errno==EINTR) {
-                free(connfdp);
+        connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno==ECONNABORTED) {
+                continue;
+            }
+            if (errno==EMFILE || errno==ENFILE || errno==ENOBUFS || errno==ENOMEM) {
+                debug("accept: %s, retrying in %ld ms", strerror(errno), backoff_ms);
+                struct timespec ts = { backoff_ms/1000, (backoff_ms%1000)*1000000 };
+                nanosleep(&ts, NULL);
+                if (backoff_ms<ACCEPT_BACKOFF_MAX_MS) {
+                    backoff_ms *= 2;
+                }
+                continue;
             }
+            //errno would be stale by the end if the loop ended for another reason
+            err = errno;
             break;
         }
+        backoff_ms = ACCEPT_BACKOFF_MIN_MS;
+        if (nloops>0) {
+            //the reactor owns the connection from here on
+            reactor_add(connfd);
+            continue;
+        }
+        if ((connfdp = pool_alloc(&service_fd_pool))==NULL) {
+            Close(connfd);
+            continue;
+        }
+        *connfdp = connfd;                                          // line:conc:echoservert:endmalloc
         Pthread_create(&tid, NULL, pbx_client_service, connfdp); 
     }
-    
+    if (err && err!=EINTR && err!=EINVAL) {
+        return -1;
+    }
+    return 0;
+}
 
-    //check if error and not eintr caused by interrupted signal
-    if (errno && errno!= EINTR) {        
-        terminate(EXIT_FAILURE);
+/*
+ * Run the accept loop of one of the SO_REUSEPORT listeners.  If it fails,
+ * the listener is closed, which takes it out of the group so that the
+ * kernel sends its share of the connections to the other listeners.
+ * Whoever swaps the descriptor out of the slot first owns it, so this and
+ * the shutdown on SIGHUP never both get at it.
+ */
+static void *acceptor_thread(void *arg) {
+    int *listenfdp = arg;
+    if (accept_loop(*listenfdp)<0) {
+        int listenfd = __atomic_exchange_n(listenfdp, -1, __ATOMIC_ACQ_REL);
+        if (listenfd>=0) {
+            debug("Closing listener %d: %s", listenfd, strerror(errno));
+            Close(listenfd);
+        }
     }
-    terminate(EXIT_SUCCESS); 
+    return NULL;
+}
+
+/*
+ * Open one SO_REUSEPORT listener per acceptor thread, so that the kernel
+ * spreads incoming connections over them, and wait for SIGHUP.
+ * The acceptor threads run with SIGHUP blocked; once it arrives the
+ * listeners are shut down, which makes their accept() calls fail.
+ *
+ * @param port  The port to listen on.
+ * @param n  The number of listeners, or 0 for one per online CPU.
+ */
+static void serve_sharded(char *port, int n) {
+    if (n==0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n<1) {
+            n = 1;
+        }
+    }
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+
+    int *listenfds = Malloc(n*sizeof(int));
+    pthread_t *tids = Malloc(n*sizeof(pthread_t));
+    for (int i=0;i<n;i++) {
+        listenfds[i] = open_listener(port, 1);
+        Pthread_create(&tids[i], NULL, acceptor_thread, &listenfds[i]);
+    }
+    debug("Accepting on %d SO_REUSEPORT listeners", n);
+
+    while (!sighup_called) {
+        sigsuspend(&oldmask);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    int *closefds = Malloc(n*sizeof(int));
+    for (int i=0;i<n;i++) {
+        closefds[i] = __atomic_exchange_n(&listenfds[i], -1, __ATOMIC_ACQ_REL);
+        if (closefds[i]>=0) {
+            shutdown(closefds[i], SHUT_RDWR);
+        }
+    }
+    for (int i=0;i<n;i++) {
+        Pthread_join(tids[i], NULL);
+        if (closefds[i]>=0) {
+            Close(closefds[i]);
+        }
+    }
+    free(closefds);
+    free(tids);
+    free(listenfds);
 }
 
 /*
@@ -117,7 +522,23 @@ int main(int argc, char* argv[]){
  */
 static void terminate(int status) {
     debug("Shutting down PBX...");
+    long elapsed;
+    long left = pbx_drain(pbx, drain_ms, &elapsed);
+    if (left>0) {
+        fprintf(stderr,"Drain timed out after %ld ms, %ld clients still connected\n", elapsed, left);
+    }
+    else {
+        fprintf(stderr,"Drained in %ld ms\n", elapsed);
+    }
     pbx_shutdown(pbx);
+    //every call has been torn down by now
+    cdr_close();
+    POOL_STATS stats[POOL_MAX];
+    int n = pool_stats(stats, POOL_MAX);
+    for (int i=0;i<n;i++) {
+        debug("Pool %s: %zu of %zu objects in use (%zu slabs of %zu byte slots)",
+              stats[i].name, stats[i].in_use, stats[i].capacity, stats[i].slabs, stats[i].slot_size);
+    }
     debug("PBX server terminating");
     exit(status);
 }
@@ -0,0 +1,374 @@
+/*
+ * Metrics: per-thread counters, state gauges and latency histograms,
+ * served in the Prometheus text format.
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "pbx.h"
+#include "server.h"
+#include "pool.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define TU_NUM_STATES (TU_ERROR+1)
+//commands whose latency is measured
+#define METRICS_COMMANDS (TU_CHAT_CMD+1)
+//histograms: one per command, then the fan-out time of pages
+#define HIST_PAGE METRICS_COMMANDS
+#define METRICS_HISTS (METRICS_COMMANDS+1)
+
+/*
+ * Latency histogram buckets: 8 linear sub-buckets for every power of two of
+ * nanoseconds, which keeps the relative error of any value under 12.5%.
+ * Values of 2^38ns (about 4.5 minutes) or more share the last bucket.
+ */
+#define HIST_SUB 8
+#define HIST_MAX_LOG 38
+#define HIST_BUCKETS ((HIST_MAX_LOG-2)*HIST_SUB)
+//bucket bounds reported to Prometheus: every power of two from 2^10ns (1us) to 2^34ns (17s)
+#define HIST_FIRST_LE 10
+#define HIST_LAST_LE 34
+
+//how long the admin port waits for a request before answering anyway
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+
+static const char *metric_names[METRIC_COUNT] = {
+    [METRIC_REGISTRATIONS] = "pbx_registrations_total",
+    [METRIC_UNREGISTRATIONS] = "pbx_unregistrations_total",
+    [METRIC_DIALS] = "pbx_dials_total",
+    [METRIC_BUSY] = "pbx_dial_busy_total",
+    [METRIC_DIAL_ERRORS] = "pbx_dial_errors_total",
+    [METRIC_CONNECTS] = "pbx_connects_total",
+    [METRIC_HANGUPS] = "pbx_hangups_total",
+    [METRIC_CHATS] = "pbx_chats_total",
+    [METRIC_BYTES_IN] = "pbx_received_bytes_total",
+    [METRIC_BYTES_OUT] = "pbx_sent_bytes_total",
+    [METRIC_PAGES] = "pbx_pages_total",
+    [METRIC_HUNT_QUEUED] = "pbx_hunt_queued_total",
+    [METRIC_PRESENCE] = "pbx_presence_notifications_total",
+    [METRIC_PRESENCE_COALESCED] = "pbx_presence_coalesced_total"
+};
+
+static const char *metric_help[METRIC_COUNT] = {
+    [METRIC_REGISTRATIONS] = "TUs registered.",
+    [METRIC_UNREGISTRATIONS] = "TUs unregistered.",
+    [METRIC_DIALS] = "Dial commands executed.",
+    [METRIC_BUSY] = "Dials that got a busy signal.",
+    [METRIC_DIAL_ERRORS] = "Dials of an extension that does not exist.",
+    [METRIC_CONNECTS] = "Calls answered.",
+    [METRIC_HANGUPS] = "Hangup commands executed.",
+    [METRIC_CHATS] = "Chat messages delivered.",
+    [METRIC_BYTES_IN] = "Bytes of commands received from clients.",
+    [METRIC_BYTES_OUT] = "Bytes sent to clients.",
+    [METRIC_PAGES] = "Pages sent from the paging extension.",
+    [METRIC_HUNT_QUEUED] = "Hunt group calls that had to wait for an agent.",
+    [METRIC_PRESENCE] = "Presence notifications sent to watchers.",
+    [METRIC_PRESENCE_COALESCED] = "State changes superseded before their watchers were sent them."
+};
+
+/*
+ * The metrics updated by one thread.  Only the owning thread writes a slot,
+ * with relaxed stores so that readers see whole values.
+ */
+typedef struct metrics_slot {
+    unsigned long counters[METRIC_COUNT];
+    long states[TU_NUM_STATES];
+    unsigned long hist[METRICS_HISTS][HIST_BUCKETS];
+    unsigned long hist_ns[METRICS_HISTS];
+    struct metrics_slot *next;
+} __attribute__((aligned(64))) METRICS_SLOT;
+
+//the slots of running threads, and the sum of those of exited threads
+static METRICS_SLOT *slots;
+static METRICS_SLOT retired;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static __thread METRICS_SLOT *my_slot;
+
+static int timing;
+static int admin_fd = -1;
+static pthread_t admin_tid;
+
+#define SLOT_ADD(field, n) __atomic_store_n(&(field), (field)+(n), __ATOMIC_RELAXED)
+
+//add every value of a slot to another
+static void slot_fold(METRICS_SLOT *to, METRICS_SLOT *from) {
+    for (int i=0;i<METRIC_COUNT;i++) {
+        to->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int i=0;i<TU_NUM_STATES;i++) {
+        to->states[i] += __atomic_load_n(&from->states[i], __ATOMIC_RELAXED);
+    }
+    for (int c=0;c<METRICS_HISTS;c++) {
+        for (int i=0;i<HIST_BUCKETS;i++) {
+            to->hist[c][i] += __atomic_load_n(&from->hist[c][i], __ATOMIC_RELAXED);
+        }
+        to->hist_ns[c] += __atomic_load_n(&from->hist_ns[c], __ATOMIC_RELAXED);
+    }
+}
+
+//fold the slot of an exiting thread into the retired total
+static void slot_release(void *arg) {
+    METRICS_SLOT *slot = arg;
+    pthread_mutex_lock(&slots_lock);
+    for (METRICS_SLOT **prev = &slots; *prev!=NULL; prev = &(*prev)->next) {
+        if (*prev==slot) {
+            *prev = slot->next;
+            break;
+        }
+    }
+    slot_fold(&retired, slot);
+    pthread_mutex_unlock(&slots_lock);
+    my_slot = NULL;
+    free(slot);
+}
+
+static void slot_key_create(void) {
+    pthread_key_create(&slot_key, slot_release);
+}
+
+static METRICS_SLOT *slot_create(void) {
+    METRICS_SLOT *slot = aligned_alloc(64, sizeof(METRICS_SLOT));
+    if (slot==NULL) {
+        return NULL;
+    }
+    memset(slot, 0, sizeof(METRICS_SLOT));
+    pthread_once(&slot_key_once, slot_key_create);
+    pthread_mutex_lock(&slots_lock);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&slots_lock);
+    pthread_setspecific(slot_key, slot);
+    return slot;
+}
+
+static inline METRICS_SLOT *slot_get(void) {
+    METRICS_SLOT *slot = my_slot;
+    if (slot==NULL) {
+        slot = my_slot = slot_create();
+    }
+    return slot;
+}
+
+void metrics_add(METRIC m, unsigned long n) {
+    METRICS_SLOT *slot = slot_get();
+    if (slot!=NULL) {
+        SLOT_ADD(slot->counters[m], n);
+    }
+}
+
+void metrics_state_change(int from, int to) {
+    METRICS_SLOT *slot = slot_get();
+    if (slot==NULL) {
+        return;
+    }
+    if (from>=0) {
+        SLOT_ADD(slot->states[from], -1);
+    }
+    if (to>=0) {
+        SLOT_ADD(slot->states[to], 1);
+    }
+}
+
+int metrics_timing(void) {
+    return __atomic_load_n(&timing, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns) {
+    if (ns<HIST_SUB) {
+        return ns;
+    }
+    int log = 63-__builtin_clzll(ns);
+    if (log>=HIST_MAX_LOG) {
+        return HIST_BUCKETS-1;
+    }
+    int sub = (ns>>(log-3)) & (HIST_SUB-1);
+    return (log-2)*HIST_SUB + sub;
+}
+
+void metrics_command_time(int cmd, uint64_t ns) {
+    METRICS_SLOT *slot = slot_get();
+    if (slot==NULL || cmd<0 || cmd>=METRICS_COMMANDS) {
+        return;
+    }
+    SLOT_ADD(slot->hist[cmd][hist_bucket(ns)], 1);
+    SLOT_ADD(slot->hist_ns[cmd], ns);
+}
+
+void metrics_page_time(uint64_t ns) {
+    METRICS_SLOT *slot = slot_get();
+    if (slot==NULL) {
+        return;
+    }
+    SLOT_ADD(slot->hist[HIST_PAGE][hist_bucket(ns)], 1);
+    SLOT_ADD(slot->hist_ns[HIST_PAGE], ns);
+}
+
+//write one histogram, with power-of-two bucket bounds
+static void hist_write(FILE *out, const char *name, const char *labels,
+                       unsigned long *hist, unsigned long ns) {
+    const char *sep = *labels ? "," : "";
+    unsigned long count = 0;
+    int bucket = 0;
+    for (int le=HIST_FIRST_LE;le<=HIST_LAST_LE;le++) {
+        //buckets below that of 2^le hold the values under 2^le
+        for (;bucket<(le-2)*HIST_SUB;bucket++) {
+            count += hist[bucket];
+        }
+        fprintf(out, "%s_bucket{%s%sle=\"%.9g\"} %lu\n",
+                name, labels, sep, (double)(1ull<<le)/1e9, count);
+    }
+    for (;bucket<HIST_BUCKETS;bucket++) {
+        count += hist[bucket];
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, count);
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", ns/1e9);
+    fprintf(out, "%s_count%s%s%s %lu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", count);
+}
+
+//write the current metrics to a stream in the Prometheus text format
+static void metrics_write(FILE *out) {
+    METRICS_SLOT *sum = aligned_alloc(64, sizeof(METRICS_SLOT));
+    if (sum==NULL) {
+        return;
+    }
+    pthread_mutex_lock(&slots_lock);
+    *sum = retired;
+    for (METRICS_SLOT *slot = slots; slot!=NULL; slot = slot->next) {
+        slot_fold(sum, slot);
+    }
+    pthread_mutex_unlock(&slots_lock);
+
+    for (int i=0;i<METRIC_COUNT;i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+                metric_names[i], metric_help[i], metric_names[i], metric_names[i], sum->counters[i]);
+    }
+
+    fprintf(out, "# HELP pbx_tus TUs in each state.\n# TYPE pbx_tus gauge\n");
+    for (int i=0;i<TU_NUM_STATES;i++) {
+        fprintf(out, "pbx_tus{state=\"%s\"} %ld\n", tu_state_names[i], sum->states[i]<0 ? 0 : sum->states[i]);
+    }
+
+    fprintf(out, "# HELP pbx_command_duration_seconds Time from receiving a command to sending its notifications.\n"
+                 "# TYPE pbx_command_duration_seconds histogram\n");
+    for (int c=0;c<METRICS_COMMANDS;c++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "command=\"%s\"", tu_command_names[c]);
+        hist_write(out, "pbx_command_duration_seconds", labels, sum->hist[c], sum->hist_ns[c]);
+    }
+    fprintf(out, "# HELP pbx_page_fanout_seconds Time to deliver a page to every TU on hook.\n"
+                 "# TYPE pbx_page_fanout_seconds histogram\n");
+    hist_write(out, "pbx_page_fanout_seconds", "", sum->hist[HIST_PAGE], sum->hist_ns[HIST_PAGE]);
+    free(sum);
+
+    POOL_STATS stats[POOL_MAX];
+    int n = pool_stats(stats, POOL_MAX);
+    fprintf(out, "# HELP pbx_pool_objects Objects carved out of each pool's slabs.\n# TYPE pbx_pool_objects gauge\n");
+    for (int i=0;i<n;i++) {
+        fprintf(out, "pbx_pool_objects{pool=\"%s\"} %zu\n", stats[i].name, stats[i].capacity);
+    }
+    fprintf(out, "# HELP pbx_pool_objects_in_use Objects allocated from each pool.\n# TYPE pbx_pool_objects_in_use gauge\n");
+    for (int i=0;i<n;i++) {
+        fprintf(out, "pbx_pool_objects_in_use{pool=\"%s\"} %zu\n", stats[i].name, stats[i].in_use);
+    }
+}
+
+//read a request up to the blank line that ends its header, or until the client stops sending
+static void read_request(int fd) {
+    char buf[1024];
+    int len = 0;
+    while (1) {
+        ssize_t n = read(fd, buf+len, sizeof(buf)-1-len);
+        if (n<=0) {
+            return;
+        }
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n")!=NULL || strstr(buf, "\n\n")!=NULL) {
+            return;
+        }
+        if (len==sizeof(buf)-1) {
+            //only the end of a long header matters
+            memmove(buf, buf+len-3, 3);
+            len = 3;
+        }
+    }
+}
+
+static void *admin_thread(void *arg) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd<0) {
+            if (errno==EINTR || errno==ECONNABORTED) {
+                continue;
+            }
+            //EINVAL once metrics_stop() has shut the port down
+            if (errno!=EINVAL) {
+                debug("Admin port failed: %s", strerror(errno));
+            }
+            break;
+        }
+        struct timeval tv = { METRICS_REQUEST_TIMEOUT_MS/1000, METRICS_REQUEST_TIMEOUT_MS%1000*1000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        read_request(fd);
+
+        char *body = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&body, &len);
+        if (out!=NULL) {
+            metrics_write(out);
+            fclose(out);
+            char header[128];
+            int hlen = snprintf(header, sizeof(header),
+                                "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n\r\n", len);
+            if (rio_writen(fd, header, hlen)==hlen) {
+                rio_writen(fd, body, len);
+            }
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(char *port) {
+    if ((admin_fd = open_listenfd(port))<0) {
+        return -1;
+    }
+    if (pthread_create(&admin_tid, NULL, admin_thread, NULL)!=0) {
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+    __atomic_store_n(&timing, 1, __ATOMIC_RELAXED);
+    debug("Serving metrics on port %s", port);
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (admin_fd<0) {
+        return;
+    }
+    //wakes the admin thread up from accept()
+    shutdown(admin_fd, SHUT_RDWR);
+    Pthread_join(admin_tid, NULL);
+    close(admin_fd);
+    admin_fd = -1;
+}
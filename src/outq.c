@@ -0,0 +1,693 @@
+/*
+ * Outbound queues: buffered, non-blocking delivery of output to clients.
+ */
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+#include "pool.h"
+#include "uring.h"
+#include "metrics.h"
+#include "debug.h"
+#include "csapp.h"
+
+//size of the chunks that small messages are packed into
+#define OUTQ_CHUNK 512
+//maximum number of chunks written by one sendmsg()
+#define OUTQ_MAX_IOV 64
+
+/*
+ * A reference-counted chunk of outbound bytes.
+ */
+typedef struct obuf {
+    int ref;
+    size_t len;
+    size_t cap;
+    char data[];
+} OBUF;
+
+/*
+ * An entry in an outbound queue: the unsent part of a chunk.
+ */
+typedef struct oseg {
+    OBUF *buf;
+    size_t off;
+    struct oseg *next;
+} OSEG;
+
+/*
+ * A send submitted to an io_uring, see outq_use_uring().  The chunks are
+ * referenced until it completes, as the kernel may read them until then.
+ */
+typedef struct osend {
+    struct outq *q;
+    struct msghdr msg;
+    int n;
+    OBUF *bufs[OUTQ_MAX_IOV];
+    struct iovec iov[OUTQ_MAX_IOV];
+} OSEND;
+
+typedef struct outq {
+    pthread_mutex_t lock;
+    int ref;
+    int fd;
+    OSEG *head;
+    OSEG *tail;
+    size_t bytes;      //total unsent bytes
+    int closed;        //no further output will be sent
+    int armed;         //the drainer or an io_uring send holds a reference and finishes the queue
+    int registered;    //fd has been added to the drainer's epoll set
+    int held;          //output is kept back, see outq_hold()
+    //told when output that waited for the socket is all sent, see outq_set_drained()
+    void (*drained)(void *arg);
+    void (*release)(void *arg);
+    void *drained_arg;
+} OUTQ;
+
+static POOL outq_pool = POOL_INITIALIZER("outq", sizeof(OUTQ), 64);
+static POOL oseg_pool = POOL_INITIALIZER("oseg", sizeof(OSEG), sizeof(void *));
+//chunks of the standard size; larger ones come from malloc()
+static POOL obuf_pool = POOL_INITIALIZER("obuf", sizeof(OBUF)+OUTQ_CHUNK, 64);
+static POOL osend_pool = POOL_INITIALIZER("osend", sizeof(OSEND), sizeof(void *));
+
+static size_t outq_limit = OUTQ_DEFAULT_LIMIT;
+static OUTQ_POLICY outq_policy = OUTQ_DROP;
+
+static pthread_once_t drainer_once = PTHREAD_ONCE_INIT;
+static int drainer_epfd = -1;
+
+//ring that the calling thread submits its sends to, see outq_use_uring()
+static __thread URING *outq_ring;
+static __thread unsigned long outq_ring_tag;
+
+static OBUF *obuf_new(size_t cap) {
+    OBUF *buf = cap==OUTQ_CHUNK ? pool_alloc(&obuf_pool) : malloc(sizeof(OBUF)+cap);
+    if (buf!=NULL) {
+        buf->ref = 1;
+        buf->len = 0;
+        buf->cap = cap;
+    }
+    return buf;
+}
+
+static void obuf_unref(OBUF *buf) {
+    if (__atomic_sub_fetch(&buf->ref, 1, __ATOMIC_ACQ_REL)==0) {
+        if (buf->cap==OUTQ_CHUNK) {
+            pool_free(&obuf_pool, buf);
+        }
+        else {
+            free(buf);
+        }
+    }
+}
+
+//discard all unsent output, queue has to be locked
+static void outq_discard(OUTQ *q) {
+    OSEG *seg = q->head;
+    while (seg!=NULL) {
+        OSEG *next = seg->next;
+        obuf_unref(seg->buf);
+        pool_free(&oseg_pool, seg);
+        seg = next;
+    }
+    q->head = q->tail = NULL;
+    q->bytes = 0;
+}
+
+//shut the connection down, queue has to be locked
+static void outq_close_locked(OUTQ *q) {
+    if (!q->closed) {
+        q->closed = 1;
+        shutdown(q->fd, SHUT_RDWR);
+    }
+    outq_discard(q);
+}
+
+//account for sent bytes and release the segments that were written completely
+//queue has to be locked
+static void outq_consume_locked(OUTQ *q, size_t sent) {
+    q->bytes -= sent;
+    metrics_add(METRIC_BYTES_OUT, sent);
+    while (sent>0) {
+        OSEG *seg = q->head;
+        size_t left = seg->buf->len - seg->off;
+        if (sent<left) {
+            seg->off += sent;
+            break;
+        }
+        sent -= left;
+        q->head = seg->next;
+        obuf_unref(seg->buf);
+        pool_free(&oseg_pool, seg);
+    }
+    if (q->head==NULL) {
+        q->tail = NULL;
+    }
+}
+
+//write as much as possible without blocking, queue has to be locked
+//return 0 if empty, 1 if output remains, -1 if the connection failed
+static int outq_send_locked(OUTQ *q) {
+    struct iovec iov[OUTQ_MAX_IOV];
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    while (q->head!=NULL) {
+        int n = 0;
+        for (OSEG *seg = q->head; seg!=NULL && n<OUTQ_MAX_IOV; seg = seg->next) {
+            iov[n].iov_base = seg->buf->data + seg->off;
+            iov[n].iov_len = seg->buf->len - seg->off;
+            n++;
+        }
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(q->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent<0) {
+            if (errno==EINTR) {
+                continue;
+            }
+            if (errno==EAGAIN || errno==EWOULDBLOCK) {
+                return 1;
+            }
+            outq_close_locked(q);
+            return -1;
+        }
+        outq_consume_locked(q, sent);
+    }
+    return 0;
+}
+
+//(re)arm the drainer to wait for the socket to become writable, queue has to be locked
+static int outq_arm_locked(OUTQ *q) {
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    ev.data.ptr = q;
+    int op = q->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(drainer_epfd, op, q->fd, &ev)<0) {
+        return -1;
+    }
+    q->registered = 1;
+    return 0;
+}
+
+/*
+ * Background thread that finishes writing output which could not be sent
+ * immediately.  While a queue is armed, the drainer holds a reference to it.
+ */
+static void *drainer_thread(void *arg) {
+    struct epoll_event events[64];
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        int n = epoll_wait(drainer_epfd, events, 64, -1);
+        if (n<0) {
+            if (errno==EINTR) {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        for (int i=0;i<n;i++) {
+            OUTQ *q = events[i].data.ptr;
+            int release = 1;
+            pthread_mutex_lock(&q->lock);
+            //a held queue is flushed again when it is released
+            if (!q->closed && !q->held && outq_send_locked(q)==1) {
+                if (outq_arm_locked(q)==0) {
+                    release = 0;
+                }
+                else {
+                    outq_close_locked(q);
+                }
+            }
+            void (*drained)(void *) = NULL;
+            if (release) {
+                q->armed = 0;
+                drained = q->closed ? NULL : q->drained;
+            }
+            pthread_mutex_unlock(&q->lock);
+            if (drained!=NULL) {
+                drained(q->drained_arg);
+            }
+            if (release) {
+                outq_unref(q);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void drainer_start(void) {
+    if ((drainer_epfd = epoll_create1(EPOLL_CLOEXEC))<0) {
+        unix_error("epoll_create1 error");
+    }
+    pthread_t tid;
+    Pthread_create(&tid, NULL, drainer_thread, NULL);
+    Pthread_detach(tid);
+}
+
+/*
+ * Set the per-connection limit and the overflow policy used by all queues.
+ */
+void outq_configure(size_t limit, OUTQ_POLICY policy) {
+    outq_limit = limit;
+    outq_policy = policy;
+}
+
+/*
+ * Create a queue for a connection, taking ownership of fd.
+ */
+OUTQ *outq_new(int fd) {
+    OUTQ *q = pool_zalloc(&outq_pool);
+    if (q==NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    q->ref = 1;
+    q->fd = fd;
+    return q;
+}
+
+OUTQ *outq_ref(OUTQ *q) {
+    __atomic_add_fetch(&q->ref, 1, __ATOMIC_RELAXED);
+    return q;
+}
+
+/*
+ * Release a reference to a queue.  When the last one goes away the
+ * remaining output is discarded and the connection is closed.
+ */
+void outq_unref(OUTQ *q) {
+    if (__atomic_sub_fetch(&q->ref, 1, __ATOMIC_ACQ_REL)!=0) {
+        return;
+    }
+    outq_discard(q);
+    close(q->fd);
+    if (q->release!=NULL) {
+        q->release(q->drained_arg);
+    }
+    pthread_mutex_destroy(&q->lock);
+    pool_free(&outq_pool, q);
+}
+
+//check that a message of len bytes may be queued, applying the overflow policy if not
+//queue has to be locked
+static int outq_admit_locked(OUTQ *q, size_t len) {
+    if (q->closed) {
+        return -1;
+    }
+    if (q->bytes+len>outq_limit) {
+        debug("Output queue for fd %d overflowed (%zu bytes pending)", q->fd, q->bytes);
+        if (outq_policy==OUTQ_DISCONNECT) {
+            outq_close_locked(q);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+//copy bytes to the end of a queue, packing them into the last chunk if they fit
+//queue has to be locked
+static int outq_copy_locked(OUTQ *q, const void *data, size_t len) {
+    OSEG *tail = q->tail;
+    if (len==0) {
+        return 0;
+    }
+    if (tail!=NULL && tail->buf->ref==1 && tail->buf->cap-tail->buf->len>=len) {
+        memcpy(tail->buf->data+tail->buf->len, data, len);
+        tail->buf->len += len;
+    }
+    else {
+        size_t cap = len>OUTQ_CHUNK ? len : OUTQ_CHUNK;
+        OBUF *buf = obuf_new(cap);
+        OSEG *seg = pool_alloc(&oseg_pool);
+        if (buf==NULL || seg==NULL) {
+            if (buf!=NULL) {
+                obuf_unref(buf);
+            }
+            pool_free(&oseg_pool, seg);
+            return -1;
+        }
+        buf->len = len;
+        memcpy(buf->data, data, len);
+        seg->buf = buf;
+        seg->off = 0;
+        seg->next = NULL;
+        if (tail!=NULL) {
+            tail->next = seg;
+        }
+        else {
+            q->head = seg;
+        }
+        q->tail = seg;
+    }
+    q->bytes += len;
+    return 0;
+}
+
+/*
+ * Append a message to a queue.
+ */
+int outq_append(OUTQ *q, const void *data, size_t len) {
+    int ret;
+    pthread_mutex_lock(&q->lock);
+    ret = outq_admit_locked(q, len);
+    if (ret==0) {
+        ret = outq_copy_locked(q, data, len);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+void outq_lock(OUTQ *q) {
+    pthread_mutex_lock(&q->lock);
+}
+
+void outq_unlock(OUTQ *q) {
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Append a message made of several pieces to a locked queue.
+ */
+int outq_append_iov_locked(OUTQ *q, const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i=0;i<iovcnt;i++) {
+        len += iov[i].iov_len;
+    }
+    if (outq_admit_locked(q, len)<0) {
+        return -1;
+    }
+    for (int i=0;i<iovcnt;i++) {
+        if (outq_copy_locked(q, iov[i].iov_base, iov[i].iov_len)<0) {
+            //the queue is left holding a partial message
+            outq_close_locked(q);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Build a message to be queued on several queues.  A short one gets a chunk
+ * of the standard size, as the last queue to hold it may pack more output
+ * into what is left.
+ */
+OUTQ_MSG *outq_msg_new(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i=0;i<iovcnt;i++) {
+        len += iov[i].iov_len;
+    }
+    OBUF *buf = obuf_new(len>OUTQ_CHUNK ? len : OUTQ_CHUNK);
+    if (buf==NULL) {
+        return NULL;
+    }
+    for (int i=0;i<iovcnt;i++) {
+        memcpy(buf->data+buf->len, iov[i].iov_base, iov[i].iov_len);
+        buf->len += iov[i].iov_len;
+    }
+    return buf;
+}
+
+void outq_msg_unref(OUTQ_MSG *msg) {
+    obuf_unref(msg);
+}
+
+/*
+ * Queue a shared message by reference.  While anyone else holds it, its
+ * reference count keeps outq_copy_locked() from packing into it.
+ */
+int outq_append_msg(OUTQ *q, OUTQ_MSG *msg) {
+    int ret = -1;
+    pthread_mutex_lock(&q->lock);
+    OSEG *seg;
+    if (outq_admit_locked(q, msg->len)==0 && (seg = pool_alloc(&oseg_pool))!=NULL) {
+        __atomic_add_fetch(&msg->ref, 1, __ATOMIC_RELAXED);
+        seg->buf = msg;
+        seg->off = 0;
+        seg->next = NULL;
+        if (q->tail!=NULL) {
+            q->tail->next = seg;
+        }
+        else {
+            q->head = seg;
+        }
+        q->tail = seg;
+        q->bytes += msg->len;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/*
+ * Send a message made of several pieces straight to the socket if nothing
+ * is queued ahead of it, and queue whatever the socket does not take.
+ */
+int outq_write_locked(OUTQ *q, const struct iovec *iov, int iovcnt) {
+    size_t len = 0, sent = 0;
+    for (int i=0;i<iovcnt;i++) {
+        len += iov[i].iov_len;
+    }
+    if (q->closed) {
+        return -1;
+    }
+    //a thread with a ring leaves the sending to the ring, after the message is queued
+    if (q->head==NULL && !q->armed && !q->held && outq_ring==NULL) {
+        struct msghdr msg = {0};
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n;
+        do {
+            n = sendmsg(q->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (n<0 && errno==EINTR);
+        if (n<0) {
+            if (errno!=EAGAIN && errno!=EWOULDBLOCK) {
+                outq_close_locked(q);
+                return -1;
+            }
+            n = 0;
+        }
+        sent = n;
+        metrics_add(METRIC_BYTES_OUT, sent);
+        if (sent==len) {
+            return 0;
+        }
+    }
+    if (outq_admit_locked(q, len-sent)<0) {
+        //part of the message may be out already, so the rest can't just be dropped
+        if (sent>0) {
+            outq_close_locked(q);
+        }
+        return -1;
+    }
+    for (int i=0;i<iovcnt;i++) {
+        size_t skip = sent<iov[i].iov_len ? sent : iov[i].iov_len;
+        sent -= skip;
+        if (iov[i].iov_len>skip &&
+            outq_copy_locked(q, (char *)iov[i].iov_base+skip, iov[i].iov_len-skip)<0) {
+            outq_close_locked(q);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//submit the queued output to the calling thread's ring, if it has one
+//return 0 if submitted, -1 if the ring is full, queue has to be locked
+static int outq_submit_locked(OUTQ *q) {
+    OSEND *s = pool_alloc(&osend_pool);
+    struct io_uring_sqe *sqe = s!=NULL ? uring_get_sqe(outq_ring) : NULL;
+    if (sqe==NULL) {
+        pool_free(&osend_pool, s);
+        return -1;
+    }
+    int n = 0;
+    for (OSEG *seg = q->head; seg!=NULL && n<OUTQ_MAX_IOV; seg = seg->next) {
+        __atomic_add_fetch(&seg->buf->ref, 1, __ATOMIC_RELAXED);
+        s->bufs[n] = seg->buf;
+        s->iov[n].iov_base = seg->buf->data + seg->off;
+        s->iov[n].iov_len = seg->buf->len - seg->off;
+        n++;
+    }
+    s->q = q;
+    s->n = n;
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_iov = s->iov;
+    s->msg.msg_iovlen = n;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = q->fd;
+    sqe->addr = (unsigned long)&s->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)s | outq_ring_tag;
+    q->armed = 1;
+    outq_ref(q);
+    return 0;
+}
+
+//start sending queued output, on the calling thread's ring or else with sendmsg()
+//and the drainer for what the socket does not take, queue has to be locked
+//return as for outq_flush()
+static int outq_push_locked(OUTQ *q) {
+    if (q->head!=NULL && outq_ring!=NULL && outq_submit_locked(q)==0) {
+        return 1;
+    }
+    int ret = outq_send_locked(q);
+    if (ret==1) {
+        pthread_once(&drainer_once, drainer_start);
+        if (outq_arm_locked(q)==0) {
+            q->armed = 1;
+            outq_ref(q);
+        }
+        else {
+            outq_close_locked(q);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Write queued output without blocking, leaving the rest to the drainer.
+ */
+int outq_flush(OUTQ *q) {
+    int ret;
+    pthread_mutex_lock(&q->lock);
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    if (q->armed) {
+        //the drainer is already waiting to finish this queue
+        pthread_mutex_unlock(&q->lock);
+        return 1;
+    }
+    if (q->held) {
+        ret = q->head!=NULL;
+        pthread_mutex_unlock(&q->lock);
+        return ret;
+    }
+    ret = outq_push_locked(q);
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/*
+ * Submit the sends of the calling thread to an io_uring.
+ */
+void outq_use_uring(URING *ring, unsigned long tag) {
+    outq_ring = ring;
+    outq_ring_tag = tag;
+}
+
+/*
+ * Finish a send submitted to an io_uring, and submit whatever has been
+ * queued since.
+ */
+void outq_uring_complete(void *req, int res) {
+    OSEND *s = req;
+    OUTQ *q = s->q;
+    pthread_mutex_lock(&q->lock);
+    if (!q->closed) {
+        if (res>=0) {
+            outq_consume_locked(q, res);
+        }
+        else if (res!=-EINTR && res!=-EAGAIN) {
+            outq_close_locked(q);
+        }
+    }
+    for (int i=0;i<s->n;i++) {
+        obuf_unref(s->bufs[i]);
+    }
+    pool_free(&osend_pool, s);
+    q->armed = 0;
+    if (!q->closed && !q->held && q->head!=NULL) {
+        outq_push_locked(q);
+    }
+    void (*drained)(void *) = q->closed || q->armed ? NULL : q->drained;
+    pthread_mutex_unlock(&q->lock);
+    if (drained!=NULL) {
+        drained(q->drained_arg);
+    }
+    outq_unref(q);
+}
+
+/*
+ * Have a queue report when its output has caught up with what was queued.
+ */
+void outq_set_drained(OUTQ *q, void (*drained)(void *arg), void (*release)(void *arg),
+                      void *arg) {
+    pthread_mutex_lock(&q->lock);
+    q->drained = drained;
+    q->release = release;
+    q->drained_arg = arg;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Output is waiting for the socket while the drainer or an io_uring send
+ * is finishing it, or while the queue is held.
+ */
+int outq_busy(OUTQ *q) {
+    pthread_mutex_lock(&q->lock);
+    int busy = q->armed || q->held;
+    pthread_mutex_unlock(&q->lock);
+    return busy;
+}
+
+/*
+ * Stop sending output and copy whatever is queued.
+ */
+ssize_t outq_hold(OUTQ *q, char **data) {
+    pthread_mutex_lock(&q->lock);
+    q->held = 1;
+    size_t len = q->bytes;
+    if (data==NULL) {
+        pthread_mutex_unlock(&q->lock);
+        return len;
+    }
+    char *buf = malloc(len>0 ? len : 1);
+    if (buf==NULL) {
+        q->held = 0;
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    size_t off = 0;
+    for (OSEG *seg = q->head; seg!=NULL; seg = seg->next) {
+        memcpy(buf+off, seg->buf->data+seg->off, seg->buf->len-seg->off);
+        off += seg->buf->len-seg->off;
+    }
+    pthread_mutex_unlock(&q->lock);
+    *data = buf;
+    return len;
+}
+
+/*
+ * Resume sending the output of a held queue.  A producer that held back
+ * meanwhile is told as if the output had drained, unless the flush left
+ * some for the drainer, which tells it once that is sent.
+ */
+void outq_release(OUTQ *q) {
+    pthread_mutex_lock(&q->lock);
+    q->held = 0;
+    pthread_mutex_unlock(&q->lock);
+    outq_flush(q);
+    pthread_mutex_lock(&q->lock);
+    void (*drained)(void *) = q->closed || q->armed ? NULL : q->drained;
+    pthread_mutex_unlock(&q->lock);
+    if (drained!=NULL) {
+        drained(q->drained_arg);
+    }
+}
+
+/*
+ * Shut down the connection behind a queue and discard any unsent output.
+ * If the drainer is waiting on the queue, the shutdown wakes it up so that
+ * it drops its reference.
+ */
+void outq_close(OUTQ *q) {
+    pthread_mutex_lock(&q->lock);
+    outq_close_locked(q);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -2,22 +2,322 @@
  * PBX: simulates a Private Branch Exchange.
  */
 #include <stdlib.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
 
 #include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+#include "metrics.h"
 #include "debug.h"
 #include "csapp.h"
 
-sem_t pbx_mutex;
+/*
+ * The registry is split into shards by extension number.  Each shard has its
+ * own lock, which serializes registrations and unregistrations within that
+ * shard only.  Lookups take no lock at all: a reader announces itself in one
+ * of two per-shard counters, and a writer that removes a TU (or replaces the
+ * slot array) waits for the counters to drain before releasing what it removed,
+ * in the manner of sleepable RCU.  The registry's own reference thus keeps a
+ * TU alive until every lookup that could have seen it has taken a reference.
+ */
+#define PBX_SHARDS 64
+
+//TUs a page is delivered to per pass over a shard, as many as a batch flushes at once
+#define PBX_PAGE_BATCH 64
 
-volatile long thread_cnt = 0;
-sem_t thread_cnt_mutex;
+//slot array of a shard, replaced as a whole when it grows
+typedef struct slots {
+    int cap;
+    TU *tu[];
+} SLOTS;
+
+typedef struct shard {
+    pthread_mutex_t lock;
+    SLOTS *slots;   //read without the lock
+    int readers[2]; //lookups in progress, by reader epoch
+    int epoch;
+    int count; //number of registered TUs
+    int *free_idx; //stack of released slot indices, reused before new ones
+    int free_count;
+    int free_cap;
+    int next_idx; //lowest slot index that has never been handed out
+} __attribute__((aligned(64))) SHARD;
 
-sem_t shutdown_mutex;
 typedef struct pbx {
-    TU* tu_list[PBX_MAX_EXTENSIONS];
-    int tu_count;
+    SHARD shards[PBX_SHARDS];
+    unsigned int next_shard; //spreads new registrations over the shards
+    //registered TUs, for draining; signalled when the last one is unregistered
+    pthread_mutex_t drain_lock;
+    pthread_cond_t drain_cond; //waits on CLOCK_MONOTONIC
+    long registered;
+    int draining; //no new registrations are accepted
+    //conference bridges, fixed before the first registration and read without a lock
+    CONF *bridges[PBX_MAX_BRIDGES];
+    int nbridges;
+    //hunt groups, likewise
+    HUNT *hunts[PBX_MAX_HUNTS];
+    int nhunts;
 } PBX;
 
+#define EXT_SHARD(ext) (((ext)-PBX_FIRST_EXTENSION)%PBX_SHARDS)
+#define EXT_INDEX(ext) (((ext)-PBX_FIRST_EXTENSION)/PBX_SHARDS)
+#define SHARD_EXT(shard,idx) ((idx)*PBX_SHARDS+(shard)+PBX_FIRST_EXTENSION)
+
+static int shard_read_lock(SHARD *sh) {
+    int e = __atomic_load_n(&sh->epoch,__ATOMIC_RELAXED)&1;
+    __atomic_add_fetch(&sh->readers[e],1,__ATOMIC_SEQ_CST);
+    return e;
+}
+
+static void shard_read_unlock(SHARD *sh, int e) {
+    __atomic_sub_fetch(&sh->readers[e],1,__ATOMIC_RELEASE);
+}
+
+//wait until no lookup can still see anything unpublished before the call,
+//shard has to be locked
+static void shard_synchronize(SHARD *sh) {
+    //flip twice, so that readers of both epochs are waited for at least once
+    for (int i=0;i<2;i++) {
+        int e = __atomic_load_n(&sh->epoch,__ATOMIC_RELAXED)&1;
+        __atomic_store_n(&sh->epoch,e^1,__ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&sh->readers[e],__ATOMIC_SEQ_CST)!=0) {
+            sched_yield();
+        }
+    }
+}
+
+//make room in a shard for the given slot index, shard has to be locked
+static int shard_grow(SHARD *sh, int idx) {
+    SLOTS *old = sh->slots;
+    int oldcap = old ? old->cap : 0;
+    if (idx<oldcap) {
+        return 0;
+    }
+    int cap = oldcap ? oldcap : 16;
+    while (cap<=idx) {
+        if (cap>INT_MAX/(2*PBX_SHARDS)) {
+            return -1;
+        }
+        cap *= 2;
+    }
+    SLOTS *slots = calloc(1,sizeof(SLOTS)+cap*sizeof(TU *));
+    if (slots==NULL) {
+        return -1;
+    }
+    slots->cap = cap;
+    if (old!=NULL) {
+        memcpy(slots->tu,old->tu,oldcap*sizeof(TU *));
+    }
+    __atomic_store_n(&sh->slots,slots,__ATOMIC_RELEASE);
+    if (old!=NULL) {
+        shard_synchronize(sh);
+        free(old);
+    }
+    return 0;
+}
+
+static TU *shard_slot(SHARD *sh, int idx) {
+    return sh->slots!=NULL && idx<sh->slots->cap ? sh->slots->tu[idx] : NULL;
+}
+
+//pick a free slot index, shard has to be locked
+//released indices are reused first; entries that have since been
+//registered explicitly are skipped, so the stack never needs searching
+static int shard_alloc_index(SHARD *sh) {
+    while (sh->free_count>0) {
+        int idx = sh->free_idx[--sh->free_count];
+        if (shard_slot(sh,idx)==NULL) {
+            return idx;
+        }
+    }
+    while (shard_slot(sh,sh->next_idx)!=NULL) {
+        sh->next_idx++;
+    }
+    return sh->next_idx++;
+}
+
+//return a slot index to the free stack, shard has to be locked
+static void shard_release_index(SHARD *sh, int idx) {
+    if (sh->free_count==sh->free_cap) {
+        int cap = sh->free_cap ? 2*sh->free_cap : 16;
+        int *free_idx = realloc(sh->free_idx,cap*sizeof(int));
+        if (free_idx==NULL) {
+            //the extension is just not reused
+            return;
+        }
+        sh->free_idx = free_idx;
+        sh->free_cap = cap;
+    }
+    sh->free_idx[sh->free_count++] = idx;
+}
+
+/*
+ * Look up the TU registered at an extension without taking any lock.
+ *
+ * @return the TU, with a reference that the caller must release, or NULL if
+ * no TU is registered at that extension.
+ */
+static TU *pbx_lookup(PBX *pbx, int ext) {
+    if (ext<PBX_FIRST_EXTENSION) {
+        return NULL;
+    }
+    SHARD *sh = &pbx->shards[EXT_SHARD(ext)];
+    int idx = EXT_INDEX(ext);
+    int e = shard_read_lock(sh);
+    SLOTS *slots = __atomic_load_n(&sh->slots,__ATOMIC_ACQUIRE);
+    TU *tu = NULL;
+    if (slots!=NULL && idx<slots->cap) {
+        tu = __atomic_load_n(&slots->tu[idx],__ATOMIC_ACQUIRE);
+    }
+    if (tu!=NULL) {
+        tu_ref(tu,"Looked up in PBX");
+    }
+    shard_read_unlock(sh,e);
+    return tu;
+}
+
+//account for a TU leaving the registry, waking a drain when it was the last
+static void pbx_unregistered(PBX *pbx) {
+    pthread_mutex_lock(&pbx->drain_lock);
+    if (--pbx->registered==0 && pbx->draining) {
+        pthread_cond_broadcast(&pbx->drain_cond);
+    }
+    pthread_mutex_unlock(&pbx->drain_lock);
+}
+
+/*
+ * Find a conference bridge.  There are few enough for a linear search.
+ */
+CONF *pbx_bridge(PBX *pbx, int ext) {
+    for (int i=0;i<pbx->nbridges;i++) {
+        if (conf_extension(pbx->bridges[i])==ext) {
+            return pbx->bridges[i];
+        }
+    }
+    return NULL;
+}
+
+static HUNT *pbx_hunt(PBX *pbx, int ext) {
+    for (int i=0;i<pbx->nhunts;i++) {
+        if (hunt_extension(pbx->hunts[i])==ext) {
+            return pbx->hunts[i];
+        }
+    }
+    return NULL;
+}
+
+//the hunt group an extension is an agent of, or NULL
+static HUNT *pbx_agent_hunt(PBX *pbx, int ext) {
+    for (int i=0;i<pbx->nhunts;i++) {
+        if (hunt_is_agent(pbx->hunts[i],ext)) {
+            return pbx->hunts[i];
+        }
+    }
+    return NULL;
+}
+
+//an extension that is never assigned to a TU
+static int pbx_reserved(PBX *pbx, int ext) {
+    return pbx_bridge(pbx,ext)!=NULL || pbx_hunt(pbx,ext)!=NULL;
+}
+
+static int pbx_add_conf(PBX *pbx, int ext, int limit, CONF_RELAY relay) {
+    if (ext<PBX_FIRST_EXTENSION || pbx->nbridges==PBX_MAX_BRIDGES ||
+        pbx_reserved(pbx,ext) || pbx_agent_hunt(pbx,ext)!=NULL) {
+        return -1;
+    }
+    CONF *conf = conf_new(ext,limit,relay,pbx);
+    if (conf==NULL) {
+        return -1;
+    }
+    pbx->bridges[pbx->nbridges++] = conf;
+    return 0;
+}
+
+int pbx_add_bridge(PBX *pbx, int ext) {
+    return pbx_add_conf(pbx,ext,0,NULL);
+}
+
+/*
+ * Deliver a page to every TU that is on hook.  The registry is walked a few
+ * TUs at a time: a group is referenced within a lookup's read section,
+ * which keeps no writer waiting for longer than that, and the page is then
+ * queued for each TU of the group and flushed with one write per client.
+ * A TU registered or unregistered during the walk may or may not get it.
+ */
+static int pbx_page(void *arg, const char *text, size_t len) {
+    PBX *pbx = arg;
+    uint64_t start = metrics_timing() ? metrics_now() : 0;
+    struct iovec iov[3] = {
+        { "PAGE ", 5 },
+        { (void *)text, len },
+        { EOL, 2 }
+    };
+    OUTQ_MSG *msg = outq_msg_new(iov,3);
+    if (msg==NULL) {
+        return -1;
+    }
+    TU *group[PBX_PAGE_BATCH];
+    int delivered = 0;
+    tu_batch_begin();
+    for (int s=0;s<PBX_SHARDS;s++) {
+        SHARD *sh = &pbx->shards[s];
+        int idx = 0, n;
+        do {
+            n = 0;
+            int e = shard_read_lock(sh);
+            SLOTS *slots = __atomic_load_n(&sh->slots,__ATOMIC_ACQUIRE);
+            for (;slots!=NULL && idx<slots->cap && n<PBX_PAGE_BATCH;idx++) {
+                TU *tu = __atomic_load_n(&slots->tu[idx],__ATOMIC_ACQUIRE);
+                if (tu!=NULL) {
+                    tu_ref(tu,"Paging");
+                    group[n++] = tu;
+                }
+            }
+            shard_read_unlock(sh,e);
+            for (int i=0;i<n;i++) {
+                if (tu_page(group[i],msg)>0) {
+                    delivered++;
+                }
+                tu_unref(group[i],"Paged");
+            }
+            tu_batch_flush();
+        } while (n==PBX_PAGE_BATCH);
+    }
+    tu_batch_end();
+    outq_msg_unref(msg);
+    metrics_inc(METRIC_PAGES);
+    if (start!=0) {
+        metrics_page_time(metrics_now()-start);
+    }
+    return delivered;
+}
+
+int pbx_add_hunt(PBX *pbx, int ext, const int *agents, int nagents) {
+    if (ext<PBX_FIRST_EXTENSION || pbx->nhunts==PBX_MAX_HUNTS ||
+        pbx_reserved(pbx,ext) || pbx_agent_hunt(pbx,ext)!=NULL) {
+        return -1;
+    }
+    for (int i=0;i<nagents;i++) {
+        if (agents[i]<PBX_FIRST_EXTENSION || agents[i]==ext ||
+            pbx_reserved(pbx,agents[i]) || pbx_agent_hunt(pbx,agents[i])!=NULL) {
+            return -1;
+        }
+    }
+    HUNT *hunt = hunt_new(ext,agents,nagents);
+    if (hunt==NULL) {
+        return -1;
+    }
+    pbx->hunts[pbx->nhunts++] = hunt;
+    return 0;
+}
+
+int pbx_add_paging(PBX *pbx, int ext) {
+    //whoever holds the line is the only one who can page
+    return pbx_add_conf(pbx,ext,1,pbx_page);
+}
 
 /*
  * Initialize a new PBX.
@@ -26,13 +326,68 @@ typedef struct pbx {
  */
 #if 1
 PBX *pbx_init() {
-    Sem_init(&pbx_mutex,0,1);
-    Sem_init(&shutdown_mutex,0,1);
-    Sem_init(&thread_cnt_mutex,0,1);
-    return calloc(1,sizeof(PBX));
+    PBX *pbx = aligned_alloc(64,sizeof(PBX));
+    if (pbx==NULL) {
+        return NULL;
+    }
+    memset(pbx,0,sizeof(PBX));
+    for (int i=0;i<PBX_SHARDS;i++) {
+        pthread_mutex_init(&pbx->shards[i].lock,NULL);
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&pbx->drain_cond,&attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&pbx->drain_lock,NULL);
+    return pbx;
 }
 #endif
 
+/*
+ * Drain a PBX: refuse new registrations, shut down the connection of every
+ * registered TU in one pass over the registry and wait, until a deadline,
+ * for all of them to be unregistered.
+ */
+long pbx_drain(PBX *pbx, long timeout_ms, long *elapsed_ms) {
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    deadline.tv_sec = start.tv_sec + timeout_ms/1000;
+    deadline.tv_nsec = start.tv_nsec + timeout_ms%1000*1000000;
+    if (deadline.tv_nsec>=1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&pbx->drain_lock);
+    pbx->draining = 1;
+    pthread_mutex_unlock(&pbx->drain_lock);
+
+    for (int s=0;s<PBX_SHARDS;s++) {
+        SHARD *sh = &pbx->shards[s];
+        pthread_mutex_lock(&sh->lock);
+        for (int i=0;sh->count>0 && i<sh->slots->cap;i++) {
+            if (sh->slots->tu[i]!=NULL) {
+                shutdown(tu_fileno(sh->slots->tu[i]),SHUT_RDWR);
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    pthread_mutex_lock(&pbx->drain_lock);
+    while (pbx->registered>0 &&
+           pthread_cond_timedwait(&pbx->drain_cond,&pbx->drain_lock,&deadline)!=ETIMEDOUT)
+        ;
+    long left = pbx->registered;
+    pthread_mutex_unlock(&pbx->drain_lock);
+
+    if (elapsed_ms!=NULL) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        *elapsed_ms = (end.tv_sec-start.tv_sec)*1000 + (end.tv_nsec-start.tv_nsec)/1000000;
+    }
+    return left;
+}
+
 /*
  * Shut down a pbx, shutting down all network connections, waiting for all server
  * threads to terminate, and freeing all associated resources.
@@ -45,29 +400,84 @@ PBX *pbx_init() {
  */
 #if 1
 void pbx_shutdown(PBX *pbx) {
-    P(&pbx_mutex);
-    for (int i=0;i<PBX_MAX_EXTENSIONS;i++) {
-        if (pbx->tu_count==0) {
-            break;
-        }
-        if (pbx->tu_list[i]!=NULL) {
-            shutdown(tu_fileno(pbx->tu_list[i]),SHUT_RDWR);
-            pbx->tu_count--;
-            //while (pbx->tu_list!= NULL);
-            //pbx_unregister(pbx,pbx->tu_list[i]);
-        }
+    //a drain that has run already is not waited for again
+    pthread_mutex_lock(&pbx->drain_lock);
+    long timeout_ms = pbx->draining ? 0 : PBX_DRAIN_TIMEOUT_MS;
+    pthread_mutex_unlock(&pbx->drain_lock);
+    if (pbx_drain(pbx,timeout_ms,NULL)>0) {
+        //threads that have not let go of their TUs may still use the registry
+        debug("PBX not drained, leaving the registry in place");
+        return;
     }
-    
-    V(&pbx_mutex);
-    //while(pbx->tu_count!=0);
-    P(&shutdown_mutex);
+    //every member has left its conference, and every agent its hunt group,
+    //on being unregistered
+    for (int i=0;i<pbx->nbridges;i++) {
+        conf_free(pbx->bridges[i]);
+    }
+    for (int i=0;i<pbx->nhunts;i++) {
+        hunt_free(pbx->hunts[i]);
+    }
+    for (int s=0;s<PBX_SHARDS;s++) {
+        free(pbx->shards[s].slots);
+        free(pbx->shards[s].free_idx);
+        pthread_mutex_destroy(&pbx->shards[s].lock);
+    }
+    pthread_cond_destroy(&pbx->drain_cond);
+    pthread_mutex_destroy(&pbx->drain_lock);
     free(pbx);
-    pbx=NULL;
-    V(&shutdown_mutex);
-
 }
 #endif
 
+/*
+ * Enter a TU into the registry at an extension, or at a free one if ext is
+ * PBX_ANY_EXTENSION, without notifying its client.
+ *
+ * @return the extension, or -1 if it is taken or the PBX is draining.
+ */
+static int pbx_insert(PBX *pbx, TU *tu, int ext) {
+    SHARD *sh;
+    int idx;
+    if (ext==PBX_ANY_EXTENSION) {
+        int s = __atomic_fetch_add(&pbx->next_shard,1,__ATOMIC_RELAXED)%PBX_SHARDS;
+        sh = &pbx->shards[s];
+        pthread_mutex_lock(&sh->lock);
+        //the index of a reserved extension is taken here and never released
+        do {
+            idx = shard_alloc_index(sh);
+            ext = SHARD_EXT(s,idx);
+        } while (pbx_reserved(pbx,ext));
+    }
+    else if (ext>=PBX_FIRST_EXTENSION && !pbx_reserved(pbx,ext)) {
+        sh = &pbx->shards[EXT_SHARD(ext)];
+        idx = EXT_INDEX(ext);
+        pthread_mutex_lock(&sh->lock);
+    }
+    else {
+        return -1;
+    }
+    //checked with the shard locked, so a drain either refuses the TU here or
+    //finds it in the shard when it gets the lock
+    pthread_mutex_lock(&pbx->drain_lock);
+    if (pbx->draining) {
+        pthread_mutex_unlock(&pbx->drain_lock);
+        pthread_mutex_unlock(&sh->lock);
+        return -1;
+    }
+    pbx->registered++;
+    pthread_mutex_unlock(&pbx->drain_lock);
+    if (shard_grow(sh,idx)<0 || sh->slots->tu[idx]!=NULL) {
+        pthread_mutex_unlock(&sh->lock);
+        pbx_unregistered(pbx);
+        return -1;
+    }
+    //the reference is taken before the TU becomes visible to lookups
+    tu_ref(tu,"Registering TU with PBX");
+    __atomic_store_n(&sh->slots->tu[idx],tu,__ATOMIC_RELEASE);
+    sh->count++;
+    pthread_mutex_unlock(&sh->lock);
+    return ext;
+}
+
 /*
  * Register a telephone unit with a PBX at a specified extension number.
  * This amounts to "plugging a telephone unit into the PBX".
@@ -79,35 +489,39 @@ void pbx_shutdown(PBX *pbx) {
  *
  * @param pbx  The PBX registry.
  * @param tu  The TU to be registered.
- * @param ext  The extension number on which the TU is to be registered.
+ * @param ext  The extension number on which the TU is to be registered, or
+ * PBX_ANY_EXTENSION to have the PBX pick a free one.
  * @return 0 if registration succeeds, otherwise -1.
  */
 #if 1
 int pbx_register(PBX *pbx, TU *tu, int ext) {
-    int ret = 0;
-    P(&pbx_mutex);
-    if (pbx->tu_list[ext]==NULL) {
-        pbx->tu_list[ext]=tu; 
-    }
-    else{
-        ret = -1;
-        //no reason why the tu_list at that index should not be null but just in case
+    if ((ext = pbx_insert(pbx,tu,ext))<0) {
+        return -1;
     }
-    pbx->tu_count++;
-    V(&pbx_mutex);
-    tu_ref(tu,"Registering TU with PBX");
     tu_set_extension(tu,ext);
-
-    P(&thread_cnt_mutex);
-    thread_cnt++;
-    if (thread_cnt==1) {
-        P(&shutdown_mutex);
+    metrics_inc(METRIC_REGISTRATIONS);
+    HUNT *hunt = pbx_agent_hunt(pbx,ext);
+    if (hunt!=NULL) {
+        tu_join_hunt(tu,hunt);
     }
-    V(&thread_cnt_mutex);
-    return ret;
+    return 0;
 }
 #endif
 
+/*
+ * Register a TU restored by another process at its old extension.
+ */
+int pbx_restore(PBX *pbx, TU *tu, int ext) {
+    if (pbx_insert(pbx,tu,ext)<0) {
+        return -1;
+    }
+    HUNT *hunt = pbx_agent_hunt(pbx,ext);
+    if (hunt!=NULL) {
+        tu_join_hunt(tu,hunt);
+    }
+    return 0;
+}
+
 /*
  * Unregister a TU from a PBX.
  * This amounts to "unplugging a telephone unit from the PBX".
@@ -125,21 +539,33 @@ int pbx_register(PBX *pbx, TU *tu, int ext) {
 #if 1
 int pbx_unregister(PBX *pbx, TU *tu) {
     int ret = 0;
-    P(&pbx_mutex);
-    pbx->tu_list[tu_extension(tu)] = NULL;
-    //pbx->tu_count--;
-    V(&pbx_mutex);
+    int removed = 0;
+    int ext = tu_extension(tu);
+    if (ext>=PBX_FIRST_EXTENSION) {
+        SHARD *sh = &pbx->shards[EXT_SHARD(ext)];
+        int idx = EXT_INDEX(ext);
+        pthread_mutex_lock(&sh->lock);
+        if (shard_slot(sh,idx)==tu) {
+            __atomic_store_n(&sh->slots->tu[idx],NULL,__ATOMIC_SEQ_CST);
+            sh->count--;
+            //lookups that found the TU have taken their own references by now
+            shard_synchronize(sh);
+            shard_release_index(sh,idx);
+            removed = 1;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    //before the hangup, so that it can't make the TU take a waiting caller
+    tu_leave_hunt(tu);
     if (tu_hangup(tu) == -1) {
         ret = -1;
     }
     
     tu_unref(tu,"Unregistering TU from PBX");
-    P(&thread_cnt_mutex);
-    thread_cnt--;
-    if (thread_cnt==0) {
-        V(&shutdown_mutex);
+    metrics_inc(METRIC_UNREGISTRATIONS);
+    if (removed) {
+        pbx_unregistered(pbx);
     }
-    V(&thread_cnt_mutex);
     return ret;
 }
 #endif
@@ -154,10 +580,31 @@ int pbx_unregister(PBX *pbx, TU *tu) {
  */
 #if 1
 int pbx_dial(PBX *pbx, TU *tu, int ext) {
-    TU *target;
-    P(&pbx_mutex);
-        target = pbx->tu_list[ext];
-    V(&pbx_mutex);
-    return tu_dial(tu, target);
+    CONF *conf = pbx_bridge(pbx, ext);
+    if (conf!=NULL) {
+        return tu_dial_bridge(tu, conf);
+    }
+    HUNT *hunt = pbx_hunt(pbx, ext);
+    if (hunt!=NULL) {
+        return tu_dial_hunt(tu, hunt);
+    }
+    TU *target = pbx_lookup(pbx, ext);
+    int ret = tu_dial(tu, target);
+    if (target!=NULL) {
+        tu_unref(target,"Dial completed");
+    }
+    return ret;
 }
 #endif
+
+/*
+ * Have a TU watch the state of an extension.
+ */
+int pbx_watch(PBX *pbx, TU *tu, int ext) {
+    TU *target = pbx_lookup(pbx, ext);
+    int ret = tu_watch(tu, ext, target);
+    if (target!=NULL) {
+        tu_unref(target,"Watch started");
+    }
+    return ret;
+}
@@ -0,0 +1,237 @@
+/*
+ * Pool: fixed-size object allocator with per-thread caches.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "debug.h"
+
+//bytes carved into objects at a time
+#define POOL_SLAB_SIZE (64*1024)
+//most objects moved between a thread's cache and its pool at a time
+#define POOL_BATCH 32
+//but no more than this many bytes' worth of them
+#define POOL_BATCH_BYTES (16*1024)
+
+static POOL *pools[POOL_MAX];
+static int pool_count;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+
+/*
+ * Free objects cached by the calling thread, one list per pool.
+ * The first word of a free object links it to the next one.
+ * A thread starts by taking single objects and doubles its batch with
+ * every refill, so that short-lived threads (one per connection) don't
+ * hoard objects that long-lived ones would make good use of.
+ */
+static __thread struct {
+    void *head;
+    int count;
+    int batch;
+} pool_cache[POOL_MAX];
+static __thread int pool_thread_shard = -1;
+static __thread int pool_thread_known;
+
+static volatile unsigned int next_shard;
+
+static void counter_add(POOL *pool, long n) {
+    if (pool_thread_shard<0) {
+        pool_thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % POOL_COUNTER_SHARDS;
+    }
+    __atomic_add_fetch(&pool->in_use[pool_thread_shard].n, n, __ATOMIC_RELAXED);
+}
+
+//move up to n objects from the calling thread's cache back to the pool
+static void cache_flush(POOL *pool, int n) {
+    int id = pool->id;
+    void *head = pool_cache[id].head;
+    void *tail = head;
+    int moved = 1;
+    if (head==NULL || n<1) {
+        return;
+    }
+    while (moved<n && *(void **)tail!=NULL) {
+        tail = *(void **)tail;
+        moved++;
+    }
+    pool_cache[id].head = *(void **)tail;
+    pool_cache[id].count -= moved;
+    pthread_mutex_lock(&pool->lock);
+    *(void **)tail = pool->free;
+    pool->free = head;
+    pool->nfree += moved;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+//return everything cached by a thread that is exiting
+static void pool_thread_exit(void *arg) {
+    for (int i=0;i<POOL_MAX;i++) {
+        POOL *pool = __atomic_load_n(&pools[i], __ATOMIC_ACQUIRE);
+        if (pool!=NULL) {
+            cache_flush(pool, pool_cache[i].count);
+        }
+    }
+}
+
+static void pool_key_create(void) {
+    pthread_key_create(&pool_key, pool_thread_exit);
+}
+
+//arrange for the calling thread's caches to be flushed when it exits
+static void pool_thread_init(void) {
+    pthread_once(&pool_key_once, pool_key_create);
+    //any non-NULL value makes the destructor run
+    pthread_setspecific(pool_key, pool_cache);
+    pool_thread_known = 1;
+}
+
+//assign a pool its cache index on first use
+static int pool_register(POOL *pool) {
+    pthread_mutex_lock(&pools_lock);
+    if (pool->id<0) {
+        if (pool_count==POOL_MAX) {
+            pthread_mutex_unlock(&pools_lock);
+            return -1;
+        }
+        size_t align = pool->align<sizeof(void *) ? sizeof(void *) : pool->align;
+        size_t size = pool->size<sizeof(void *) ? sizeof(void *) : pool->size;
+        pool->align = align;
+        pool->slot = (size+align-1)/align*align;
+        pool->batch = POOL_BATCH_BYTES/pool->slot;
+        if (pool->batch>POOL_BATCH) {
+            pool->batch = POOL_BATCH;
+        }
+        if (pool->batch<1) {
+            pool->batch = 1;
+        }
+        __atomic_store_n(&pools[pool_count], pool, __ATOMIC_RELEASE);
+        __atomic_store_n(&pool->id, pool_count, __ATOMIC_RELEASE);
+        pool_count++;
+        debug("Pool %s: %zu byte objects in %zu byte slots", pool->name, pool->size, pool->slot);
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return 0;
+}
+
+//carve a new slab into free objects, pool has to be locked
+static int pool_grow(POOL *pool) {
+    size_t size = pool->slot>POOL_SLAB_SIZE ? pool->slot : POOL_SLAB_SIZE;
+    size_t n = size/pool->slot;
+    char *slab = aligned_alloc(pool->align, n*pool->slot);
+    if (slab==NULL) {
+        return -1;
+    }
+    for (size_t i=0;i<n;i++) {
+        void *obj = slab+i*pool->slot;
+        *(void **)obj = pool->free;
+        pool->free = obj;
+    }
+    pool->nfree += n;
+    pool->capacity += n;
+    pool->slabs++;
+    return 0;
+}
+
+//refill the calling thread's cache from the pool, then allocate from it
+static void *pool_alloc_slow(POOL *pool) {
+    if (__atomic_load_n(&pool->id, __ATOMIC_ACQUIRE)<0 && pool_register(pool)<0) {
+        return NULL;
+    }
+    if (!pool_thread_known) {
+        pool_thread_init();
+    }
+    int id = pool->id;
+    int want = pool_cache[id].batch>0 ? pool_cache[id].batch : 1;
+    if (want<pool->batch) {
+        pool_cache[id].batch = 2*want<pool->batch ? 2*want : pool->batch;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free==NULL && pool_grow(pool)<0) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    void *head = pool->free, *tail = head;
+    int moved = 1;
+    while (moved<want && *(void **)tail!=NULL) {
+        tail = *(void **)tail;
+        moved++;
+    }
+    pool->free = *(void **)tail;
+    pool->nfree -= moved;
+    pthread_mutex_unlock(&pool->lock);
+    *(void **)tail = NULL;
+
+    //the first object is returned, the others are cached
+    pool_cache[id].head = *(void **)head;
+    pool_cache[id].count = moved-1;
+    counter_add(pool, 1);
+    return head;
+}
+
+void *pool_alloc(POOL *pool) {
+    int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (id<0 || pool_cache[id].head==NULL) {
+        return pool_alloc_slow(pool);
+    }
+    void *obj = pool_cache[id].head;
+    pool_cache[id].head = *(void **)obj;
+    pool_cache[id].count--;
+    counter_add(pool, 1);
+    return obj;
+}
+
+void *pool_zalloc(POOL *pool) {
+    void *obj = pool_alloc(pool);
+    if (obj!=NULL) {
+        memset(obj, 0, pool->size);
+    }
+    return obj;
+}
+
+void pool_free(POOL *pool, void *obj) {
+    if (obj==NULL) {
+        return;
+    }
+    //an object can only come from a pool that is in use, so id is set
+    int id = pool->id;
+    if (!pool_thread_known) {
+        pool_thread_init();
+    }
+    *(void **)obj = pool_cache[id].head;
+    pool_cache[id].head = obj;
+    pool_cache[id].count++;
+    counter_add(pool, -1);
+    if (pool_cache[id].count>=2*pool->batch) {
+        cache_flush(pool, pool->batch);
+    }
+}
+
+/*
+ * Get the occupancy of every pool in use.
+ */
+int pool_stats(POOL_STATS *stats, int max) {
+    int n = 0;
+    pthread_mutex_lock(&pools_lock);
+    for (int i=0;i<pool_count && n<max;i++) {
+        POOL *pool = pools[i];
+        long in_use = 0;
+        for (int j=0;j<POOL_COUNTER_SHARDS;j++) {
+            in_use += __atomic_load_n(&pool->in_use[j].n, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_lock(&pool->lock);
+        stats[n].name = pool->name;
+        stats[n].slot_size = pool->slot;
+        stats[n].slabs = pool->slabs;
+        stats[n].capacity = pool->capacity;
+        stats[n].pooled = pool->nfree;
+        pthread_mutex_unlock(&pool->lock);
+        stats[n].in_use = in_use<0 ? 0 : in_use;
+        n++;
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return n;
+}
@@ -0,0 +1,282 @@
+/*
+ * Presence: watches of extension states, with coalesced notifications.
+ */
+#include <stdlib.h>
+
+#include "presence.h"
+#include "pool.h"
+#include "metrics.h"
+#include "debug.h"
+#include "csapp.h"
+
+//slots of the index of watches, a power of 2; consecutive extensions never share one
+#define PRESENCE_SLOTS 256
+//"PRESENCE ", an extension, a space, the longest state name and the EOL
+#define PRESENCE_LINE_MAX 48
+//lines rendered into one buffer before it is queued
+#define PRESENCE_BATCH 32
+
+typedef struct watch {
+    int ext;
+    WATCHER *watcher;
+    TU_STATE state;             //latest state of the extension
+    int pending;                //on the watcher's list of changes to send
+    struct watch *prev;         //in the slot of the extension, under its lock
+    struct watch *next;
+    struct watch *next_pending; //under the lock of the watcher
+    struct watch *next_own;     //in the watcher's list of its watches
+} WATCH;
+
+typedef struct watcher {
+    pthread_mutex_t lock;
+    OUTQ *q; //not referenced: the queue owns the watcher
+    WATCH *watches;
+    int count;
+    //changes to send, in the order the watches first changed
+    WATCH *pending;
+    WATCH **pending_tail;
+    //on the list of the thread that will send the changes
+    int scheduled;
+    struct watcher *next_scheduled;
+} WATCHER;
+
+typedef struct slot {
+    pthread_mutex_t lock;
+    WATCH *head; //read without the lock to skip extensions nobody watches
+} __attribute__((aligned(64))) SLOT;
+
+static SLOT slots[PRESENCE_SLOTS] = {
+    [0 ... PRESENCE_SLOTS-1] = { PTHREAD_MUTEX_INITIALIZER, NULL }
+};
+
+static POOL watch_pool = POOL_INITIALIZER("watch", sizeof(WATCH), sizeof(void *));
+
+//watchers with changes made by the calling thread, each holding a reference to its queue
+static __thread WATCHER *scheduled;
+
+static SLOT *slot_of(int ext) {
+    return &slots[(unsigned int)ext & (PRESENCE_SLOTS-1)];
+}
+
+/*
+ * Queue a line for each pending change of a watcher whose output is not
+ * waiting for the socket, watcher has to be locked.
+ * @return the number of lines queued.
+ */
+static int watcher_send_locked(WATCHER *w) {
+    if (w->pending==NULL || outq_busy(w->q)) {
+        return 0;
+    }
+    char buf[PRESENCE_BATCH*PRESENCE_LINE_MAX];
+    int len = 0, n = 0;
+    while (w->pending!=NULL) {
+        WATCH *wt = w->pending;
+        w->pending = wt->next_pending;
+        wt->pending = 0;
+        len += snprintf(buf+len, PRESENCE_LINE_MAX, "PRESENCE %d %s" EOL,
+                        wt->ext, tu_state_names[wt->state]);
+        if (++n%PRESENCE_BATCH==0 || w->pending==NULL) {
+            //a client that can't take the lines misses them, as with any notification
+            outq_append(w->q, buf, len);
+            len = 0;
+        }
+    }
+    w->pending_tail = &w->pending;
+    metrics_add(METRIC_PRESENCE, n);
+    return n;
+}
+
+//the output of a watcher's client has caught up: send what changed meanwhile
+static void watcher_drained(void *arg) {
+    WATCHER *w = arg;
+    pthread_mutex_lock(&w->lock);
+    int n = watcher_send_locked(w);
+    pthread_mutex_unlock(&w->lock);
+    if (n>0) {
+        outq_flush(w->q);
+    }
+}
+
+static void watcher_free(void *arg) {
+    WATCHER *w = arg;
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
+
+WATCHER *presence_watcher_new(OUTQ *q) {
+    WATCHER *w = calloc(1, sizeof(WATCHER));
+    if (w==NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    w->q = q;
+    w->pending_tail = &w->pending;
+    outq_set_drained(q, watcher_drained, watcher_free, w);
+    return w;
+}
+
+//have a watch's latest state sent, watcher has to be locked
+static void watch_changed_locked(WATCH *wt, TU_STATE state) {
+    WATCHER *w = wt->watcher;
+    if (wt->pending) {
+        //the state it was in before is never sent
+        metrics_inc(METRIC_PRESENCE_COALESCED);
+    }
+    else {
+        wt->pending = 1;
+        wt->next_pending = NULL;
+        *w->pending_tail = wt;
+        w->pending_tail = &wt->next_pending;
+    }
+    wt->state = state;
+    if (!w->scheduled) {
+        w->scheduled = 1;
+        w->next_scheduled = scheduled;
+        scheduled = w;
+        outq_ref(w->q);
+    }
+}
+
+int presence_watch(WATCHER *w, int ext, int state) {
+    SLOT *sl = slot_of(ext);
+    WATCH *wt;
+    pthread_mutex_lock(&sl->lock);
+    for (wt = sl->head; wt!=NULL; wt = wt->next) {
+        if (wt->ext==ext && wt->watcher==w) {
+            break;
+        }
+    }
+    if (wt==NULL) {
+        if (w->count>=PRESENCE_MAX_WATCHES || (wt = pool_alloc(&watch_pool))==NULL) {
+            pthread_mutex_unlock(&sl->lock);
+            return -1;
+        }
+        wt->ext = ext;
+        wt->watcher = w;
+        wt->pending = 0;
+        wt->prev = NULL;
+        wt->next = sl->head;
+        if (wt->next!=NULL) {
+            wt->next->prev = wt;
+        }
+        __atomic_store_n(&sl->head, wt, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&w->lock);
+        wt->next_own = w->watches;
+        w->watches = wt;
+        w->count++;
+        pthread_mutex_unlock(&w->lock);
+    }
+    if (state>=0) {
+        pthread_mutex_lock(&w->lock);
+        watch_changed_locked(wt, state);
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_unlock(&sl->lock);
+    return 0;
+}
+
+//take a watch out of the index
+static void watch_unlink(WATCH *wt) {
+    SLOT *sl = slot_of(wt->ext);
+    pthread_mutex_lock(&sl->lock);
+    if (wt->prev!=NULL) {
+        wt->prev->next = wt->next;
+    }
+    else {
+        __atomic_store_n(&sl->head, wt->next, __ATOMIC_RELAXED);
+    }
+    if (wt->next!=NULL) {
+        wt->next->prev = wt->prev;
+    }
+    pthread_mutex_unlock(&sl->lock);
+}
+
+int presence_unwatch(WATCHER *w, int ext) {
+    WATCH **own = &w->watches;
+    while (*own!=NULL && (*own)->ext!=ext) {
+        own = &(*own)->next_own;
+    }
+    WATCH *wt = *own;
+    if (wt==NULL) {
+        return -1;
+    }
+    //once out of the index, only the watcher can still reach it
+    watch_unlink(wt);
+    pthread_mutex_lock(&w->lock);
+    *own = wt->next_own;
+    w->count--;
+    if (wt->pending) {
+        WATCH **p = &w->pending;
+        while (*p!=wt) {
+            p = &(*p)->next_pending;
+        }
+        *p = wt->next_pending;
+        if (w->pending_tail==&wt->next_pending) {
+            w->pending_tail = p;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    pool_free(&watch_pool, wt);
+    return 0;
+}
+
+void presence_unwatch_all(WATCHER *w) {
+    for (WATCH *wt = w->watches; wt!=NULL; wt = wt->next_own) {
+        watch_unlink(wt);
+    }
+    pthread_mutex_lock(&w->lock);
+    WATCH *wt = w->watches;
+    w->watches = NULL;
+    w->count = 0;
+    w->pending = NULL;
+    w->pending_tail = &w->pending;
+    pthread_mutex_unlock(&w->lock);
+    while (wt!=NULL) {
+        WATCH *next = wt->next_own;
+        pool_free(&watch_pool, wt);
+        wt = next;
+    }
+}
+
+/*
+ * A watch added while the TU was locked was published before the lock was
+ * released, so the unlocked check can't miss it.
+ */
+void presence_changed(int ext, TU_STATE state) {
+    SLOT *sl = slot_of(ext);
+    if (__atomic_load_n(&sl->head, __ATOMIC_RELAXED)==NULL) {
+        return;
+    }
+    pthread_mutex_lock(&sl->lock);
+    for (WATCH *wt = sl->head; wt!=NULL; wt = wt->next) {
+        if (wt->ext==ext) {
+            pthread_mutex_lock(&wt->watcher->lock);
+            watch_changed_locked(wt, state);
+            pthread_mutex_unlock(&wt->watcher->lock);
+        }
+    }
+    pthread_mutex_unlock(&sl->lock);
+}
+
+/*
+ * The lines are rendered from the latest states only now, so changes made
+ * since the watcher was scheduled, by this thread or any other, go out
+ * with them.
+ */
+void presence_dispatch(void (*flush)(OUTQ *q)) {
+    while (scheduled!=NULL) {
+        WATCHER *w = scheduled;
+        scheduled = w->next_scheduled;
+        OUTQ *q = w->q;
+        pthread_mutex_lock(&w->lock);
+        w->scheduled = 0;
+        int n = watcher_send_locked(w);
+        pthread_mutex_unlock(&w->lock);
+        if (n>0) {
+            flush(q);
+        }
+        else {
+            outq_unref(q);
+        }
+    }
+}
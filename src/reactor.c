@@ -0,0 +1,783 @@
+/*
+ * Reactor: event-driven server front end.
+ * A small fixed set of loop threads multiplex all client sockets with epoll
+ * or io_uring, split the received bytes into lines and dispatch them to the PBX.
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "reactor.h"
+#include "service.h"
+#include "workers.h"
+#include "tu_ext.h"
+#include "outq.h"
+#include "uring.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define REACTOR_MAX_EVENTS 64
+//unexecuted input held for a connection before the loop stops reading from it
+#define REACTOR_MAX_BACKLOG (16*MAXLINE)
+//submission queue entries of a loop's io_uring
+#define REACTOR_URING_ENTRIES 1024
+//buffers that a loop's io_uring receives into, shared by all its connections
+#define REACTOR_URING_BUFS 128
+//longest partial line kept in the CONN itself, and in a short line buffer
+#define REACTOR_INLINE_LINE 48
+#define REACTOR_SHORT_LINE 256
+
+/*
+ * What an io_uring completion is for, in the low bits of its user_data.
+ */
+enum {
+    REACTOR_RECV,   //receive of the CONN
+    REACTOR_SEND,   //send of an output queue, see outq_use_uring()
+    REACTOR_WAKE    //poll of the loop's eventfd
+};
+#define REACTOR_TAG_MASK 3UL
+
+struct loop;
+
+/*
+ * State kept for each client connection.
+ * Bytes of an incomplete line are parked between reads in the structure
+ * itself if they are few, as commands are short, and otherwise in the
+ * smallest pool buffer they fit, so that only a partial line longer than
+ * REACTOR_SHORT_LINE holds a MAXLINE buffer.
+ *
+ * With a worker pool, the loop thread only reads: complete lines are
+ * appended to the backlog and the connection itself is the task that a
+ * worker runs to execute them.  A connection is queued at most once at a
+ * time, so its commands are executed in order by one worker at a time.
+ */
+typedef struct conn {
+    int fd;
+    TU *tu;
+    char *pending; //partial line left over from the last read, or NULL
+    int pending_len;
+    char pending_buf[REACTOR_INLINE_LINE]; //pending, if it fits
+    struct conn *prev, *next; //connections of the same loop, see loop->conns
+    //only used with io_uring, and only by the loop thread
+    int recv_armed; //a receive is in flight
+    int closing;    //client has gone away, the receive is never armed again
+    //with io_uring, queued for the loop to arm the receive, see loop->arm
+    struct conn *arm_next;
+    int arm_queued;
+    //the rest is only used with a worker pool, and protected by lock
+    TASK task;
+    struct loop *lp;
+    pthread_mutex_t lock;
+    char *backlog; //complete lines not yet executed
+    int backlog_len;
+    int backlog_cap;
+    int scheduled; //queued on or being run by a worker
+    int throttled; //removed from the epoll set until the backlog is taken
+    int eof;       //client has gone away, close once the backlog is done
+} CONN;
+
+typedef struct loop {
+    int epfd;
+    int wakefd; //eventfd that interrupts epoll_wait() to pause the loop
+    pthread_t tid;
+    pthread_mutex_t conns_lock;
+    CONN *conns; //every open connection of the loop
+    //with io_uring, connections whose receive other threads want armed
+    URING *ring;
+    pthread_mutex_t arm_lock;
+    CONN *arm;
+    char buf[MAXLINE]; //scratch buffer that lines are assembled in
+} LOOP;
+
+static POOL conn_pool = POOL_INITIALIZER("conn", sizeof(CONN), 64);
+static POOL short_line_pool = POOL_INITIALIZER("short_line", REACTOR_SHORT_LINE, 64);
+
+static LOOP *loops;
+static int loop_count;
+static REACTOR_BACKEND backend;
+static volatile unsigned int next_loop;
+
+//backlog that a worker swaps with the one of the connection it runs
+static __thread char *work_buf;
+static __thread int work_cap;
+
+/*
+ * Pausing, see reactor_pause(): the loops wait on pause_cond while paused
+ * is set, and connections queued on or run by a worker are counted in
+ * scheduled, so that the pool can be waited for to go quiet.
+ */
+static int paused;
+static int paused_loops;
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static int scheduled;
+
+static void conn_link(LOOP *lp, CONN *conn) {
+    pthread_mutex_lock(&lp->conns_lock);
+    conn->prev = NULL;
+    conn->next = lp->conns;
+    if (lp->conns!=NULL) {
+        lp->conns->prev = conn;
+    }
+    lp->conns = conn;
+    pthread_mutex_unlock(&lp->conns_lock);
+}
+
+static void conn_unlink(LOOP *lp, CONN *conn) {
+    pthread_mutex_lock(&lp->conns_lock);
+    if (conn->prev!=NULL) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        lp->conns = conn->next;
+    }
+    if (conn->next!=NULL) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&lp->conns_lock);
+}
+
+//wake a loop thread up, to pause or to arm receives
+static void loop_wake(LOOP *lp) {
+    uint64_t one = 1;
+    if (write(lp->wakefd, &one, sizeof(one))<0) {
+        unix_error("eventfd write error");
+    }
+}
+
+//have the loop thread of a connection arm its receive, called by other threads
+static void conn_arm_later(LOOP *lp, CONN *conn) {
+    pthread_mutex_lock(&lp->arm_lock);
+    if (!conn->arm_queued) {
+        conn->arm_queued = 1;
+        conn->arm_next = lp->arm;
+        lp->arm = conn;
+    }
+    pthread_mutex_unlock(&lp->arm_lock);
+    loop_wake(lp);
+}
+
+//take a connection that is about to be freed off the list of its loop
+static void conn_arm_drop(LOOP *lp, CONN *conn) {
+    pthread_mutex_lock(&lp->arm_lock);
+    if (conn->arm_queued) {
+        CONN **p = &lp->arm;
+        while (*p!=conn) {
+            p = &(*p)->arm_next;
+        }
+        *p = conn->arm_next;
+        conn->arm_queued = 0;
+    }
+    pthread_mutex_unlock(&lp->arm_lock);
+}
+
+//park a partial line of a connection in the smallest buffer that it fits
+//return 0 if successful, -1 if out of memory
+static int conn_park(CONN *conn, const char *line, int len) {
+    if (len<=REACTOR_INLINE_LINE) {
+        conn->pending = conn->pending_buf;
+    }
+    else if ((conn->pending = pool_alloc(len<=REACTOR_SHORT_LINE ? &short_line_pool
+                                                                : &service_line_pool))==NULL) {
+        return -1;
+    }
+    memcpy(conn->pending, line, len);
+    conn->pending_len = len;
+    return 0;
+}
+
+//release the buffer of the partial line of a connection, if it has one
+static void conn_park_free(CONN *conn) {
+    if (conn->pending_len>REACTOR_SHORT_LINE) {
+        pool_free(&service_line_pool, conn->pending);
+    }
+    else if (conn->pending_len>REACTOR_INLINE_LINE) {
+        pool_free(&short_line_pool, conn->pending);
+    }
+    conn->pending = NULL;
+    conn->pending_len = 0;
+}
+
+//tear down a connection once the client has gone away
+static void conn_free(CONN *conn) {
+    TU *tu = conn->tu;
+    conn_unlink(conn->lp, conn);
+    if (backend==REACTOR_URING) {
+        conn_arm_drop(conn->lp, conn);
+    }
+    conn_park_free(conn);
+    if (workers_running()) {
+        pthread_mutex_destroy(&conn->lock);
+        free(conn->backlog);
+    }
+    pool_free(&conn_pool, conn);
+    //last, as shutdown completes once every TU is unregistered
+    //the TU owns the socket, it is closed when the last reference is released
+    pbx_unregister(pbx, tu);
+}
+
+//arm a receive of a connection into the loop's provided buffers
+//it is one-shot, so that as with epoll a connection is read once per round
+//and a client flooding the server cannot pull in more than its output can take
+static int conn_arm_recv(LOOP *lp, CONN *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(lp->ring);
+    if (sqe==NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (unsigned long)conn | REACTOR_RECV;
+    conn->recv_armed = 1;
+    return 0;
+}
+
+static void conn_close(LOOP *lp, CONN *conn) {
+    if (backend==REACTOR_EPOLL) {
+        epoll_ctl(lp->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    if (!workers_running()) {
+        conn_free(conn);
+        return;
+    }
+    //a worker frees the connection, after executing whatever is left
+    pthread_mutex_lock(&conn->lock);
+    conn->eof = 1;
+    int submit = !conn->scheduled;
+    conn->scheduled = 1;
+    pthread_mutex_unlock(&conn->lock);
+    if (submit) {
+        __atomic_add_fetch(&scheduled, 1, __ATOMIC_RELAXED);
+        workers_submit(&conn->task);
+    }
+}
+
+//execute every complete line in a buffer, return the start of what is left
+//when there are several, their output is sent once they have all been executed
+static char *conn_execute(CONN *conn, char *start, char *end) {
+    char *eol = memchr(start, '\n', end-start);
+    int batch = eol!=NULL && memchr(eol+1, '\n', end-eol-1)!=NULL;
+    if (batch) {
+        tu_batch_begin();
+    }
+    while (eol!=NULL) {
+        execute_client_message(conn->tu, start, eol+1-start);
+        start = eol+1;
+        eol = memchr(start, '\n', end-start);
+    }
+    if (batch) {
+        tu_batch_end();
+    }
+    return start;
+}
+
+//queue complete lines for a worker, called by the loop thread
+static void conn_enqueue(LOOP *lp, CONN *conn, char *lines, int len) {
+    pthread_mutex_lock(&conn->lock);
+    if (conn->backlog_len+len>conn->backlog_cap) {
+        int cap = conn->backlog_cap ? conn->backlog_cap : MAXLINE;
+        while (cap<conn->backlog_len+len) {
+            cap *= 2;
+        }
+        conn->backlog = realloc(conn->backlog, cap);
+        if (conn->backlog==NULL) {
+            unix_error("realloc error");
+        }
+        conn->backlog_cap = cap;
+    }
+    memcpy(conn->backlog+conn->backlog_len, lines, len);
+    conn->backlog_len += len;
+    if (conn->backlog_len>=REACTOR_MAX_BACKLOG && !conn->throttled) {
+        //stop reading until a worker catches up with this client
+        //(with io_uring, the receive in progress is simply not armed again)
+        if (backend==REACTOR_EPOLL) {
+            struct epoll_event ev = { .events = 0, .data.ptr = conn };
+            epoll_ctl(lp->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        }
+        conn->throttled = 1;
+    }
+    int submit = !conn->scheduled;
+    conn->scheduled = 1;
+    pthread_mutex_unlock(&conn->lock);
+    if (submit) {
+        __atomic_add_fetch(&scheduled, 1, __ATOMIC_RELAXED);
+        workers_submit(&conn->task);
+    }
+}
+
+//run by a worker: execute the backlog of a connection
+static void conn_run(TASK *task) {
+    CONN *conn = (CONN *)((char *)task - offsetof(CONN, task));
+    pthread_mutex_lock(&conn->lock);
+    //take the backlog, leaving our empty buffer for the loop to fill meanwhile
+    char *buf = conn->backlog;
+    int len = conn->backlog_len;
+    int cap = conn->backlog_cap;
+    conn->backlog = work_buf;
+    conn->backlog_cap = work_cap;
+    conn->backlog_len = 0;
+    work_buf = buf;
+    work_cap = cap;
+    int arm = 0;
+    if (conn->throttled && !conn->eof) {
+        if (backend==REACTOR_EPOLL) {
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+            epoll_ctl(conn->lp->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        }
+        else {
+            arm = 1;
+        }
+        conn->throttled = 0;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    if (arm) {
+        conn_arm_later(conn->lp, conn);
+    }
+
+    conn_execute(conn, buf, buf+len);
+
+    pthread_mutex_lock(&conn->lock);
+    int more = conn->backlog_len>0;
+    int done = !more && conn->eof;
+    if (!more) {
+        conn->scheduled = 0;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    if (more) {
+        //go to the back of the queue, so that a busy client can't starve others
+        workers_submit(task);
+        return;
+    }
+    if (done) {
+        conn_free(conn);
+    }
+    __atomic_sub_fetch(&scheduled, 1, __ATOMIC_RELEASE);
+}
+
+//move the partial line of a connection to the start of the loop's buffer
+//return its length
+static int conn_unpark(LOOP *lp, CONN *conn) {
+    int len = conn->pending_len;
+    if (len>0) {
+        memcpy(lp->buf, conn->pending, len);
+        conn_park_free(conn);
+    }
+    return len;
+}
+
+//execute every complete line in the first len bytes of the loop's buffer
+//and park what is left as the partial line of the connection
+static void conn_input(LOOP *lp, CONN *conn, int len) {
+    char *buf = lp->buf;
+    char *start = buf;
+    char *end = buf+len;
+    char *eol;
+    if (workers_running()) {
+        //hand everything up to the last complete line to a worker
+        for (eol = end; eol>start && eol[-1]!='\n'; eol--)
+            ;
+        if (eol>start) {
+            conn_enqueue(lp, conn, start, eol-start);
+            start = eol;
+        }
+    }
+    else {
+        start = conn_execute(conn, start, end);
+    }
+
+    len = end-start;
+    if (len==MAXLINE) {
+        //line too long to ever complete, discard it
+        len = 0;
+    }
+    if (len>0 && conn_park(conn, start, len)<0) {
+        unix_error("pool_alloc error");
+    }
+}
+
+//read whatever is available on a connection and execute every complete line
+//return 0 if the connection is still open, -1 if it has been closed
+static int conn_read(LOOP *lp, CONN *conn) {
+    int len = conn_unpark(lp, conn);
+    int n = read(conn->fd, lp->buf+len, MAXLINE-len);
+    if (n<0 && (errno==EINTR || errno==EAGAIN)) {
+        n = 0;
+    }
+    else if (n<=0) {
+        conn_close(lp, conn);
+        return -1;
+    }
+    conn_input(lp, conn, len+n);
+    return 0;
+}
+
+//decide what comes next for a connection once its receive has completed
+static void conn_settle(LOOP *lp, CONN *conn) {
+    if (conn->closing) {
+        conn_close(lp, conn);
+        return;
+    }
+    int throttled = 0;
+    if (workers_running()) {
+        pthread_mutex_lock(&conn->lock);
+        throttled = conn->throttled;
+        pthread_mutex_unlock(&conn->lock);
+    }
+    if (!throttled && conn_arm_recv(lp, conn)<0) {
+        conn_close(lp, conn);
+    }
+}
+
+//execute what a connection has received on the ring
+static void conn_received(LOOP *lp, CONN *conn, struct io_uring_cqe *cqe) {
+    int n = cqe->res;
+    char *data = uring_cqe_buffer(lp->ring, cqe);
+    if (n>0 && data!=NULL) {
+        //the buffer may hold more than the rest of a line fits
+        while (n>0) {
+            int len = conn_unpark(lp, conn);
+            int chunk = n<MAXLINE-len ? n : MAXLINE-len;
+            memcpy(lp->buf+len, data, chunk);
+            conn_input(lp, conn, len+chunk);
+            data += chunk;
+            n -= chunk;
+        }
+    }
+    uring_cqe_buffer_done(lp->ring, cqe);
+    conn->recv_armed = 0;
+    //out of buffers is no reason to close
+    if (cqe->res==0 || (cqe->res<0 && cqe->res!=-ENOBUFS && cqe->res!=-EINTR)) {
+        conn->closing = 1;
+    }
+    conn_settle(lp, conn);
+}
+
+//wait in a loop thread for as long as the reactor is paused
+static void loop_pause(LOOP *lp) {
+    uint64_t count;
+    if (read(lp->wakefd, &count, sizeof(count))<0 && errno!=EAGAIN) {
+        unix_error("eventfd read error");
+    }
+    pthread_mutex_lock(&pause_lock);
+    if (paused) {
+        paused_loops++;
+        pthread_cond_broadcast(&pause_cond);
+        while (paused) {
+            pthread_cond_wait(&pause_cond, &pause_lock);
+        }
+        paused_loops--;
+    }
+    pthread_mutex_unlock(&pause_lock);
+}
+
+static void *reactor_loop(void *arg) {
+    LOOP *lp = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    //leave SIGHUP to the main thread, so that it interrupts accept()
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while(1) {
+        int n = epoll_wait(lp->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n<0) {
+            if (errno==EINTR) {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        int wake = 0;
+        for (int i=0;i<n;i++) {
+            wake |= events[i].data.ptr==NULL;
+        }
+        if (wake) {
+            //the other events are level-triggered and come back after the pause
+            loop_pause(lp);
+            continue;
+        }
+        for (int i=0;i<n;i++) {
+            conn_read(lp, events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+//wait for the eventfd of a loop to be written, on its ring
+static int loop_arm_wake(LOOP *lp) {
+    struct io_uring_sqe *sqe = uring_get_sqe(lp->ring);
+    if (sqe==NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = lp->wakefd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = REACTOR_WAKE;
+    return 0;
+}
+
+//pause if asked to, and arm the receives that other threads asked for
+static void loop_woken(LOOP *lp) {
+    loop_pause(lp);
+    CONN *failed = NULL;
+    pthread_mutex_lock(&lp->arm_lock);
+    //under the lock, as conn_free() may take a connection off the list at any time
+    while (lp->arm!=NULL) {
+        CONN *conn = lp->arm;
+        lp->arm = conn->arm_next;
+        conn->arm_queued = 0;
+        if (!conn->recv_armed && !conn->closing &&
+            conn_arm_recv(lp, conn)<0) {
+            conn->arm_next = failed;
+            failed = conn;
+        }
+    }
+    pthread_mutex_unlock(&lp->arm_lock);
+    while (failed!=NULL) {
+        CONN *conn = failed;
+        failed = conn->arm_next;
+        conn_close(lp, conn);
+    }
+    if (loop_arm_wake(lp)<0) {
+        unix_error("io_uring error");
+    }
+}
+
+/*
+ * Loop thread with io_uring: a receive is kept armed on every connection,
+ * and the output generated while executing what they bring is submitted
+ * to the same ring, so that one io_uring_enter() sends everything from the
+ * last round of completions, arms the receives again and waits for the next.
+ */
+static void *reactor_uring_loop(void *arg) {
+    LOOP *lp = arg;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    outq_use_uring(lp->ring, REACTOR_SEND);
+    if (loop_arm_wake(lp)<0) {
+        unix_error("io_uring error");
+    }
+    while(1) {
+        if (uring_submit(lp->ring, 1)<0 && errno!=EINTR && errno!=EBUSY) {
+            unix_error("io_uring_enter error");
+        }
+        int wake = 0;
+        struct io_uring_cqe *cqe;
+        //output to a client over the whole round goes out in one send
+        tu_batch_begin();
+        for (int i=0;i<REACTOR_MAX_EVENTS && (cqe = uring_peek_cqe(lp->ring))!=NULL;i++) {
+            struct io_uring_cqe c = *cqe;
+            uring_cqe_seen(lp->ring);
+            void *ptr = (void *)(unsigned long)(c.user_data & ~REACTOR_TAG_MASK);
+            switch (c.user_data & REACTOR_TAG_MASK) {
+                case REACTOR_RECV:
+                    conn_received(lp, ptr, &c);
+                    break;
+                case REACTOR_SEND:
+                    outq_uring_complete(ptr, c.res);
+                    break;
+                case REACTOR_WAKE:
+                    wake = 1;
+                    break;
+            }
+        }
+        tu_batch_end();
+        if (wake) {
+            loop_woken(lp);
+        }
+    }
+    return NULL;
+}
+
+//give every loop an io_uring, return -1 if the kernel can't
+static int reactor_uring_init(void) {
+    for (int i=0;i<loop_count;i++) {
+        loops[i].ring = uring_new(REACTOR_URING_ENTRIES, REACTOR_URING_BUFS, MAXLINE);
+        if (loops[i].ring==NULL) {
+            debug("io_uring unavailable: %s", strerror(errno));
+            while (i-->0) {
+                uring_free(loops[i].ring);
+                loops[i].ring = NULL;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int reactor_uring_available(void) {
+    URING *ring = uring_new(REACTOR_URING_ENTRIES, REACTOR_URING_BUFS, MAXLINE);
+    if (ring==NULL) {
+        return 0;
+    }
+    uring_free(ring);
+    return 1;
+}
+
+/*
+ * Start the reactor with the specified number of loop threads.
+ */
+int reactor_init(int nloops, REACTOR_BACKEND want) {
+    if (nloops<1) {
+        return -1;
+    }
+    loops = calloc(nloops, sizeof(LOOP));
+    if (loops==NULL) {
+        return -1;
+    }
+    loop_count = nloops;
+    backend = want;
+    if (backend==REACTOR_URING && reactor_uring_init()<0) {
+        backend = REACTOR_EPOLL;
+    }
+    for (int i=0;i<nloops;i++) {
+        if ((loops[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))<0) {
+            unix_error("eventfd error");
+        }
+        pthread_mutex_init(&loops[i].conns_lock, NULL);
+        pthread_mutex_init(&loops[i].arm_lock, NULL);
+        if (backend==REACTOR_URING) {
+            loops[i].epfd = -1;
+            Pthread_create(&loops[i].tid, NULL, reactor_uring_loop, &loops[i]);
+            Pthread_detach(loops[i].tid);
+            continue;
+        }
+        if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC))<0) {
+            unix_error("epoll_create1 error");
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakefd, &ev)<0) {
+            unix_error("epoll_ctl error");
+        }
+        Pthread_create(&loops[i].tid, NULL, reactor_loop, &loops[i]);
+        Pthread_detach(loops[i].tid);
+    }
+    debug("Reactor started with %d %s loop threads", nloops,
+          backend==REACTOR_URING ? "io_uring" : "epoll");
+    return backend;
+}
+
+static CONN *conn_new(int connfd) {
+    CONN *conn = pool_zalloc(&conn_pool);
+    if (conn==NULL) {
+        return NULL;
+    }
+    conn->fd = connfd;
+    if (workers_running()) {
+        pthread_mutex_init(&conn->lock, NULL);
+        workers_task_init(&conn->task, conn_run);
+    }
+    return conn;
+}
+
+//assign a connection with a registered TU to one of the loop threads
+static int conn_start(CONN *conn) {
+    LOOP *lp = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % loop_count];
+    conn->lp = lp;
+    conn_link(lp, conn);
+    if (backend==REACTOR_URING) {
+        //only the loop thread submits to its ring
+        conn_arm_later(lp, conn);
+        return 0;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, conn->fd, &ev)<0) {
+        conn_free(conn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hand a newly accepted client connection to one of the loop threads.
+ */
+int reactor_add(int connfd) {
+    CONN *conn = conn_new(connfd);
+    if (conn==NULL) {
+        Close(connfd);
+        return -1;
+    }
+    if ((conn->tu = tu_init(connfd))==NULL) {
+        Close(connfd);
+        pool_free(&conn_pool, conn);
+        return -1;
+    }
+    if (pbx_register(pbx, conn->tu, PBX_ANY_EXTENSION)<0) {
+        //never registered, so nobody else can hold a reference; this frees it
+        tu_ref(conn->tu, "Discarding unregistered TU");
+        tu_unref(conn->tu, "Discarding unregistered TU");
+        pool_free(&conn_pool, conn);
+        return -1;
+    }
+    return conn_start(conn);
+}
+
+/*
+ * Take over a connection handed over by another process.
+ */
+int reactor_adopt(TU *tu, const char *pending, int len) {
+    CONN *conn = conn_new(tu_fileno(tu));
+    if (conn==NULL || len>=MAXLINE) {
+        pool_free(&conn_pool, conn);
+        return -1;
+    }
+    conn->tu = tu;
+    if (len>0 && conn_park(conn, pending, len)<0) {
+        pool_free(&conn_pool, conn);
+        return -1;
+    }
+    return conn_start(conn);
+}
+
+/*
+ * Stop the loops and wait for the workers to finish every connection.
+ */
+void reactor_pause(void) {
+    pthread_mutex_lock(&pause_lock);
+    paused = 1;
+    pthread_mutex_unlock(&pause_lock);
+    for (int i=0;i<loop_count;i++) {
+        loop_wake(&loops[i]);
+    }
+    pthread_mutex_lock(&pause_lock);
+    while (paused_loops<loop_count) {
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    }
+    pthread_mutex_unlock(&pause_lock);
+    //nothing new is queued now, so this only goes down
+    while (__atomic_load_n(&scheduled, __ATOMIC_ACQUIRE)>0) {
+        sched_yield();
+    }
+}
+
+void reactor_resume(void) {
+    pthread_mutex_lock(&pause_lock);
+    paused = 0;
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+/*
+ * Call a function for every connection of a paused reactor.
+ */
+void reactor_foreach(void (*fn)(TU *tu, const char *pending, int len, void *arg), void *arg) {
+    for (int i=0;i<loop_count;i++) {
+        pthread_mutex_lock(&loops[i].conns_lock);
+        for (CONN *conn = loops[i].conns; conn!=NULL; conn = conn->next) {
+            fn(conn->tu, conn->pending, conn->pending_len, arg);
+        }
+        pthread_mutex_unlock(&loops[i].conns_lock);
+    }
+}
@@ -3,51 +3,167 @@
  * Manages interaction with a client telephone unit (TU).
  */
 #include <stdlib.h>
+#include <limits.h>
 
 #include "debug.h"
 #include "pbx.h"
+#include "pbx_ext.h"
 #include "server.h"
+#include "service.h"
+#include "tu_ext.h"
+#include "metrics.h"
 #include "csapp.h"
 
 
+POOL service_line_pool = POOL_INITIALIZER("line", MAXLINE, 64);
+POOL service_fd_pool = POOL_INITIALIZER("connfd", sizeof(int), sizeof(int));
+
+//command whose name starts with a given byte, or -1
+static const signed char first_byte_command[256] = {
+    [0 ... 255] = -1,
+    ['p'] = TU_PICKUP_CMD,
+    ['h'] = TU_HANGUP_CMD,
+    ['d'] = TU_DIAL_CMD,
+    ['c'] = TU_CHAT_CMD,
+    ['w'] = TU_WATCH_CMD,
+    ['u'] = TU_UNWATCH_CMD
+};
+
+//names of the commands that tu_command_names[] does not have
+static const char *const extra_command_names[] = {
+    [TU_WATCH_CMD-TU_WATCH_CMD] = "watch",
+    [TU_UNWATCH_CMD-TU_WATCH_CMD] = "unwatch"
+};
+
+//length of the name of each command
+static const unsigned char command_name_len[] = {
+    [TU_PICKUP_CMD] = 6,
+    [TU_HANGUP_CMD] = 6,
+    [TU_DIAL_CMD] = 4,
+    [TU_CHAT_CMD] = 4,
+    [TU_WATCH_CMD] = 5,
+    [TU_UNWATCH_CMD] = 7
+};
+
+//parse the extension argument at the end of a message, after a single space
+//return the extension, -1 if the number is missing or too large to name any
+//TU, or -2 if the argument is not a number at all
+static int parse_ext(const char *arg, const char *end) {
+    if (end-arg<1 || *arg!=' ') {
+        return -2;
+    }
+    int ext = -1;
+    for (const char *dp = arg+1; dp<end; dp++) {
+        unsigned int digit = (unsigned char)*dp - '0';
+        if (digit>9) {
+            return -2;
+        }
+        if (dp==arg+1) {
+            ext = 0;
+        }
+        else if (ext<0 || ext>(INT_MAX-9)/10) {
+            ext = -1;
+            continue;
+        }
+        ext = ext*10 + digit;
+    }
+    return ext;
+}
+
+/*
+ * Parse a message received from a TU in a single pass.
+ * The command is identified by its first byte and confirmed against its
+ * name; nothing is copied or allocated.
+ */
+int parse_client_message(char *buf, int len, CLIENT_CMD *cmd) {
+    //a message is only complete with its EOL, the '\r' is optional
+    if (len<1 || buf[len-1]!='\n') {
+        return -1;
+    }
+    len--;
+    if (len>0 && buf[len-1]=='\r') {
+        len--;
+    }
+    if (len<1) {
+        return -1;
+    }
+    int type = first_byte_command[(unsigned char)buf[0]];
+    if (type<0) {
+        return -1;
+    }
+    int nlen = command_name_len[type];
+    const char *name = type<TU_WATCH_CMD ? tu_command_names[type] :
+                                           extra_command_names[type-TU_WATCH_CMD];
+    if (len<nlen || memcmp(buf,name,nlen)!=0) {
+        return -1;
+    }
+    cmd->type = type;
+    cmd->ext = -1;
+    cmd->arg = NULL;
+    cmd->arglen = 0;
+    switch (type) {
+        case TU_PICKUP_CMD:
+        case TU_HANGUP_CMD:
+            return len==nlen ? 0 : -1;
+        case TU_DIAL_CMD:
+            //dialing a number that names no TU gets an error from the TU
+            cmd->ext = parse_ext(buf+nlen,buf+len);
+            return cmd->ext<-1 ? -1 : 0;
+        case TU_WATCH_CMD:
+        case TU_UNWATCH_CMD:
+            cmd->ext = parse_ext(buf+nlen,buf+len);
+            return cmd->ext<0 ? -1 : 0;
+        case TU_CHAT_CMD:
+            //the message may be empty, in which case the space is optional
+            if (len>nlen && buf[nlen]!=' ') {
+                return -1;
+            }
+            cmd->arg = len>nlen ? buf+nlen+1 : buf+len;
+            cmd->arglen = buf+len-cmd->arg;
+            //terminate the message in place, over the EOL
+            cmd->arg[cmd->arglen] = '\0';
+            return 0;
+    }
+    return -1;
+}
+
 //parse and executre a message received form a TU 
 //return 0 if successful -1 if error
 int execute_client_message(TU *curTU,char *buf, int messageSize) {
-    if (strcmp(buf,"pickup\r\n")==0) {
-        //printf("picksss\n");
-        return tu_pickup(curTU);
-            //error
+    CLIENT_CMD cmd;
+    int ret;
+    metrics_add(METRIC_BYTES_IN,messageSize);
+    if (parse_client_message(buf,messageSize,&cmd)<0) {
+        return -1;
     }
-    else if (strcmp(buf,"hangup\r\n")==0) {
-        return tu_hangup(curTU);
+    uint64_t start = metrics_timing() ? metrics_now() : 0;
+    switch (cmd.type) {
+        case TU_PICKUP_CMD:
+            ret = tu_pickup(curTU);
+            break;
+        case TU_HANGUP_CMD:
+            metrics_inc(METRIC_HANGUPS);
+            ret = tu_hangup(curTU);
+            break;
+        case TU_DIAL_CMD:
+            ret = pbx_dial(pbx,curTU,cmd.ext);
+            break;
+        case TU_CHAT_CMD:
+            ret = tu_chat_len(curTU,cmd.arg,cmd.arglen);
+            break;
+        case TU_WATCH_CMD:
+            ret = pbx_watch(pbx,curTU,cmd.ext);
+            break;
+        case TU_UNWATCH_CMD:
+            ret = tu_unwatch(curTU,cmd.ext);
+            break;
+        default:
+            return -1;
     }
-    else {
-        char d_command[6];
-        memcpy(d_command,buf,5);
-        d_command[5] = '\0';
-        //printf("%s",d_command);
-        if (strcmp(d_command,"dial ")==0) {
-            int ext=0;
-            char* num_start = buf + 5; //start of where the numebr should be
-            while (*num_start!='\r') {
-                
-                if (isdigit(*num_start)) {
-                    ext = (ext*10) + (*num_start-'0');
-                    num_start++;
-                }
-                else {
-                    return -1;
-                }
-            }
-            return pbx_dial(pbx,curTU,ext);
-        }
-        else if (strcmp(d_command,"chat ")==0) {
-            buf[messageSize-1]='\0';
-            char* message = buf + 5;
-            return tu_chat(curTU,message);
-        }
+    if (start!=0) {
+        metrics_command_time(cmd.type,metrics_now()-start);
     }
-    return -1;
+    return ret;
 }
 
 /*
@@ -59,16 +175,28 @@ int execute_client_message(TU *curTU,char *buf, int messageSize) {
 void *pbx_client_service(void *arg) {
     int connfd = *((int *)arg);
     Pthread_detach(pthread_self());
-    free(arg);
+    pool_free(&service_fd_pool,arg);
     TU *newTU = tu_init(connfd);
-    if (pbx_register(pbx,newTU,connfd)<0) {
-
+    if (newTU==NULL) {
+        Close(connfd);
+        return NULL;
+    }
+    if (pbx_register(pbx,newTU,PBX_ANY_EXTENSION)<0) {
+        //never registered, so nobody else can hold a reference; this frees it
+        tu_ref(newTU,"Discarding unregistered TU");
+        tu_unref(newTU,"Discarding unregistered TU");
+        return NULL;
     }   
 
     rio_t rio;
     int n;
+    int batch = 0;
     rio_readinitb(&rio,connfd);
-    char* buf = malloc(MAXLINE);
+    char* buf = pool_alloc(&service_line_pool);
+    if (buf==NULL) {
+        pbx_unregister(pbx,newTU);
+        return NULL;
+    }
     //char buf[MAXLINE];
     while(1) {
         // char command[10]; //command
@@ -84,6 +212,10 @@ void *pbx_client_service(void *arg) {
         // }
         
         n=rio_readlineb(&rio,buf,MAXLINE);
+        if (batch && n<=0) {
+            tu_batch_end();
+            batch = 0;
+        }
         if (n==0) {
             // if (tu_hangup(newTU)==-1) {
                 
@@ -94,11 +226,22 @@ void *pbx_client_service(void *arg) {
             //error
             break;
         }
+        //while more complete lines are buffered, hold the output back, so that
+        //it goes out in one write once they have all been executed
+        int more = memchr(rio.rio_bufptr,'\n',rio.rio_cnt)!=NULL;
+        if (more && !batch) {
+            tu_batch_begin();
+            batch = 1;
+        }
         execute_client_message(newTU,buf,n);
+        if (batch && !more) {
+            tu_batch_end();
+            batch = 0;
+        }
     }
-    free(buf);
+    pool_free(&service_line_pool,buf);
+    //the TU owns connfd, it is closed when the last reference is released
     pbx_unregister(pbx,newTU);
-    Close(connfd);
     return NULL;
 }
 #endif
@@ -2,43 +2,349 @@
  * TU: simulates a "telephone unit", which interfaces a client with the PBX.
  */
 #include <stdlib.h>
+#include <assert.h>
 
 #include "pbx.h"
+#include "outq.h"
+#include "conf.h"
+#include "hunt.h"
+#include "presence.h"
+#include "tu_ext.h"
+#include "pool.h"
+#include "fmutex.h"
+#include "cdr.h"
+#include "metrics.h"
 #include "debug.h"
 #include "csapp.h"
 
+/*
+ * The fields are grouped by who writes them, one cache line per group, so
+ * that a thread bumping the reference count or taking the lock does not
+ * invalidate the line that readers of the other fields depend on.
+ */
 typedef struct tu {
+    //read-mostly: set when the TU is created and registered
     int tu_fd; //the file descriptor of the TU
     int ext; //extension number of the TU
-    int ref; //reference number of the TU
+    OUTQ *outq; //queued output to the client, owns tu_fd
+    //written by calls involving the TU, always while holding the lock
+    FMUTEX tu_mutex __attribute__((aligned(64)));
     TU_STATE cur_state;
     struct tu *peer;
-    sem_t tu_mutex;
-} TU;
+    //the bridge of the conference the TU takes part in instead of a call
+    CONF *conf;
+    CONF_MEMBER *member;
+    //the hunt group the TU is an agent of, the one it waits for as a caller,
+    //and its place on the idle list or the queue, see hunt.h
+    HUNT *hunt;
+    HUNT *hunt_wait;
+    HUNT_LINK hunt_link;
+    //the extensions whose state the TU watches, only changed by its own commands
+    WATCHER *watcher;
+    //details of the current call, kept by both parties when calls are recorded
+    uint64_t call_id;
+    int64_t ring_ns;
+    int64_t answer_ns;
+    int caller; //this TU placed the current call
+    //written without the lock by registry lookups and peers
+    int ref __attribute__((aligned(64))); //reference number of the TU, only accessed atomically
+} __attribute__((aligned(64))) TU;
+
+//each TU in its own cache lines, so that locking one never disturbs another
+static POOL tu_pool = POOL_INITIALIZER("tu", sizeof(TU), _Alignof(TU));
+
+#define TU_NUM_STATES (TU_ERROR+1)
+//longest state name plus room for an extension and the EOL
+#define TU_NOTIFY_MAX 48
+
+/*
+ * Wire bytes of each state notification, built once from tu_state_names[].
+ * States that report an extension are cached up to and including the space
+ * before it, the others including their EOL.
+ */
+static struct {
+    char text[TU_NOTIFY_MAX];
+    int len;
+} tu_notify_cache[TU_NUM_STATES];
+static pthread_once_t tu_notify_once = PTHREAD_ONCE_INIT;
+
+static int tu_state_has_ext(TU_STATE state) {
+    return state==TU_ON_HOOK || state==TU_CONNECTED;
+}
+
+static void tu_notify_cache_init(void) {
+    for (int i=0;i<TU_NUM_STATES;i++) {
+        tu_notify_cache[i].len = snprintf(tu_notify_cache[i].text,TU_NOTIFY_MAX,"%s%s",
+                                          tu_state_names[i],tu_state_has_ext(i) ? " " : EOL);
+    }
+}
+
+//write the decimal form of a non-negative number, return the number of bytes written
+static int tu_utoa(char *buf, unsigned int n) {
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[10];
+    char *p = tmp+sizeof(tmp);
+    while (n>=100) {
+        unsigned int r = n%100;
+        n /= 100;
+        p -= 2;
+        memcpy(p,pairs+2*r,2);
+    }
+    if (n>=10) {
+        p -= 2;
+        memcpy(p,pairs+2*n,2);
+    }
+    else {
+        *--p = '0'+n;
+    }
+    int len = tmp+sizeof(tmp)-p;
+    memcpy(buf,p,len);
+    return len;
+}
 
 //access tu has to have been locked beforehand
 //if state is connected then access to the peer tu also locked beforehand.
+//the notification is only queued, it is sent by tu_flush() once the locks are released
 int tu_send_current_state(TU *tu) {
-    switch (tu->cur_state) {
-        case TU_ON_HOOK:
-            if (dprintf(tu->tu_fd,"%s %d\r\n",tu_state_names[tu->cur_state],tu->ext)<0) {
-                return -1;
-            }
-            break;
-        case TU_CONNECTED:
-            if (dprintf(tu->tu_fd,"%s %d\r\n",tu_state_names[tu->cur_state],tu->peer->ext)<0) {
-                return -1;
-            }
-            break;
-        default:
-            if (dprintf(tu->tu_fd,"%s\r\n",tu_state_names[tu->cur_state])<0) {
-                return -1;
+    char msg[TU_NOTIFY_MAX];
+    int len = tu_notify_cache[tu->cur_state].len;
+    memcpy(msg,tu_notify_cache[tu->cur_state].text,len);
+    if (tu_state_has_ext(tu->cur_state)) {
+        len += tu_utoa(msg+len,tu->cur_state==TU_ON_HOOK ? tu->ext :
+                               tu->peer!=NULL ? tu->peer->ext : conf_extension(tu->conf));
+        memcpy(msg+len,EOL,2);
+        len += 2;
+    }
+    return outq_append(tu->outq,msg,len);
+}
+
+//most distinct queues a batch defers flushing; beyond that they are flushed at once
+#define TU_BATCH_MAX 64
+
+/*
+ * Queues with output generated during the calling thread's current batch,
+ * each holding a reference, see tu_batch_begin().
+ */
+static __thread struct {
+    int depth;
+    int count;
+    OUTQ *queues[TU_BATCH_MAX];
+} tu_batch;
+
+void tu_batch_begin(void) {
+    tu_batch.depth++;
+}
+
+void tu_batch_end(void) {
+    if (--tu_batch.depth>0) {
+        return;
+    }
+    tu_batch_flush();
+}
+
+void tu_batch_flush(void) {
+    for (int i=0;i<tu_batch.count;i++) {
+        outq_flush(tu_batch.queues[i]);
+        outq_unref(tu_batch.queues[i]);
+    }
+    tu_batch.count = 0;
+}
+
+//note a queue to be flushed at the end of the current batch
+//return 0 if it will be, -1 if the batch is full
+static int tu_batch_defer(OUTQ *q, int unref) {
+    for (int i=0;i<tu_batch.count;i++) {
+        if (tu_batch.queues[i]==q) {
+            if (unref) {
+                outq_unref(q);
             }
-            break;
+            return 0;
+        }
     }
+    if (tu_batch.count==TU_BATCH_MAX) {
+        return -1;
+    }
+    tu_batch.queues[tu_batch.count++] = unref ? q : outq_ref(q);
     return 0;
 }
 
+//send queued output to a client, must be called without holding any TU lock
+//releases the reference to the queue if unref is set
+//within a batch the output is only sent when the batch ends
+static int tu_flush(OUTQ *q, int unref) {
+    int ret = 0;
+    if (q!=NULL && tu_batch.depth>0 && tu_batch_defer(q,unref)==0) {
+        return 0;
+    }
+    if (q!=NULL) {
+        ret = outq_flush(q)<0 ? -1 : 0;
+        if (unref) {
+            outq_unref(q);
+        }
+    }
+    return ret;
+}
+
+//flush a queue handed over with a reference, see conf_chat() and presence_dispatch()
+static void tu_flush_unref(OUTQ *q) {
+    tu_flush(q,1);
+}
+
+static void tu_dispatch(void);
+
+//lock statistics of the calling thread, see tu_lock_stats()
+static __thread TU_LOCK_STATS tu_lock_counters;
+
+//lock a single TU, counting the acquisitions that had to wait for another thread
+static void tu_lock(TU *tu) {
+    tu_lock_counters.acquired++;
+    if (fmutex_trylock(&(tu->tu_mutex))==0) {
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    fmutex_lock(&(tu->tu_mutex));
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    tu_lock_counters.contended++;
+    tu_lock_counters.wait_ns += (end.tv_sec-start.tv_sec)*1000000000ull + end.tv_nsec-start.tv_nsec;
+}
+
+static void tu_unlock(TU *tu) {
+    fmutex_unlock(&(tu->tu_mutex));
+}
+
+void tu_lock_stats(TU_LOCK_STATS *stats, int reset) {
+    *stats = tu_lock_counters;
+    if (reset) {
+        memset(&tu_lock_counters,0,sizeof(tu_lock_counters));
+    }
+}
+
+//record the end of the call between tu and its peer, both locked
+static void tu_record_call(TU *tu, TU *peer, CDR_REASON reason) {
+    TU *caller = tu->caller ? tu : peer;
+    TU *callee = tu->caller ? peer : tu;
+    CDR_RECORD rec = {
+        .call_id = tu->call_id,
+        .ring_ns = tu->ring_ns,
+        .answer_ns = tu->answer_ns,
+        .end_ns = cdr_now(),
+        .caller = caller->ext,
+        .callee = callee->ext,
+        .reason = reason
+    };
+    cdr_log(&rec);
+}
+
+/*
+ * Agents and callers matched by a hunt group while the TU that made the
+ * match was locked, to be connected by tu_hunt_dispatch() once it is not.
+ * Each entry holds a reference to both TUs.
+ */
+#define TU_HUNT_PENDING 4
+static __thread struct {
+    int count;
+    struct {
+        HUNT *hunt;
+        TU *agent;
+        TU *caller;
+    } match[TU_HUNT_PENDING];
+} tu_hunt_pending;
+
+//an agent has gone on hook: it takes a waiting caller or becomes idle
+//tu has to be locked
+static void tu_hunt_idle(TU *tu) {
+    TU *caller = hunt_agent_idle(tu->hunt,&tu->hunt_link);
+    if (caller!=NULL) {
+        //a single operation puts at most two TUs on hook, and every operation
+        //dispatches before it returns, so the array can only overflow if one
+        //of them stops doing so
+        assert(tu_hunt_pending.count<TU_HUNT_PENDING);
+        int i = tu_hunt_pending.count++;
+        tu_hunt_pending.match[i].hunt = tu->hunt;
+        tu_hunt_pending.match[i].agent = tu;
+        tu_hunt_pending.match[i].caller = caller;
+        tu_ref(tu,"Matched with a waiting caller");
+    }
+}
+
+//every state change goes through here, so that the state gauges, the
+//idle lists of hunt groups and the watchers of the TU stay exact
+//tu has to be locked
+static void tu_set_state(TU *tu, TU_STATE state) {
+    if (tu->cur_state!=state) {
+        metrics_state_change(tu->cur_state,state);
+        TU_STATE old = tu->cur_state;
+        tu->cur_state = state;
+        if (tu->hunt!=NULL && old==TU_ON_HOOK) {
+            hunt_agent_busy(tu->hunt,&tu->hunt_link);
+        }
+        else if (tu->hunt!=NULL && state==TU_ON_HOOK) {
+            tu_hunt_idle(tu);
+        }
+        presence_changed(tu->ext,state);
+    }
+}
+
+/*
+ * Operations that involve two TUs always lock them in order of address, so that
+ * two threads working on the same pair (e.g. both parties hanging up at once)
+ * can never each hold one lock while waiting for the other.
+ */
+static void tu_lock_pair(TU *a, TU *b) {
+    if (a<b) {
+        tu_lock(a);
+        tu_lock(b);
+    }
+    else {
+        tu_lock(b);
+        tu_lock(a);
+    }
+}
+
+static void tu_unlock_pair(TU *a, TU *b) {
+    tu_unlock(a);
+    tu_unlock(b);
+}
+
+//lock a TU together with its current peer, if it has one
+//return the peer, which stays referenced until tu_unlock_with_peer(), or NULL
+static TU *tu_lock_with_peer(TU *tu) {
+    while (1) {
+        tu_lock(tu);
+        TU *peer = tu->peer;
+        if (peer==NULL) {
+            return NULL;
+        }
+        //the pairing holds a reference to the peer, so it is safe to take our own
+        tu_ref(peer,"Locking peer");
+        if (tu<peer) {
+            //already in order
+            tu_lock(peer);
+            return peer;
+        }
+        tu_unlock(tu);
+        tu_lock_pair(tu,peer);
+        if (tu->peer==peer) {
+            return peer;
+        }
+        //the call changed while no lock was held, start over
+        tu_unlock_pair(tu,peer);
+        tu_unref(peer,"Peer changed while locking");
+    }
+}
+
+static void tu_unlock_with_peer(TU *tu, TU *peer) {
+    tu_unlock(tu);
+    if (peer!=NULL) {
+        tu_unlock(peer);
+        tu_unref(peer,"Unlocking peer");
+    }
+}
+
 //associate tu_mutexes with extensions
 //sem_t tu_mutex[PBX_MAX_EXTENSIONS];
 /*
@@ -51,14 +357,36 @@ int tu_send_current_state(TU *tu) {
  */
 #if 1
 TU *tu_init(int fd) {
-    TU *newTU = calloc(1,sizeof(TU));
+    pthread_once(&tu_notify_once,tu_notify_cache_init);
+    TU *newTU = pool_zalloc(&tu_pool);
+    if (newTU==NULL) {
+        return NULL;
+    }
+    if ((newTU->outq = outq_new(fd))==NULL) {
+        pool_free(&tu_pool,newTU);
+        return NULL;
+    }
     newTU->tu_fd=fd;
+    newTU->hunt_link.tu = newTU;
     newTU->cur_state = TU_ON_HOOK; 
-    Sem_init(&(newTU->tu_mutex),0,1);
+    metrics_state_change(-1,TU_ON_HOOK);
+    fmutex_init(&(newTU->tu_mutex));
     return newTU;
 }
 #endif
 
+//final release of a TU, called exactly once by whoever drops the last reference
+static void tu_free(TU *tu) {
+    debug("Freeing TU %d", tu->ext);
+    metrics_state_change(tu->cur_state,-1);
+    if (tu->watcher!=NULL) {
+        presence_unwatch_all(tu->watcher);
+    }
+    //closes the connection once any pending output is gone
+    outq_unref(tu->outq);
+    pool_free(&tu_pool,tu);
+}
+
 /*
  * Increment the reference count on a TU.
  *
@@ -69,9 +397,8 @@ TU *tu_init(int fd) {
  */
 #if 1
 void tu_ref(TU *tu, char *reason) {
-    //P(&(tu->tu_mutex));
-    tu->ref++;
-    //V(&(tu->tu_mutex));
+    //a new reference is always derived from an existing one, so no ordering is needed
+    __atomic_add_fetch(&tu->ref,1,__ATOMIC_RELAXED);
 }
 #endif
 
@@ -85,12 +412,10 @@ void tu_ref(TU *tu, char *reason) {
  */
 #if 1
 void tu_unref(TU *tu, char *reason) {
-    //P(&(tu->tu_mutex));
-    tu->ref--;
-    //V(&(tu->tu_mutex));
-    if (tu->ref==0) {
-        free(tu);
-        //tu=NULL;
+    //release our accesses to the TU; the thread dropping the last reference
+    //acquires everyone else's before tearing it down
+    if (__atomic_sub_fetch(&tu->ref,1,__ATOMIC_ACQ_REL)==0) {
+        tu_free(tu);
     }
 }
 #endif
@@ -108,9 +433,9 @@ void tu_unref(TU *tu, char *reason) {
 #if 1
 int tu_fileno(TU *tu) {
     int fd = -1;
-    P(&(tu->tu_mutex));
+    tu_lock(tu);
     fd=tu->tu_fd;
-    V(&(tu->tu_mutex));
+    tu_unlock(tu);
     return fd;
 }
 #endif
@@ -129,9 +454,9 @@ int tu_fileno(TU *tu) {
 #if 1
 int tu_extension(TU *tu) {
     int ext = -1;
-    P(&(tu->tu_mutex));
+    tu_lock(tu);
     ext = tu->ext;
-    V(&(tu->tu_mutex));
+    tu_unlock(tu);
     return ext;
 }
 #endif
@@ -147,16 +472,39 @@ int tu_extension(TU *tu) {
 #if 1
 int tu_set_extension(TU *tu, int ext) {
     int ret=0;
-    P(&(tu->tu_mutex));
+    tu_lock(tu);
     tu->ext=ext;
-    if (dprintf(tu->tu_fd,"%s %d\r\n",tu_state_names[tu->cur_state],tu->ext)<0) {
+    //watchers of the extension see it come on line
+    presence_changed(ext,tu->cur_state);
+    if (tu_send_current_state(tu)<0) {
+        ret=-1;
+    }
+    tu_unlock(tu);
+    if (tu_flush(tu->outq,0)<0) {
         ret=-1;
     }
-    V(&(tu->tu_mutex));
+    tu_dispatch();
     return ret;
 }
 #endif
 
+//start a call from tu to target, both locked: they become peers and the target rings
+static void tu_pair(TU *tu, TU *target) {
+    tu->peer=target;
+    target->peer=tu;
+    if (cdr_enabled()) {
+        tu->call_id = target->call_id = cdr_new_call_id();
+        tu->ring_ns = target->ring_ns = cdr_now();
+        tu->answer_ns = target->answer_ns = 0;
+        tu->caller = 1;
+        target->caller = 0;
+    }
+    tu_ref(tu,"Dialed a valid TU");
+    tu_ref(target,"Received valid call from TU");
+    tu_set_state(tu,TU_RING_BACK);
+    tu_set_state(target,TU_RINGING);
+}
+
 /*
  * Initiate a call from a specified originating TU to a specified target TU.
  *   If the originating TU is not in the TU_DIAL_TONE state, then there is no effect.
@@ -191,42 +539,242 @@ int tu_set_extension(TU *tu, int ext) {
 #if 1
 int tu_dial(TU *tu, TU *target) {
     int ret = 0;
-    P(&(tu->tu_mutex));
+    OUTQ *peerq = NULL;
+    int paired = (target!=NULL && target!=tu);
+    if (paired) {
+        tu_lock_pair(tu,target);
+    }
+    else {
+        tu_lock(tu);
+    }
+    metrics_inc(METRIC_DIALS);
     if (tu->cur_state==TU_DIAL_TONE) {
         if (tu==target) {
-            tu->cur_state = TU_BUSY_SIGNAL;
+            tu_set_state(tu,TU_BUSY_SIGNAL);
+            metrics_inc(METRIC_BUSY);
         }
         else if (target==NULL) {
-            tu->cur_state=TU_ERROR;
+            tu_set_state(tu,TU_ERROR);
+            metrics_inc(METRIC_DIAL_ERRORS);
         } 
-        else {
-            P(&(target->tu_mutex));
-            if (target->peer!=NULL || target->cur_state!=TU_ON_HOOK) {
-                tu->cur_state = TU_BUSY_SIGNAL;
+        else if (target->peer!=NULL || target->cur_state!=TU_ON_HOOK) {
+            tu_set_state(tu,TU_BUSY_SIGNAL);
+            metrics_inc(METRIC_BUSY);
+            if (cdr_enabled()) {
+                CDR_RECORD rec = {
+                    .call_id = cdr_new_call_id(),
+                    .ring_ns = cdr_now(),
+                    .caller = tu->ext,
+                    .callee = target->ext,
+                    .reason = CDR_BUSY
+                };
+                rec.end_ns = rec.ring_ns;
+                cdr_log(&rec);
             }
-            else {
-                tu->peer=target;
-                target->peer=tu;
-                tu_ref(tu,"Dialed a valid TU");
-                tu_ref(target,"Received valid call from TU");
-                tu->cur_state=TU_RING_BACK;
-                target->cur_state=TU_RINGING;
-                if (tu_send_current_state(target)==-1) {
-                    ret = -1;
-                }
+        }
+        else {
+            tu_pair(tu,target);
+            if (tu_send_current_state(target)==-1) {
+                ret = -1;
             }
-            V(&(target->tu_mutex));
+            peerq = outq_ref(target->outq);
         }
     }
     if (tu_send_current_state(tu)==-1) {
         ret = -1;
     }
-    V(&(tu->tu_mutex));
+    if (paired) {
+        tu_unlock_pair(tu,target);
+    }
+    else {
+        tu_unlock(tu);
+    }
+    if (tu_flush(tu->outq,0)<0 || tu_flush(peerq,1)<0) {
+        ret = -1;
+    }
+    tu_dispatch();
     return ret;
 
 }
 #endif
 
+/*
+ * Dial a conference bridge.  A TU with a dial tone joins the conference and
+ * goes to the TU_CONNECTED state, in which it is notified of the extension
+ * of the bridge.  Only the TU itself is locked; see conf.h.
+ */
+int tu_dial_bridge(TU *tu, CONF *conf) {
+    int ret = 0;
+    tu_lock(tu);
+    metrics_inc(METRIC_DIALS);
+    if (tu->cur_state==TU_DIAL_TONE) {
+        if ((tu->member = conf_join(conf,tu->outq))!=NULL) {
+            tu->conf = conf;
+            tu_set_state(tu,TU_CONNECTED);
+            metrics_inc(METRIC_CONNECTS);
+        }
+        else if (errno==EBUSY) {
+            tu_set_state(tu,TU_BUSY_SIGNAL);
+            metrics_inc(METRIC_BUSY);
+        }
+        else {
+            tu_set_state(tu,TU_ERROR);
+            ret = -1;
+        }
+    }
+    if (tu_send_current_state(tu)==-1) {
+        ret = -1;
+    }
+    tu_unlock(tu);
+    if (tu_flush(tu->outq,0)<0) {
+        ret = -1;
+    }
+    tu_dispatch();
+    return ret;
+}
+
+/*
+ * Connect an agent and a caller matched by a hunt group, both referenced by
+ * the caller of this function.  Either may have changed since the match was
+ * made, without the group lock: a caller whose agent is no longer idle is
+ * matched again, ahead of any other caller, and an agent whose caller has
+ * hung up takes the next one, until a call is made or nobody is left.
+ */
+static void tu_hunt_connect(HUNT *hunt, TU *agent, TU *caller) {
+    while (agent!=NULL && caller!=NULL) {
+        OUTQ *agentq = NULL;
+        TU *next_agent = NULL, *next_caller = NULL;
+        tu_lock_pair(agent,caller);
+        int caller_ok = caller->hunt_wait==hunt && caller->cur_state==TU_RING_BACK &&
+                        caller->peer==NULL;
+        int agent_ok = agent->hunt==hunt && agent->cur_state==TU_ON_HOOK && agent->peer==NULL;
+        int dequeued = 0;
+        if (caller_ok && agent_ok) {
+            //a caller that hung up and called again since the match may be queued
+            dequeued = hunt_caller_cancel(hunt,&caller->hunt_link);
+            caller->hunt_wait = NULL;
+            tu_pair(caller,agent);
+            tu_send_current_state(agent);
+            agentq = outq_ref(agent->outq);
+        }
+        else if (caller_ok) {
+            next_agent = hunt_caller_wait(hunt,&caller->hunt_link,1);
+        }
+        else if (agent_ok) {
+            next_caller = hunt_agent_idle(hunt,&agent->hunt_link);
+        }
+        tu_unlock_pair(agent,caller);
+        tu_flush(agentq,1);
+        if (dequeued) {
+            tu_unref(caller,"Left hunt group queue");
+        }
+        if (next_agent==NULL) {
+            //paired, queued again, or gone
+            tu_unref(caller,"Hunt match done");
+        }
+        if (next_caller==NULL) {
+            tu_unref(agent,"Hunt match done");
+        }
+        if (next_agent!=NULL) {
+            agent = next_agent;
+        }
+        else if (next_caller!=NULL) {
+            caller = next_caller;
+        }
+        else {
+            break;
+        }
+    }
+}
+
+//connect the matches made by the calling thread while it held TU locks
+static void tu_hunt_dispatch(void) {
+    while (tu_hunt_pending.count>0) {
+        int i = --tu_hunt_pending.count;
+        tu_hunt_connect(tu_hunt_pending.match[i].hunt,tu_hunt_pending.match[i].agent,
+                        tu_hunt_pending.match[i].caller);
+    }
+}
+
+/*
+ * Finish what the calling thread left to be done once its TUs are unlocked:
+ * hunt group matches, then the watchers of every state changed meanwhile.
+ * Every operation that changes the state of a TU calls this before it returns.
+ */
+static void tu_dispatch(void) {
+    tu_hunt_dispatch();
+    presence_dispatch(tu_flush_unref);
+}
+
+/*
+ * Dial a hunt group.  The caller goes to TU_RING_BACK straight away, and
+ * either rings the agent that has been idle longest or waits in the queue.
+ */
+int tu_dial_hunt(TU *tu, HUNT *hunt) {
+    int ret = 0;
+    TU *agent = NULL;
+    tu_lock(tu);
+    metrics_inc(METRIC_DIALS);
+    if (tu->cur_state==TU_DIAL_TONE) {
+        tu_set_state(tu,TU_RING_BACK);
+        tu->hunt_wait = hunt;
+        if ((agent = hunt_caller_wait(hunt,&tu->hunt_link,0))!=NULL) {
+            tu_ref(tu,"Matched with an idle agent");
+        }
+        else {
+            metrics_inc(METRIC_HUNT_QUEUED);
+        }
+    }
+    if (tu_send_current_state(tu)==-1) {
+        ret = -1;
+    }
+    tu_unlock(tu);
+    if (tu_flush(tu->outq,0)<0) {
+        ret = -1;
+    }
+    if (agent!=NULL) {
+        tu_hunt_connect(hunt,agent,tu);
+    }
+    tu_dispatch();
+    return ret;
+}
+
+void tu_join_hunt(TU *tu, HUNT *hunt) {
+    tu_lock(tu);
+    tu->hunt = hunt;
+    if (tu->cur_state==TU_ON_HOOK) {
+        tu_hunt_idle(tu);
+    }
+    tu_unlock(tu);
+    tu_dispatch();
+}
+
+void tu_leave_hunt(TU *tu) {
+    tu_lock(tu);
+    if (tu->hunt!=NULL) {
+        hunt_agent_busy(tu->hunt,&tu->hunt_link);
+        tu->hunt = NULL;
+    }
+    tu_unlock(tu);
+}
+
+/*
+ * Queue a page for a TU that is on hook.  The TU is locked only to check
+ * its state, so a page never waits for anything but the TU it goes to.
+ */
+int tu_page(TU *tu, OUTQ_MSG *msg) {
+    int ret = 0;
+    tu_lock(tu);
+    if (tu->cur_state==TU_ON_HOOK) {
+        ret = outq_append_msg(tu->outq,msg)<0 ? -1 : 1;
+    }
+    tu_unlock(tu);
+    if (ret>0 && tu_flush(tu->outq,0)<0) {
+        ret = -1;
+    }
+    return ret;
+}
+
 /*
  * Take a TU receiver off-hook (i.e. pick up the handset).
  *   If the TU is in neither the TU_ON_HOOK state nor the TU_RINGING state,
@@ -248,19 +796,23 @@ int tu_dial(TU *tu, TU *target) {
 #if 1
 int tu_pickup(TU *tu) {
     int ret = 0;
-    P(&(tu->tu_mutex));
+    OUTQ *peerq = NULL;
+    TU *peer = tu_lock_with_peer(tu);
     if (tu->cur_state==TU_ON_HOOK) {
-        tu->cur_state=TU_DIAL_TONE;
+        tu_set_state(tu,TU_DIAL_TONE);
     }
     else if (tu->cur_state==TU_RINGING) {
-        if(tu->peer!=NULL) {
-            P(&(tu->peer->tu_mutex)); //lock the peer
-            tu->peer->cur_state=TU_CONNECTED;
-            tu->cur_state=TU_CONNECTED;
-            if (tu_send_current_state(tu->peer)==-1) {
+        if(peer!=NULL) {
+            tu_set_state(peer,TU_CONNECTED);
+            tu_set_state(tu,TU_CONNECTED);
+            metrics_inc(METRIC_CONNECTS);
+            if (cdr_enabled()) {
+                tu->answer_ns = peer->answer_ns = cdr_now();
+            }
+            if (tu_send_current_state(peer)==-1) {
                 ret=-1;
             }
-            V(&(tu->peer->tu_mutex));
+            peerq = outq_ref(peer->outq);
         }
         else {
             ret = -1;
@@ -269,7 +821,11 @@ int tu_pickup(TU *tu) {
     if (tu_send_current_state(tu)==-1) {
         ret = -1;
     }
-    V(&(tu->tu_mutex));
+    tu_unlock_with_peer(tu,peer);
+    if (tu_flush(tu->outq,0)<0 || tu_flush(peerq,1)<0) {
+        ret = -1;
+    }
+    tu_dispatch();
     return ret;
 }
 #endif
@@ -299,56 +855,139 @@ int tu_pickup(TU *tu) {
 #if 1
 int tu_hangup(TU *tu) {
     int ret = 0;
-    P(&(tu->tu_mutex));
-    if (tu->cur_state==TU_CONNECTED || tu->cur_state == TU_RINGING) {
-        tu->cur_state=TU_ON_HOOK;
-        if (tu->peer!=NULL) {
-            P(&(tu->peer->tu_mutex));
-            tu->peer->cur_state=TU_DIAL_TONE;
-            tu_unref(tu->peer,"Hangup");
-            tu_unref(tu,"Hangup");
-            tu->peer->peer=NULL;
-
-            if (tu_send_current_state(tu->peer)==-1) {
-                ret=-1;
-            }
-            V(&(tu->peer->tu_mutex));
-        }
-        else {
-            ret = -1;
-        }
-
+    OUTQ *peerq = NULL;
+    TU *peer = tu_lock_with_peer(tu);
+    TU *oldpeer = NULL; //peer whose pairing is dissolved
+    int dequeued = 0; //a waiting caller was taken off its hunt group's queue
+    if (tu->conf!=NULL) {
+        conf_leave(tu->conf,tu->member);
+        tu->conf = NULL;
+        tu->member = NULL;
+        tu_set_state(tu,TU_ON_HOOK);
     }
-    else if (tu->cur_state==TU_RING_BACK) {
-        tu->cur_state=TU_ON_HOOK;
-        if(tu->peer!=NULL) {
-            P(&(tu->peer->tu_mutex)); //lock the peer
-            tu->peer->cur_state=TU_ON_HOOK;
-            tu_unref(tu->peer,"Hangup");
-            tu_unref(tu,"Hangup");
-            tu->peer->peer=NULL;
-            if (tu_send_current_state(tu->peer)==-1) {
+    else if (tu->hunt_wait!=NULL) {
+        dequeued = hunt_caller_cancel(tu->hunt_wait,&tu->hunt_link);
+        tu->hunt_wait = NULL;
+        tu_set_state(tu,TU_ON_HOOK);
+    }
+    else if (tu->cur_state==TU_CONNECTED || tu->cur_state == TU_RINGING || tu->cur_state==TU_RING_BACK) {
+        if (peer!=NULL) {
+            //the other party of an answered or ringing call gets a dial tone, a caller
+            //whose call is abandoned before being answered goes back on hook
+            tu_set_state(peer,tu->cur_state==TU_RING_BACK ? TU_ON_HOOK : TU_DIAL_TONE);
+            if (cdr_enabled()) {
+                tu_record_call(tu,peer,tu->cur_state==TU_RING_BACK ? CDR_CANCELLED :
+                                       tu->cur_state==TU_RINGING ? CDR_REJECTED :
+                                       tu->caller ? CDR_CALLER_HANGUP : CDR_CALLEE_HANGUP);
+            }
+            peer->peer=NULL;
+            oldpeer=peer;
+            if (tu_send_current_state(peer)==-1) {
                 ret=-1;
             }
-            V(&(tu->peer->tu_mutex));
+            peerq = outq_ref(peer->outq);
         }
         else {
-            ret= -1;
+            ret = -1;
         }
+        tu_set_state(tu,TU_ON_HOOK);
     }
     else if(tu->cur_state==TU_DIAL_TONE || tu->cur_state==TU_BUSY_SIGNAL || tu->cur_state==TU_ERROR) {
-        tu->cur_state=TU_ON_HOOK;
+        tu_set_state(tu,TU_ON_HOOK);
     }
     tu->peer=NULL;
 
     if (tu_send_current_state(tu)==-1) {
         ret = -1;
     }
-    V(&(tu->tu_mutex));
+    tu_unlock_with_peer(tu,peer);
+    if (oldpeer!=NULL) {
+        tu_unref(oldpeer,"Hangup");
+        tu_unref(tu,"Hangup");
+    }
+    if (dequeued) {
+        tu_unref(tu,"Left hunt group queue");
+    }
+    if (tu_flush(tu->outq,0)<0 || tu_flush(peerq,1)<0) {
+        ret = -1;
+    }
+    tu_dispatch();
     return ret;
 }
 #endif
 
+int tu_snapshot(TU *tu, TU_SNAPSHOT *snap, char **out, size_t *outlen) {
+    tu_lock(tu);
+    snap->ext = tu->ext;
+    snap->state = tu->cur_state;
+    snap->peer_ext = tu->peer!=NULL ? tu->peer->ext :
+                     tu->conf!=NULL ? conf_extension(tu->conf) : -1;
+    snap->caller = tu->caller;
+    snap->call_id = tu->call_id;
+    snap->ring_ns = tu->ring_ns;
+    snap->answer_ns = tu->answer_ns;
+    tu_unlock(tu);
+    ssize_t len = outq_hold(tu->outq,out);
+    if (len<0) {
+        return -1;
+    }
+    *outlen = len;
+    return 0;
+}
+
+void tu_hold_output(TU *tu) {
+    outq_hold(tu->outq,NULL);
+}
+
+void tu_resume_output(TU *tu) {
+    outq_release(tu->outq);
+}
+
+int tu_restore(TU *tu, const TU_SNAPSHOT *snap, TU *peer, CONF *conf,
+               const char *out, size_t outlen) {
+    if (snap->state<TU_ON_HOOK || snap->state>TU_ERROR) {
+        return -1;
+    }
+    int ended = 0;
+    tu_lock(tu);
+    tu->ext = snap->ext;
+    tu_set_state(tu,snap->state);
+    if (peer==NULL && conf!=NULL && snap->state==TU_CONNECTED &&
+        (tu->member = conf_join(conf,tu->outq))!=NULL) {
+        tu->conf = conf;
+    }
+    else if (peer==NULL && (snap->state==TU_RINGING || snap->state==TU_RING_BACK ||
+                            snap->state==TU_CONNECTED)) {
+        //the other party is gone, as if it had hung up
+        tu_set_state(tu,snap->state==TU_RINGING ? TU_ON_HOOK : TU_DIAL_TONE);
+        ended = 1;
+    }
+    tu->caller = snap->caller;
+    tu->call_id = snap->call_id;
+    tu->ring_ns = snap->ring_ns;
+    tu->answer_ns = snap->answer_ns;
+    if (peer!=NULL) {
+        //the pairing holds a reference to each party, as after tu_dial()
+        tu->peer = peer;
+        tu_ref(tu,"Restored call");
+    }
+    tu_unlock(tu);
+    if (outlen>0 && outq_append(tu->outq,out,outlen)<0) {
+        return -1;
+    }
+    if (ended) {
+        //the client is told after whatever it was sent before
+        tu_lock(tu);
+        tu_send_current_state(tu);
+        tu_unlock(tu);
+    }
+    tu_dispatch();
+    if ((outlen>0 || ended) && tu_flush(tu->outq,0)<0) {
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * "Chat" over a connection.
  *
@@ -367,23 +1006,112 @@ int tu_hangup(TU *tu) {
  */
 #if 1
 int tu_chat(TU *tu, char *msg) {
+    return tu_chat_len(tu,msg,strlen(msg));
+}
+#endif
+
+/*
+ * Send a chat message of known length to the peer.  The message is written
+ * from the caller's buffer with a "CHAT " prefix and the EOL around it,
+ * and only copied if it cannot be sent right away.
+ */
+int tu_chat_len(TU *tu, const char *msg, size_t len) {
     int ret = 0;
-    P(&(tu->tu_mutex));
-    if (tu->cur_state==TU_CONNECTED) {
-        if (tu->peer!=NULL) {
-            if (dprintf(tu_fileno(tu->peer),"CHAT %s\r\n",msg)<0) {
-                ret = -1;
-            }
+    OUTQ *peerq = NULL;
+    TU *peer = tu_lock_with_peer(tu);
+    CONF *conf = tu->conf;
+    CONF_MEMBER *member = tu->member;
+    if (tu->cur_state==TU_CONNECTED && peer!=NULL) {
+        peerq = outq_ref(peer->outq);
+    }
+    else if (conf==NULL) {
+        ret = -1;
+    }
+    tu_send_current_state(tu);
+    if (peerq!=NULL) {
+        //hold the peer's queue before releasing the TUs, so that nothing
+        //queued for the peer by a later call can overtake the message
+        outq_lock(peerq);
+    }
+    tu_unlock_with_peer(tu,peer);
+    if (conf!=NULL) {
+        //a TU only joins and leaves a conference by its own commands, which
+        //never run concurrently with this one, so the membership holds
+        int n = conf_chat(conf,member,msg,len,tu_flush_unref);
+        if (n<0) {
+            ret = -1;
         }
         else {
+            metrics_add(METRIC_CHATS,n);
+        }
+    }
+    if (peerq!=NULL) {
+        struct iovec iov[3] = {
+            { "CHAT ", 5 },
+            { (void *)msg, len },
+            { EOL, 2 }
+        };
+        //within a batch, the message joins whatever else the peer is sent
+        if ((tu_batch.depth>0 ? outq_append_iov_locked(peerq,iov,3) :
+                                outq_write_locked(peerq,iov,3))<0) {
             ret = -1;
         }
+        else {
+            metrics_inc(METRIC_CHATS);
+        }
+        outq_unlock(peerq);
+    }
+    tu_flush(tu->outq,0);
+    if (tu_flush(peerq,1)<0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+//notify a TU of its current state after a command that leaves it unchanged
+static int tu_notify(TU *tu) {
+    int ret = 0;
+    tu_lock(tu);
+    if (tu_send_current_state(tu)==-1) {
+        ret = -1;
+    }
+    tu_unlock(tu);
+    if (tu_flush(tu->outq,0)<0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Watch an extension.  The target is locked while its state is read and
+ * the watch is added, so that every change after that is seen.  Only the
+ * commands of the TU itself change its watches, so it is not locked.
+ */
+int tu_watch(TU *tu, int ext, TU *target) {
+    int ret = 0;
+    if (tu->watcher==NULL && (tu->watcher = presence_watcher_new(tu->outq))==NULL) {
+        ret = -1;
     }
     else {
+        if (target!=NULL) {
+            tu_lock(target);
+        }
+        ret = presence_watch(tu->watcher,ext,target!=NULL ? (int)target->cur_state : -1);
+        if (target!=NULL) {
+            tu_unlock(target);
+        }
+    }
+    tu_dispatch();
+    if (tu_notify(tu)<0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int tu_unwatch(TU *tu, int ext) {
+    int ret = tu->watcher!=NULL ? presence_unwatch(tu->watcher,ext) : -1;
+    if (tu_notify(tu)<0) {
         ret = -1;
     }
-    tu_send_current_state(tu);
-    V(&(tu->tu_mutex));
     return ret;
 }
-#endif
@@ -0,0 +1,231 @@
+/*
+ * io_uring: a minimal ring driven with the raw system calls.
+ */
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "debug.h"
+#include "csapp.h"
+
+typedef struct uring {
+    int fd;
+    //submission queue; sq_array maps every slot to the entry of the same index
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail; //entries prepared, published to sq_tail by uring_submit()
+    //completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    //provided buffers
+    struct io_uring_buf_ring *br;
+    unsigned br_mask;
+    unsigned buf_size;
+    char *bufs;
+    //mappings, for uring_free()
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+    size_t br_size;
+} URING;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Close a ring.
+ */
+void uring_free(URING *r) {
+    int err = errno;
+    if (r->br!=NULL) {
+        munmap(r->br, r->br_size);
+    }
+    free(r->bufs);
+    if (r->sqes!=NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->rings!=NULL) {
+        munmap(r->rings, r->rings_size);
+    }
+    if (r->fd>=0) {
+        close(r->fd);
+    }
+    free(r);
+    errno = err;
+}
+
+//hand a provided buffer to the kernel, to be published by uring_buffers_publish()
+static void uring_buffer_add(URING *r, unsigned short bid, unsigned short offset) {
+    struct io_uring_buf *buf = &r->br->bufs[(r->br->tail+offset) & r->br_mask];
+    buf->addr = (unsigned long)(r->bufs + (size_t)bid*r->buf_size);
+    buf->len = r->buf_size;
+    buf->bid = bid;
+}
+
+static void uring_buffers_publish(URING *r, unsigned short count) {
+    __atomic_store_n(&r->br->tail, r->br->tail+count, __ATOMIC_RELEASE);
+}
+
+static int uring_buffers_init(URING *r, unsigned nbufs, unsigned bufsize) {
+    r->br_size = nbufs*sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br==MAP_FAILED) {
+        r->br = NULL;
+        return -1;
+    }
+    if ((r->bufs = malloc((size_t)nbufs*bufsize))==NULL) {
+        return -1;
+    }
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (unsigned long)r->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1)<0) {
+        return -1;
+    }
+    r->br_mask = nbufs-1;
+    r->buf_size = bufsize;
+    for (unsigned i=0;i<nbufs;i++) {
+        uring_buffer_add(r, i, i);
+    }
+    uring_buffers_publish(r, nbufs);
+    return 0;
+}
+
+/*
+ * Create a ring, optionally with a group of provided buffers.
+ */
+URING *uring_new(unsigned entries, unsigned nbufs, unsigned bufsize) {
+    URING *r = calloc(1, sizeof(URING));
+    if (r==NULL) {
+        return NULL;
+    }
+    struct io_uring_params p = {0};
+    //room for a burst of completions, beyond which the kernel holds them back
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = 4*entries;
+    if ((r->fd = sys_io_uring_setup(entries, &p))<0) {
+        free(r);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        uring_free(r);
+        return NULL;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    r->rings_size = sq_size>cq_size ? sq_size : cq_size;
+    r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQ_RING);
+    if (r->rings==MAP_FAILED) {
+        r->rings = NULL;
+        uring_free(r);
+        return NULL;
+    }
+    r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes==MAP_FAILED) {
+        r->sqes = NULL;
+        uring_free(r);
+        return NULL;
+    }
+    char *rings = r->rings;
+    r->sq_head = (unsigned *)(rings + p.sq_off.head);
+    r->sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(rings + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    unsigned *sq_array = (unsigned *)(rings + p.sq_off.array);
+    for (unsigned i=0;i<p.sq_entries;i++) {
+        sq_array[i] = i;
+    }
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(rings + p.cq_off.head);
+    r->cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(rings + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    if (nbufs>0 && uring_buffers_init(r, nbufs, bufsize)<0) {
+        uring_free(r);
+        return NULL;
+    }
+    debug("io_uring %d set up with %u entries", r->fd, p.sq_entries);
+    return r;
+}
+
+/*
+ * Get a cleared submission queue entry, submitting a full queue first.
+ */
+struct io_uring_sqe *uring_get_sqe(URING *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail-head>=r->sq_entries) {
+        if (uring_submit(r, 0)<0) {
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail-head>=r->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * Submit the prepared requests and optionally wait for a completion.
+ */
+int uring_submit(URING *r, int wait) {
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit==0 && !wait) {
+        return 0;
+    }
+    if (sys_io_uring_enter(r->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0)<0) {
+        return -1;
+    }
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(URING *r) {
+    unsigned head = *r->cq_head;
+    if (head==__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(URING *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head+1, __ATOMIC_RELEASE);
+}
+
+char *uring_cqe_buffer(URING *r, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        return NULL;
+    }
+    return r->bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT)*r->buf_size;
+}
+
+void uring_cqe_buffer_done(URING *r, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uring_buffer_add(r, cqe->flags >> IORING_CQE_BUFFER_SHIFT, 0);
+        uring_buffers_publish(r, 1);
+    }
+}
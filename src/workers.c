@@ -0,0 +1,169 @@
+/*
+ * Workers: fixed-size thread pool with per-worker deques and work stealing.
+ */
+#include <stdlib.h>
+
+#include "workers.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define DEQUE_INITIAL_CAP 64
+
+/*
+ * A worker and its deque of runnable tasks, kept as a ring buffer.
+ * The owner takes tasks from the front, so that tasks queued on the same
+ * worker run in the order they became runnable; thieves take from the back.
+ */
+typedef struct worker {
+    pthread_mutex_t lock;
+    TASK **tasks;
+    int cap;
+    int head;           //index of the front task
+    int count;
+    pthread_t tid;
+} __attribute__((aligned(64))) WORKER;
+
+static WORKER *workers;
+static int worker_count;
+static volatile unsigned int next_home;
+
+//the worker run by the calling thread, or -1 if it is not a pool thread
+static __thread int self = -1;
+
+//tasks queued on any deque, and workers sleeping until one is
+static int pending;
+static int idle;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void deque_push(WORKER *w, TASK *task) {
+    pthread_mutex_lock(&w->lock);
+    if (w->count==w->cap) {
+        TASK **tasks = Malloc(2*w->cap*sizeof(TASK *));
+        for (int i=0;i<w->count;i++) {
+            tasks[i] = w->tasks[(w->head+i)%w->cap];
+        }
+        free(w->tasks);
+        w->tasks = tasks;
+        w->cap *= 2;
+        w->head = 0;
+    }
+    w->tasks[(w->head+w->count)%w->cap] = task;
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static TASK *deque_take_front(WORKER *w) {
+    TASK *task = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->count>0) {
+        task = w->tasks[w->head];
+        w->head = (w->head+1)%w->cap;
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+static TASK *deque_take_back(WORKER *w) {
+    TASK *task = NULL;
+    //don't wait for a busy victim, there may be others to steal from
+    if (pthread_mutex_trylock(&w->lock)!=0) {
+        return NULL;
+    }
+    if (w->count>0) {
+        w->count--;
+        task = w->tasks[(w->head+w->count)%w->cap];
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+//find the next task for a worker, from its own deque or by stealing
+static TASK *worker_next(int id) {
+    TASK *task = deque_take_front(&workers[id]);
+    for (int i=1;task==NULL && i<worker_count;i++) {
+        task = deque_take_back(&workers[(id+i)%worker_count]);
+    }
+    if (task!=NULL) {
+        __atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+    }
+    return task;
+}
+
+static void *worker_thread(void *arg) {
+    self = (WORKER *)arg-workers;
+
+    //leave SIGHUP to the main thread, so that it interrupts accept()
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        TASK *task = worker_next(self);
+        if (task!=NULL) {
+            task->run(task);
+            continue;
+        }
+        //sleep until something is queued; submitters check idle after
+        //publishing the task, so either they see us or we see their task
+        pthread_mutex_lock(&idle_lock);
+        __atomic_add_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST)==0) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        __atomic_sub_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Start the pool with the specified number of worker threads.
+ */
+int workers_init(int nworkers) {
+    if (nworkers<1) {
+        return -1;
+    }
+    workers = aligned_alloc(64, nworkers*sizeof(WORKER));
+    if (workers==NULL) {
+        return -1;
+    }
+    memset(workers, 0, nworkers*sizeof(WORKER));
+    for (int i=0;i<nworkers;i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].tasks = Malloc(DEQUE_INITIAL_CAP*sizeof(TASK *));
+        workers[i].cap = DEQUE_INITIAL_CAP;
+    }
+    worker_count = nworkers;
+    for (int i=0;i<nworkers;i++) {
+        Pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+        Pthread_detach(workers[i].tid);
+    }
+    debug("Worker pool started with %d threads", nworkers);
+    return 0;
+}
+
+int workers_running(void) {
+    return worker_count>0;
+}
+
+void workers_task_init(TASK *task, void (*run)(TASK *task)) {
+    task->run = run;
+    task->home = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED) % worker_count;
+}
+
+/*
+ * Queue a task on the deque of the calling worker, or on the task's home
+ * worker if called from outside the pool, and wake a sleeping worker.
+ */
+void workers_submit(TASK *task) {
+    deque_push(&workers[self>=0 ? self : task->home], task);
+    __atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idle, __ATOMIC_SEQ_CST)>0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
@@ -38,4 +38,33 @@ typedef struct test_step {
                                    // or time to delay.
 } TEST_STEP;
 
+/*
+ * Meta-commands for the extensions that are not TUs (conference bridges,
+ * paging and hunt groups) and for presence, beyond those in server.h.  For
+ * all but the watch commands, ID_TO_DIAL is a number rather than the ID of
+ * a TU.
+ */
+#define TU_DIAL_EXT_CMD    110  // Dial ID_TO_DIAL itself as the extension
+#define TU_AWAIT_CHAT_CMD  111  // Await ID_TO_DIAL chat messages received in all
+#define TU_AWAIT_PAGE_CMD  112  // Await ID_TO_DIAL pages received in all
+#define TU_WATCH_ID_CMD    113  // Watch the extension of TU ID_TO_DIAL
+#define TU_UNWATCH_ID_CMD  114  // Stop watching it
+#define TU_AWAIT_PRESENCE_CMD 115  // Await ID_TO_DIAL presence notifications received
+                                   // in all, the last reporting RESPONSE unless it is -1
+
 int run_test_script(char *name, TEST_STEP *scr, int port);
+
+/*
+ * Plain clients, for tests that go beyond a script.
+ *
+ * client_connect() returns the socket of a new client of the server on the
+ * local host, or -1.  client_send() sends text as it is, EOLs included.
+ * client_read_line() reads the next line, waiting at most msec for each
+ * byte, and returns its length without the EOL, or -1 on EOF or timeout.
+ * client_expect() reads the next line and returns 0 if it is the one given,
+ * otherwise -1.
+ */
+int client_connect(int port);
+int client_send(int fd, char *text);
+int client_read_line(int fd, char *buf, int size, int msec);
+int client_expect(int fd, char *line, int msec);
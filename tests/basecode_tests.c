@@ -183,3 +183,104 @@ Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
     fini(0);
 }
 #undef TEST_NAME
+
+#define TEST_NAME chat_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+/*
+ * Start the server with a drain timeout, and with its standard error going
+ * into a pipe, so that the test can see how long it took to drain.
+ */
+static int server_err;
+
+static void init_drain() {
+    int fds[2];
+    server_pid = 0;
+    wait_for_no_server();
+    cr_assert(pipe(fds) == 0, "Failed to create pipe\n");
+    fprintf(stderr, "***Starting server with drain timeout...");
+    if((server_pid = fork()) == 0) {
+	dup2(fds[1], 2);
+	close(fds[0]);
+	close(fds[1]);
+	execlp("bin/pbx", "pbx", "-p", SERVER_PORT_STR, "-d", "2000", NULL);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    close(fds[1]);
+    server_err = fds[0];
+    fprintf(stderr, "pid = %d\n", server_pid);
+    wait_for_server();
+}
+
+#define TEST_NAME drain_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   HND_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   HND_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+// Once the server has been sent SIGHUP, it disconnects every client.
+static TEST_STEP drained_script[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_AWAIT_CMD,      -1,           -1,             ONE_SEC },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             ONE_SEC },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             ONE_SEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_drain, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fprintf(stderr, "***Sending SIGHUP to server pid %d\n", server_pid);
+    kill(server_pid, SIGHUP);
+    ret = run_test_script(name, drained_script, SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    // The server exits on its own once the clients are gone.
+    int status;
+    waitpid(server_pid, &status, 0);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	      "Server did not exit normally (status 0x%x)\n", status);
+    char out[1024];
+    int len = 0, n;
+    while(len < sizeof(out)-1 && (n = read(server_err, out+len, sizeof(out)-1-len)) > 0)
+	len += n;
+    out[len] = '\0';
+    fprintf(stderr, "***Server reported: %s", out);
+    char *drained = strstr(out, "Drained in ");
+    cr_assert(drained != NULL, "Server did not report draining\n");
+    long ms = strtol(drained + strlen("Drained in "), NULL, 10);
+    cr_assert(ms >= 0 && ms < 2000, "Drain time %ld ms out of range\n", ms);
+}
+#undef TEST_NAME
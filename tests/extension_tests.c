@@ -0,0 +1,395 @@
+/*
+ * Tests of the extensions that are not TUs: conference bridges, the paging
+ * extension and hunt groups, and of clients watching the state of other
+ * extensions.  As with basecode_tests.c, these have to be run with -j1.
+ *
+ * A freshly started server gives out extensions in order, starting with 1,
+ * so TU n of a script that connects its TUs one at a time is at extension n+1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "presence.h"
+
+#define BRIDGE_EXT 800
+#define PAGING_EXT 700
+#define HUNT_EXT 900
+
+static int server_pid;
+
+static void wait_for_server() {
+    int ret;
+    int i = 0;
+    do {
+        fprintf(stderr, "Waiting for server to start (i = %d)\n", i);
+	ret = system("netstat -an | grep 'LISTEN[ ]*$' | grep ':"SERVER_PORT_STR"'");
+	sleep(SERVER_STARTUP_SLEEP);
+    } while(++i < 30 && WEXITSTATUS(ret));
+}
+
+/*
+ * Start the server on the test port with the extra arguments that follow,
+ * up to a NULL, and wait for it to listen.
+ */
+static void start_server(char *what, ...) {
+    char *argv[16] = { "pbx", "-p", SERVER_PORT_STR };
+    int argc = 3;
+    va_list ap;
+    va_start(ap, what);
+    while(argc < 15 && (argv[argc] = va_arg(ap, char *)) != NULL)
+	argc++;
+    va_end(ap);
+    argv[argc] = NULL;
+    server_pid = 0;
+    fprintf(stderr, "***Starting %s...", what);
+    if((server_pid = fork()) == 0) {
+	execvp("bin/pbx", argv);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    fprintf(stderr, "pid = %d\n", server_pid);
+    wait_for_server();
+}
+
+static void fini() {
+    int ret;
+    cr_assert(server_pid != 0, "No server was started!\n");
+    kill(server_pid, SIGHUP);
+    sleep(SERVER_SHUTDOWN_SLEEP);
+    kill(server_pid, SIGKILL);
+    wait(&ret);
+    if(WIFSIGNALED(ret))
+	cr_assert_fail("***Server terminated ungracefully with signal %d\n", WTERMSIG(ret));
+    cr_assert_eq(WEXITSTATUS(ret), 0, "Server exit status was not 0");
+}
+
+static void init_bridge() {
+    start_server("server with a conference bridge", "-b", QUOTE(BRIDGE_EXT), NULL);
+}
+
+static void init_paging() {
+    start_server("server with a paging extension", "-P", QUOTE(PAGING_EXT), NULL);
+}
+
+// TU 0 and TU 1 are the agents of the group.
+static void init_hunt() {
+    start_server("server with a hunt group", "-G", QUOTE(HUNT_EXT)":1,2", NULL);
+}
+
+static void init_presence() {
+    start_server("server", NULL);
+}
+
+// With room for every line, so that none is dropped for want of it.
+static void init_presence_unlimited() {
+    start_server("server with no output limit to speak of", "-q", "1000000000", NULL);
+}
+
+//the socket of a client, and the line expected next on it
+#define EXPECT(fd, line) \
+    cr_assert_eq(client_expect(fd, line, 1000), 0, "expected \"%s\"\n", line)
+
+#define SUITE extension_suite
+
+/*
+ * Three TUs join a bridge.  The chat of one goes to the other two but not
+ * back to itself, and a TU that has hung up gets no more of it.
+ */
+#define TEST_NAME conference_chat_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_EXT_CMD,   BRIDGE_EXT,   TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DIAL_EXT_CMD,   BRIDGE_EXT,   TU_CONNECTED,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_EXT_CMD,   BRIDGE_EXT,   TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_AWAIT_CHAT_CMD,  1,           -1,             HND_MSEC },
+    {   2,  TU_AWAIT_CHAT_CMD,  1,           -1,             HND_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_AWAIT_CHAT_CMD,  1,           -1,             HND_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    // Whatever was sent to a TU came before its ON HOOK, so the counts are final.
+    {   0,  TU_AWAIT_CHAT_CMD,  1,           -1,             TEN_MSEC },
+    {   1,  TU_AWAIT_CHAT_CMD,  1,           -1,             TEN_MSEC },
+    {   2,  TU_AWAIT_CHAT_CMD,  1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_bridge, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini();
+}
+#undef TEST_NAME
+
+/*
+ * A TU connected to the paging extension pages the TUs that are on hook
+ * with its chat, but not those that are off hook, and a second TU that
+ * dials the extension meanwhile gets a busy signal.  The page is queued to
+ * every TU before the pager hears back, so one that reached TU 3 or TU 4
+ * would be read ahead of their ON HOOK and fail the script.
+ */
+#define TEST_NAME paging_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   4,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_EXT_CMD,   PAGING_EXT,   TU_CONNECTED,   TEN_MSEC },
+    {   4,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   4,  TU_DIAL_EXT_CMD,   PAGING_EXT,   TU_BUSY_SIGNAL, TEN_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_AWAIT_PAGE_CMD,  1,           -1,             HND_MSEC },
+    {   2,  TU_AWAIT_PAGE_CMD,  1,           -1,             HND_MSEC },
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   4,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_AWAIT_PAGE_CMD,  0,           -1,             TEN_MSEC },
+    {   3,  TU_AWAIT_PAGE_CMD,  0,           -1,             TEN_MSEC },
+    {   4,  TU_AWAIT_PAGE_CMD,  0,           -1,             TEN_MSEC },
+    {   4,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_paging, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini();
+}
+#undef TEST_NAME
+
+/*
+ * Callers of a hunt group ring the agent that has been idle longest, and
+ * wait in order once every agent is busy.  An agent that becomes idle takes
+ * the first caller still waiting, not one that has given up.
+ */
+#define TEST_NAME hunt_group_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   4,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   5,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    // Make TU 1 the agent that has been idle longest.
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_EXT_CMD,   HUNT_EXT,     TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     HND_MSEC },
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_DIAL_EXT_CMD,   HUNT_EXT,     TU_RING_BACK,   TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_RINGING,     HND_MSEC },
+    // Both agents are busy, so TU 4 and then TU 5 wait, and TU 4 gives up.
+    {   4,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   4,  TU_DIAL_EXT_CMD,   HUNT_EXT,     TU_RING_BACK,   TEN_MSEC },
+    {   5,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   5,  TU_DIAL_EXT_CMD,   HUNT_EXT,     TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   HND_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   HND_MSEC },
+    {   4,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    // TU 0 turns TU 3 down, and is then rung for TU 5.
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   3,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   HND_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_RINGING,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   HND_MSEC },
+    {   5,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   HND_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   HND_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   5,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   HND_MSEC },
+    {   5,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   5,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   4,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_hunt, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini();
+}
+#undef TEST_NAME
+
+/*
+ * TU 0 watches TU 1 through a call, and is told of each state it goes
+ * through, starting with the one it is in, until it stops watching.  The
+ * line for a change is sent before the TU that made it hears back, so one
+ * sent after the unwatch would be read ahead of the reply to TU 0's pickup.
+ */
+#define TEST_NAME presence_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_WATCH_ID_CMD,    1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_PRESENCE_CMD, 1,        TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     HND_MSEC },
+    {   0,  TU_AWAIT_PRESENCE_CMD, 2,        TU_RINGING,     HND_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_AWAIT_PRESENCE_CMD, 3,        TU_CONNECTED,   HND_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   HND_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   HND_MSEC },
+    {   0,  TU_AWAIT_PRESENCE_CMD, 4,        TU_DIAL_TONE,   HND_MSEC },
+    {   0,  TU_UNWATCH_ID_CMD,  1,           TU_ON_HOOK,     TEN_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_AWAIT_PRESENCE_CMD, 4,        -1,             TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_presence, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini();
+}
+#undef TEST_NAME
+
+#define PRESENCE_TOGGLES 100
+#define FLOOD_CHATS 8000
+#define FLOOD_LEN 1000
+
+/*
+ * A watcher whose output is held up, here by the chats of a call that it
+ * does not read, is sent nothing for the changes of the extension it
+ * watches meanwhile.  Once it has read its output, it is sent one line,
+ * with the state the extension ended up in.
+ */
+Test(SUITE, presence_coalesce_test, .init = init_presence_unlimited, .timeout = 60) {
+    static char chat[FLOOD_LEN + 16];
+    char line[FLOOD_LEN + 16];
+    int w = client_connect(SERVER_PORT), x = client_connect(SERVER_PORT);
+    int y = client_connect(SERVER_PORT);
+    cr_assert(w >= 0 && x >= 0 && y >= 0, "could not connect\n");
+    EXPECT(w, "ON HOOK 1");
+    EXPECT(x, "ON HOOK 2");
+    EXPECT(y, "ON HOOK 3");
+    client_send(w, "watch 2" EOL);
+    EXPECT(w, "PRESENCE 2 ON HOOK");
+    EXPECT(w, "ON HOOK 1");
+    client_send(y, "pickup" EOL "dial 1" EOL);
+    EXPECT(y, "DIAL TONE");
+    EXPECT(y, "RING BACK");
+    EXPECT(w, "RINGING");
+    client_send(w, "pickup" EOL);
+    EXPECT(w, "CONNECTED 3");
+    EXPECT(y, "CONNECTED 1");
+
+    // More than the kernel will buffer for the watcher.
+    strcpy(chat, "chat ");
+    memset(chat + 5, 'x', FLOOD_LEN);
+    strcpy(chat + 5 + FLOOD_LEN, EOL);
+    FILE *in = fdopen(dup(y), "r");
+    for(int i = 0; i < FLOOD_CHATS; i += 100) {
+	for(int j = 0; j < 100; j++)
+	    client_send(y, chat);
+	for(int j = 0; j < 100; j++)
+	    cr_assert(fgets(line, sizeof(line), in) != NULL && strcmp(line, "CONNECTED 1" EOL) == 0,
+		      "chat %d failed\n", i + j);
+    }
+    fclose(in);
+    for(int i = 0; i < PRESENCE_TOGGLES; i++) {
+	client_send(x, "pickup" EOL "hangup" EOL);
+	EXPECT(x, "DIAL TONE");
+	EXPECT(x, "ON HOOK 2");
+    }
+
+    // Read until the server has nothing more to send.
+    struct timeval tv = { 0, 500000 };
+    setsockopt(w, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    in = fdopen(dup(w), "r");
+    int chats = 0, presences = 0;
+    while(fgets(line, sizeof(line), in) != NULL) {
+	if(strncmp(line, "CHAT ", 5) == 0) {
+	    chats++;
+	    continue;
+	}
+	cr_assert(strcmp(line, "PRESENCE 2 ON HOOK" EOL) == 0, "unexpected \"%s\"\n", line);
+	presences++;
+    }
+    fclose(in);
+    cr_assert_eq(chats, FLOOD_CHATS, "%d of %d chats were received\n", chats, FLOOD_CHATS);
+    cr_assert_eq(presences, 1, "%d lines for %d changes\n", presences, 2 * PRESENCE_TOGGLES);
+    close(y);
+    close(x);
+    close(w);
+    fini();
+}
+
+/*
+ * A client can watch at most PRESENCE_MAX_WATCHES extensions, registered
+ * or not.  Beyond that a watch is refused, with no line for the extension,
+ * until the client gives up one of its watches.
+ */
+Test(SUITE, presence_max_watches_test, .init = init_presence, .timeout = 30) {
+    char line[32];
+    int w = client_connect(SERVER_PORT), x = client_connect(SERVER_PORT);
+    cr_assert(w >= 0 && x >= 0, "could not connect\n");
+    EXPECT(w, "ON HOOK 1");
+    EXPECT(x, "ON HOOK 2");
+    for(int i = 0; i < PRESENCE_MAX_WATCHES; i++) {
+	sprintf(line, "watch %d" EOL, 1000 + i);
+	client_send(w, line);
+	EXPECT(w, "ON HOOK 1");
+    }
+    client_send(w, "watch 2" EOL);
+    EXPECT(w, "ON HOOK 1");
+    client_send(w, "unwatch 1000" EOL "watch 2" EOL);
+    EXPECT(w, "ON HOOK 1");
+    EXPECT(w, "PRESENCE 2 ON HOOK");
+    EXPECT(w, "ON HOOK 1");
+    close(x);
+    close(w);
+    fini();
+}
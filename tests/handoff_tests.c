@@ -0,0 +1,72 @@
+/*
+ * Tests of restoring TUs handed over by another server, calling tu.c
+ * directly with TUs that are never registered, each on one end of a
+ * socketpair whose other end plays the client.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <criterion/criterion.h>
+
+#include "tu_ext.h"
+
+static TU *tu;
+static int client;
+
+static void init() {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+    struct timeval tv = { 1, 0 };
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    client = sv[1];
+    cr_assert_not_null(tu = tu_init(sv[0]), "tu_init failed");
+    tu_ref(tu, "Handoff test");
+}
+
+static void fini() {
+    tu_unref(tu, "Handoff test done");
+    close(client);
+}
+
+/*
+ * Restore a TU from a snapshot of one side of a call whose other side was
+ * not handed over, and check the one line that tells the client so.
+ */
+static void restore_alone(TU_STATE state, char *expected) {
+    TU_SNAPSHOT snap = { .ext = 5, .state = state, .peer_ext = 6, .caller = state==TU_RING_BACK };
+    char buf[64];
+    cr_assert_eq(tu_restore(tu, &snap, NULL, NULL, "", 0), 0, "tu_restore failed");
+    ssize_t n = read(client, buf, sizeof(buf)-1);
+    cr_assert(n>0, "nothing was sent to the client");
+    buf[n] = '\0';
+    cr_assert(strcmp(buf, expected)==0, "expected \"%s\", was \"%s\"", expected, buf);
+}
+
+#define SUITE handoff_suite
+
+/*
+ * A phone that was ringing goes back on hook, as when the caller hangs up.
+ */
+Test(SUITE, restore_ringing_alone_test, .init = init, .fini = fini, .timeout = 5) {
+    restore_alone(TU_RINGING, "ON HOOK 5" EOL);
+}
+
+/*
+ * A caller that was waiting for an answer gets a dial tone, as when the
+ * callee hangs up.
+ */
+Test(SUITE, restore_ring_back_alone_test, .init = init, .fini = fini, .timeout = 5) {
+    restore_alone(TU_RING_BACK, "DIAL TONE" EOL);
+}
+
+/*
+ * Likewise a party to an answered call.
+ */
+Test(SUITE, restore_connected_alone_test, .init = init, .fini = fini, .timeout = 5) {
+    restore_alone(TU_CONNECTED, "DIAL TONE" EOL);
+}
@@ -0,0 +1,126 @@
+/*
+ * Tests of the idle lists and queues of hunt groups, calling hunt.c directly
+ * with TUs that are never registered.  Each TU gets a link of its own, as
+ * tu.c would give it, and the test keeps one reference to it throughout.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <criterion/criterion.h>
+
+#include "hunt.h"
+
+#define NTUS 4
+
+static TU *tus[NTUS];
+static HUNT_LINK links[NTUS];
+static HUNT *hunt;
+
+static void init() {
+    int agents[NTUS];
+    for(int i = 0; i < NTUS; i++) {
+	int sv[2];
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+	close(sv[1]);
+	cr_assert_not_null(tus[i] = tu_init(sv[0]), "tu_init failed");
+	tu_ref(tus[i], "Hunt test");
+	links[i] = (HUNT_LINK){ .tu = tus[i] };
+	agents[i] = i + 1;
+    }
+    cr_assert_not_null(hunt = hunt_new(900, agents, NTUS), "hunt_new failed");
+}
+
+static void fini() {
+    for(int i = 0; i < NTUS; i++) {
+	hunt_agent_busy(hunt, &links[i]);
+	if(hunt_caller_cancel(hunt, &links[i]))
+	    tu_unref(tus[i], "Left hunt test queue");
+    }
+    hunt_free(hunt);
+    for(int i = 0; i < NTUS; i++)
+	tu_unref(tus[i], "Hunt test done");
+}
+
+/*
+ * Release the reference that hunt_caller_wait() or hunt_agent_idle() gives
+ * with the TU it returns, checking that it is the expected one.
+ */
+static void expect(TU *got, int want) {
+    cr_assert_eq(got, tus[want], "expected TU %d, was %p", want, got);
+    tu_unref(got, "Checked by hunt test");
+}
+
+#define SUITE hunt_suite
+
+/*
+ * Callers are given the agents in the order they became idle, and an agent
+ * that is busy again is not given to anyone.
+ */
+Test(SUITE, longest_idle_test, .init = init, .fini = fini, .timeout = 5) {
+    cr_assert_null(hunt_agent_idle(hunt, &links[2]), "no caller was waiting");
+    cr_assert_null(hunt_agent_idle(hunt, &links[0]), "no caller was waiting");
+    cr_assert_null(hunt_agent_idle(hunt, &links[1]), "no caller was waiting");
+    // Already idle, so it keeps its place.
+    cr_assert_null(hunt_agent_idle(hunt, &links[2]), "no caller was waiting");
+    hunt_agent_busy(hunt, &links[0]);
+    expect(hunt_caller_wait(hunt, &links[3], 0), 2);
+    expect(hunt_caller_wait(hunt, &links[3], 0), 1);
+    cr_assert_null(hunt_caller_wait(hunt, &links[3], 0), "no agent was idle");
+    cr_assert(links[3].listed, "caller was not queued");
+}
+
+/*
+ * Callers that find no idle agent are given to agents in the order they
+ * called, and an agent goes on the idle list only once nobody is waiting.
+ */
+Test(SUITE, fifo_queue_test, .init = init, .fini = fini, .timeout = 5) {
+    cr_assert_null(hunt_caller_wait(hunt, &links[1], 0), "no agent was idle");
+    cr_assert_null(hunt_caller_wait(hunt, &links[3], 0), "no agent was idle");
+    cr_assert_null(hunt_caller_wait(hunt, &links[2], 0), "no agent was idle");
+    expect(hunt_agent_idle(hunt, &links[0]), 1);
+    expect(hunt_agent_idle(hunt, &links[0]), 3);
+    expect(hunt_agent_idle(hunt, &links[0]), 2);
+    cr_assert_null(hunt_agent_idle(hunt, &links[0]), "nobody was left waiting");
+    cr_assert(links[0].listed, "agent was not made idle");
+}
+
+/*
+ * A caller that gives up leaves the queue, once, and the others keep their
+ * order.
+ */
+Test(SUITE, cancel_test, .init = init, .fini = fini, .timeout = 5) {
+    cr_assert_null(hunt_caller_wait(hunt, &links[1], 0), "no agent was idle");
+    cr_assert_null(hunt_caller_wait(hunt, &links[2], 0), "no agent was idle");
+    cr_assert_null(hunt_caller_wait(hunt, &links[3], 0), "no agent was idle");
+    cr_assert_eq(hunt_caller_cancel(hunt, &links[2]), 1, "caller was not queued");
+    tu_unref(tus[2], "Left hunt test queue");
+    cr_assert_eq(hunt_caller_cancel(hunt, &links[2]), 0, "caller was dequeued twice");
+    expect(hunt_agent_idle(hunt, &links[0]), 1);
+    expect(hunt_agent_idle(hunt, &links[0]), 3);
+    cr_assert_null(hunt_agent_idle(hunt, &links[0]), "nobody was left waiting");
+}
+
+/*
+ * When a match turns out to be stale, as tu_hunt_connect() finds it, the
+ * caller waits again ahead of everyone else, unless it already called again
+ * and is back in the queue, and the agent takes the next caller.
+ */
+Test(SUITE, stale_match_test, .init = init, .fini = fini, .timeout = 5) {
+    cr_assert_null(hunt_caller_wait(hunt, &links[1], 0), "no agent was idle");
+    cr_assert_null(hunt_caller_wait(hunt, &links[2], 0), "no agent was idle");
+    cr_assert_null(hunt_caller_wait(hunt, &links[3], 0), "no agent was idle");
+    // Agent 0 is given caller 1, but went off hook meanwhile.
+    expect(hunt_agent_idle(hunt, &links[0]), 1);
+    cr_assert_null(hunt_caller_wait(hunt, &links[1], 1), "no agent was idle");
+    // Caller 1 now comes first, and caller 3 stays where it was.
+    cr_assert_null(hunt_caller_wait(hunt, &links[3], 1), "no agent was idle");
+    // Agent 0 is back on hook and given caller 1, which has hung up meanwhile,
+    // so it takes the next one.
+    expect(hunt_agent_idle(hunt, &links[0]), 1);
+    expect(hunt_agent_idle(hunt, &links[0]), 2);
+    expect(hunt_agent_idle(hunt, &links[0]), 3);
+    cr_assert_null(hunt_agent_idle(hunt, &links[0]), "nobody was left waiting");
+}
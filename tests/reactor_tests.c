@@ -0,0 +1,338 @@
+/*
+ * Tests that run the basic scripts against a server using the epoll reactor.
+ * As with basecode_tests.c, these have to be run with -j1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "reactor.h"
+#include "handoff.h"
+
+static int server_pid;
+
+static void wait_for_server() {
+    int ret;
+    int i = 0;
+    do {
+        fprintf(stderr, "Waiting for server to start (i = %d)\n", i);
+	ret = system("netstat -an | grep 'LISTEN[ ]*$' | grep ':"SERVER_PORT_STR"'");
+	sleep(SERVER_STARTUP_SLEEP);
+    } while(++i < 30 && WEXITSTATUS(ret));
+}
+
+/*
+ * Start the server on the test port with the extra arguments that follow,
+ * up to a NULL, and wait for it to listen.
+ */
+static void start_server(char *what, ...) {
+    char *argv[16] = { "pbx", "-p", SERVER_PORT_STR };
+    int argc = 3;
+    va_list ap;
+    va_start(ap, what);
+    while(argc < 15 && (argv[argc] = va_arg(ap, char *)) != NULL)
+	argc++;
+    va_end(ap);
+    argv[argc] = NULL;
+    server_pid = 0;
+    fprintf(stderr, "***Starting %s...", what);
+    if((server_pid = fork()) == 0) {
+	execvp("bin/pbx", argv);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    fprintf(stderr, "pid = %d\n", server_pid);
+    wait_for_server();
+}
+
+//start a server that takes over from the one handing over on path
+static int start_successor(char *path) {
+    int pid;
+    fprintf(stderr, "***Starting server taking over on %s...", path);
+    if((pid = fork()) == 0) {
+	execl("bin/pbx", "pbx", "-R", path, NULL);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    fprintf(stderr, "pid = %d\n", pid);
+    return pid;
+}
+
+static void init() {
+    start_server("reactor server", "-e", "2", NULL);
+}
+
+//same, but with commands executed by a worker pool
+static void init_workers() {
+    start_server("reactor server with worker pool", "-e", "1", "-w", "2", NULL);
+}
+
+//same, with the loops doing their I/O with io_uring, if the kernel allows;
+//otherwise the server would quietly use epoll, so no server is started
+static int uring_ok;
+
+static void init_uring() {
+    if(!(uring_ok = reactor_uring_available()))
+	return;
+    start_server("io_uring reactor server", "-e", "2", "-u", NULL);
+}
+
+static void fini() {
+    int ret;
+    cr_assert(server_pid != 0, "No server was started!\n");
+    kill(server_pid, SIGHUP);
+    sleep(SERVER_SHUTDOWN_SLEEP);
+    kill(server_pid, SIGKILL);
+    wait(&ret);
+    if(WIFSIGNALED(ret))
+	cr_assert_fail("***Server terminated ungracefully with signal %d\n", WTERMSIG(ret));
+    cr_assert_eq(WEXITSTATUS(ret), 0, "Server exit status was not 0");
+}
+
+#define SUITE reactor_suite
+
+#define TEST_NAME reactor_dial_answer_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini();
+}
+#undef TEST_NAME
+
+#define TEST_NAME reactor_dial_disconnect_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini();
+}
+#undef TEST_NAME
+
+#define TEST_NAME reactor_workers_chat_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_workers, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini();
+}
+#undef TEST_NAME
+
+#define TEST_NAME reactor_uring_chat_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_uring, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    if(!uring_ok)
+	cr_skip_test("io_uring is not available, the server would use epoll\n");
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini();
+}
+#undef TEST_NAME
+
+#define HANDOFF_PATH "/tmp/pbx_test_handoff.sock"
+
+//the socket of a client, and the line expected next on it
+#define EXPECT(fd, line) \
+    cr_assert_eq(client_expect(fd, line, 1000), 0, "expected \"%s\"\n", line)
+
+static void init_handoff() {
+    start_server("reactor server accepting handoffs", "-H", HANDOFF_PATH, NULL);
+}
+
+/*
+ * A server hands a call over to a new one while a client is in the middle
+ * of sending a line.  The call goes on, the rest of the line completes what
+ * the old server had read, and the new server accepts on the old listener.
+ */
+Test(SUITE, reactor_handoff_test, .init = init_handoff, .timeout = 30) {
+    int a = client_connect(SERVER_PORT), b = client_connect(SERVER_PORT);
+    int status;
+    cr_assert(a >= 0 && b >= 0, "could not connect\n");
+    EXPECT(a, "ON HOOK 1");
+    EXPECT(b, "ON HOOK 2");
+    client_send(a, "pickup" EOL "dial 2" EOL);
+    EXPECT(a, "DIAL TONE");
+    EXPECT(a, "RING BACK");
+    EXPECT(b, "RINGING");
+    client_send(b, "pickup" EOL);
+    EXPECT(b, "CONNECTED 1");
+    EXPECT(a, "CONNECTED 2");
+    client_send(a, "chat hel");
+    usleep(100000);
+
+    int old_pid = server_pid;
+    server_pid = start_successor(HANDOFF_PATH);
+    cr_assert_eq(waitpid(old_pid, &status, 0), old_pid, "old server was not reaped\n");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	      "old server did not exit cleanly after handing over\n");
+
+    client_send(a, "lo" EOL);
+    EXPECT(b, "CHAT hello");
+    EXPECT(a, "CONNECTED 2");
+    client_send(b, "chat back" EOL);
+    EXPECT(a, "CHAT back");
+    EXPECT(b, "CONNECTED 1");
+    // The new server hands out extensions afresh.
+    char line[64];
+    int c = client_connect(SERVER_PORT);
+    cr_assert(c >= 0 && client_read_line(c, line, sizeof(line), 1000) > 0 &&
+	      strncmp(line, "ON HOOK ", 8) == 0, "new server is not accepting\n");
+    close(c);
+    close(b);
+    close(a);
+    fini();
+}
+
+//send a handoff message with descriptors attached
+static void send_with_fds(int sock, void *data, size_t len, int *fds, int nfds) {
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(2*sizeof(int))];
+    } control;
+    struct iovec iov = { data, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if(nfds > 0) {
+	memset(&control, 0, sizeof(control));
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds*sizeof(int));
+    }
+    cr_assert_eq(sendmsg(sock, &msg, 0), (ssize_t)len, "sendmsg failed\n");
+}
+
+/*
+ * The test plays an old server that hands a client over, with output the
+ * client has not been sent, but never commits.  The new server has to give
+ * the client up without sending it anything, and the connection must still
+ * work for the old server.
+ */
+Test(SUITE, reactor_handoff_uncommitted_test, .timeout = 30) {
+    struct sockaddr_un ua = { .sun_family = AF_UNIX };
+    strcpy(ua.sun_path, HANDOFF_PATH);
+    unlink(HANDOFF_PATH);
+    int ls = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    cr_assert(ls >= 0 && bind(ls, (struct sockaddr *)&ua, sizeof(ua)) == 0 &&
+	      listen(ls, 1) == 0, "could not listen for the new server\n");
+    struct sockaddr_in ia = { .sin_family = AF_INET, .sin_port = htons(SERVER_PORT),
+			      .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int one = 1;
+    int tl = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(tl, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    cr_assert(tl >= 0 && bind(tl, (struct sockaddr *)&ia, sizeof(ia)) == 0 &&
+	      listen(tl, 8) == 0, "could not listen for clients\n");
+    int c = client_connect(SERVER_PORT);
+    int srv = accept(tl, NULL, NULL);
+    cr_assert(c >= 0 && srv >= 0, "could not connect the client\n");
+
+    int pid = start_successor(HANDOFF_PATH);
+    int h = accept(ls, NULL, NULL);
+    cr_assert(h >= 0, "new server did not ask to take over\n");
+    char out[] = "hello" EOL;
+    struct {
+	HANDOFF_RECORD rec;
+	char out[sizeof(out)-1];
+    } __attribute__((packed)) state = {
+	.rec = { .tu = { .ext = 5, .state = TU_DIAL_TONE, .peer_ext = -1 },
+		 .out_len = sizeof(out)-1 }
+    };
+    memcpy(state.out, out, sizeof(out)-1);
+    HANDOFF_HEADER hdr = { .magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION,
+			   .count = 1, .state_len = sizeof(state) };
+    uint32_t count = 1;
+    send_with_fds(h, &hdr, sizeof(hdr), &tl, 1);
+    send_with_fds(h, &count, sizeof(count), &srv, 1);
+    send_with_fds(h, &state, sizeof(state), NULL, 0);
+    char reply;
+    cr_assert_eq(read(h, &reply, 1), 1, "new server did not reply\n");
+    cr_assert_eq(reply, HANDOFF_READY, "new server did not say it was ready\n");
+
+    // No commit: the new server has to give up once it stops waiting.
+    int status;
+    cr_assert_eq(waitpid(pid, &status, 0), pid, "new server was not reaped\n");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) != 0,
+	      "new server claims to have taken over\n");
+    struct pollfd pfd = { .fd = c, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, 100), 0, "the client was sent something or closed\n");
+    client_send(srv, "ON HOOK 5" EOL);
+    EXPECT(c, "ON HOOK 5");
+    close(h);
+    close(srv);
+    close(c);
+    close(tl);
+    close(ls);
+    unlink(HANDOFF_PATH);
+}
@@ -6,6 +6,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 
@@ -63,6 +65,11 @@
 
 #define RESYNC NUM_STATES
 
+/* What parse_message() returns for messages that are not state notifications. */
+#define CHAT_MESSAGE NUM_STATES
+#define PAGE_MESSAGE (NUM_STATES+1)
+#define PRESENCE_MESSAGE (NUM_STATES+2)
+
 int next_states[NUM_STATES][NUM_COMMANDS] = {
   [TU_ON_HOOK] {
       1<<TU_DIAL_TONE | 1<<(TU_RINGING+RESYNC) | 1<<(TU_ON_HOOK+RESYNC),    // TU_PICKUP_CMD
@@ -160,6 +167,17 @@ typedef struct tu {
      * notification is received.
      */
     TU_COMMAND last_command;
+
+    /* The number of chat messages and of pages received so far. */
+    int chats;
+    int pages;
+
+    /*
+     * The number of presence notifications received so far, and the state
+     * reported by the last of them.
+     */
+    int presences;
+    TU_STATE presence;
 } TU;
 
 /*
@@ -206,13 +224,15 @@ TEST_STEP sample_test_script[] = {
 static void test(FILE *in, FILE *out, int cmds);
 static int choose_action(void);
 static TU_STATE parse_message(char *msg, char **arg);
+static int parse_presence(char *arg, TU_STATE *state);
 static char *unparse_state_set(int set);
 static void trim_eol(char *msg);
 static char *timestamp(void);
 static int connect_command(TU *tu, int port);
 static void disconnect_command(TU *tu);
 static int connect_to_server(struct in_addr *addr, int port);
-static int read_responses(TU *tu, TU_STATE exp, struct timeval tv);
+static int read_responses(TU *tu, TU_STATE exp, int *count, int exp_count,
+			  struct timeval tv);
 
 /*
  * Temporary main until this is fleshed out.
@@ -257,7 +277,7 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	TU *tu = &tus[ts->id];
 
 	// First, deal with performing any explicit action.
-	switch(ts->command) {
+	switch(cmd) {
 	// Meta-commands
 	case TU_NO_CMD:
 	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_NO_CMD\n", timestamp(), TU_ID(tu), ts - scr);
@@ -315,6 +335,30 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	    fprintf(tu->out, "%s%s", tu_command_names[cmd], EOL);
 	    fflush(tu->out);
 	    break;
+	case TU_DIAL_EXT_CMD:
+	    ext = ts->id_to_dial;
+	    fprintf(stderr, "%s: [%ld] (step #%ld) %s extension %d\n",
+		    timestamp(), TU_ID(tu), ts - scr, tu_command_names[TU_DIAL_CMD], ext);
+	    fprintf(tu->out, "%s %d%s", tu_command_names[TU_DIAL_CMD], ext, EOL);
+	    fflush(tu->out);
+	    break;
+	case TU_WATCH_ID_CMD:
+	case TU_UNWATCH_ID_CMD:
+	    ext = tus[ts->id_to_dial].extension;
+	    fprintf(stderr, "%s: [%ld] (step #%ld) %s extension %d (id %d)\n",
+		    timestamp(), TU_ID(tu), ts - scr, cmd == TU_WATCH_ID_CMD ? "watch" : "unwatch",
+		    ext, ts->id_to_dial);
+	    fprintf(tu->out, "%s %d%s", cmd == TU_WATCH_ID_CMD ? "watch" : "unwatch", ext, EOL);
+	    fflush(tu->out);
+	    break;
+	case TU_AWAIT_CHAT_CMD:
+	case TU_AWAIT_PAGE_CMD:
+	case TU_AWAIT_PRESENCE_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) %s %d\n", timestamp(), TU_ID(tu), ts - scr,
+		    cmd == TU_AWAIT_CHAT_CMD ? "TU_AWAIT_CHAT_CMD" :
+		    cmd == TU_AWAIT_PAGE_CMD ? "TU_AWAIT_PAGE_CMD" : "TU_AWAIT_PRESENCE_CMD",
+		    ts->id_to_dial);
+	    break;
 
 	// Unknown command
 	default:
@@ -325,6 +369,16 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	if(cmd <= TU_CHAT_CMD) {
 	    tu->last_command = cmd;
 	    tu->expected_states = next_states[tu->current_state][cmd];
+	} else if(cmd == TU_DIAL_EXT_CMD) {
+	    // A conference bridge or the paging extension connects at once.
+	    tu->last_command = TU_DIAL_CMD;
+	    tu->expected_states = next_states[tu->current_state][TU_DIAL_CMD];
+	    if(tu->current_state == TU_DIAL_TONE)
+		tu->expected_states |= 1<<TU_CONNECTED;
+	} else if(cmd == TU_WATCH_ID_CMD || cmd == TU_UNWATCH_ID_CMD) {
+	    // Watching changes nothing, so the reply is the current state, as for a chat.
+	    tu->last_command = TU_CHAT_CMD;
+	    tu->expected_states = next_states[tu->current_state][TU_CHAT_CMD];
 	} else if(cmd == TU_CONNECT_CMD) {
 	    // This is to get the right set of expected commands on initial connect,
 	    // when no previous command has actually been sent.
@@ -344,7 +398,21 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	// If expected response seen, go to next step.
 	// If unexpected response seen, fail.
 	// If timeout occurs, shutdown the connection so that read will fail.
-	if(tu->infd && read_responses(tu, ts->response, ts->timeout) == -1)
+	if(cmd == TU_AWAIT_CHAT_CMD || cmd == TU_AWAIT_PAGE_CMD) {
+	    int *count = cmd == TU_AWAIT_CHAT_CMD ? &tu->chats : &tu->pages;
+	    if(!tu->infd ||
+	       read_responses(tu, -1, count, ts->id_to_dial, ts->timeout) == -1)
+		return -1;
+	} else if(cmd == TU_AWAIT_PRESENCE_CMD) {
+	    if(!tu->infd ||
+	       read_responses(tu, -1, &tu->presences, ts->id_to_dial, ts->timeout) == -1)
+		return -1;
+	    if(ts->response != -1 && tu->presence != ts->response) {
+		fprintf(stderr, "%s: [%ld] Last presence was %s, expected %s\n", timestamp(),
+			TU_ID(tu), tu_state_names[tu->presence], tu_state_names[ts->response]);
+		return -1;
+	    }
+	} else if(tu->infd && read_responses(tu, ts->response, NULL, 0, ts->timeout) == -1)
 	    return -1;
 
 	// Advance script to next test step.
@@ -432,15 +500,24 @@ static void alarm_handler(int sig) {
 }
 
 /*
- * Read responses from the server for a specified TU until an expected state is reached.
+ * Read responses from the server for a specified TU until an expected state is reached,
+ * or, if count is not NULL, until the chat messages, pages or presence notifications it
+ * counts number exp_count.
+ * Receiving more of them than that is a failure.
  */
-static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
+static int read_responses(TU *tu, TU_STATE exp, int *count, int exp_count,
+			  struct timeval tv) {
     TU_STATE new;
     char msg[MAX_MESSAGE_LEN];
     char *arg;
     int ret = 0;
-    fprintf(stderr, "%s: [%ld] Read responses until %s\n",
-	    timestamp(), TU_ID(tu), exp == -1 ? "EOF" : tu_state_names[exp]);
+    if(count)
+	fprintf(stderr, "%s: [%ld] Read responses until %d %s received\n", timestamp(),
+		TU_ID(tu), exp_count, count == &tu->chats ? "chat messages" :
+		count == &tu->pages ? "pages" : "presence notifications");
+    else
+	fprintf(stderr, "%s: [%ld] Read responses until %s\n",
+		timestamp(), TU_ID(tu), exp == -1 ? "EOF" : tu_state_names[exp]);
     tu_to_read = tu;
     struct itimerval itv = {0};
     struct sigaction sa = {0}, oa;
@@ -454,6 +531,14 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
     itv.it_value = tv;
     setitimer(ITIMER_REAL, &itv, NULL);
     do {
+	if(count && *count >= exp_count) {
+	    if(*count > exp_count) {
+		fprintf(stderr, "%s: [%ld] Received %d, more than %d\n",
+			timestamp(), TU_ID(tu), *count, exp_count);
+		ret = -1;
+	    }
+	    goto disarm;
+	}
 	fprintf(stderr, "%s: [%ld] Expecting: %s\n", timestamp(), TU_ID(tu),
 		unparse_state_set(tu->expected_states));
 
@@ -466,6 +551,11 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 			timestamp(), TU_ID(tu));
 		ret = -1;
 		goto disarm;
+	    } else if(count) {
+		fprintf(stderr, "%s: [%ld] EOF seen while awaiting messages\n",
+			timestamp(), TU_ID(tu));
+		ret = -1;
+		goto disarm;
 	    } else {
 		if(tu->expected_states == ~0) {
 		    fprintf(stderr, "%s: [%ld] Matched EOF after disconnect\n",
@@ -487,12 +577,12 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 	trim_eol(msg);
 	fprintf(stderr, "%s: [%ld] Message from server: %s\n", timestamp(), TU_ID(tu), msg);
 	new = parse_message(msg, &arg);
-	if(new > NUM_STATES) {
+	if(new > PRESENCE_MESSAGE) {
 	    // Tracing output already produced by parse_message.
 	    ret = -1;
 	    goto disarm;
 	}
-	if(new == NUM_STATES) {
+	if(new == CHAT_MESSAGE) {
 	    // The message is chat.  There is no state transition, but we must be
 	    // in the connected state.
 	    if(tu->current_state != TU_CONNECTED) {
@@ -501,6 +591,29 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 		ret = -1;
 		goto disarm;
 	    }
+	    tu->chats++;
+	    continue;
+	}
+	if(new == PAGE_MESSAGE) {
+	    // Likewise, only a TU that is on hook gets paged.
+	    if(tu->current_state != TU_ON_HOOK) {
+		fprintf(stderr, "%s: [%ld] Page received when not in state %s\n",
+			timestamp(), TU_ID(tu), tu_state_names[TU_ON_HOOK]);
+		ret = -1;
+		goto disarm;
+	    }
+	    tu->pages++;
+	    continue;
+	}
+	if(new == PRESENCE_MESSAGE) {
+	    // A watcher is told of the extensions it watches whatever its own state.
+	    if(parse_presence(arg, &tu->presence) == -1) {
+		fprintf(stderr, "%s: [%ld] Malformed presence notification\n",
+			timestamp(), TU_ID(tu));
+		ret = -1;
+		goto disarm;
+	    }
+	    tu->presences++;
 	    continue;
 	}
 
@@ -547,7 +660,7 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 	    if(tu->expected_states != ~0)
 		tu->expected_states = next_states[new][tu->last_command];
 	}
-    } while(tu->current_state != exp);
+    } while(count || tu->current_state != exp);
 
  disarm:
     itv = (struct itimerval) {0};
@@ -571,10 +684,37 @@ static TU_STATE parse_message(char *msg, char **arg) {
     if(strstr(msg, "CHAT") == msg) {
 	  if(arg)
 	      *arg = msg + strlen("CHAT");
-	  return NUM_STATES;
+	  return CHAT_MESSAGE;
+    }
+    if(strstr(msg, "PAGE") == msg) {
+	  if(arg)
+	      *arg = msg + strlen("PAGE");
+	  return PAGE_MESSAGE;
+    }
+    if(strstr(msg, "PRESENCE") == msg) {
+	  if(arg)
+	      *arg = msg + strlen("PRESENCE");
+	  return PRESENCE_MESSAGE;
     }
     fprintf(stderr, "%s: Unrecognized message: %s\n", timestamp(), msg);
-    return NUM_STATES+1;
+    return PRESENCE_MESSAGE+1;
+}
+
+/*
+ * Parse the " <ext> <state>" that follows PRESENCE in a message.
+ * Returns 0 on success, -1 if it is malformed.
+ */
+static int parse_presence(char *arg, TU_STATE *state) {
+    int ext, n = 0;
+    if(sscanf(arg, " %d %n", &ext, &n) != 1 || n == 0)
+	return -1;
+    for(int i = 0; i < NUM_STATES; i++) {
+	if(strcmp(arg + n, tu_state_names[i]) == 0) {
+	    *state = i;
+	    return 0;
+	}
+    }
+    return -1;
 }
 
 /*
@@ -640,3 +780,61 @@ static char *timestamp() {
     sprintf(buf, "%ld.%06ld", tv.tv_sec, tv.tv_usec);
     return buf;
 }
+
+/*
+ * Plain clients, for tests of what the scripts can't express: a client is
+ * just a socket connected to the server, from which lines are read one at
+ * a time so that nothing after the line asked for is consumed.
+ */
+int client_connect(int port) {
+    struct in_addr addr;
+    inet_aton("127.0.0.1", &addr);
+    int fd = connect_to_server(&addr, port);
+    if(fd < 0)
+	fprintf(stderr, "%s: Client failed to connect to port %d\n", timestamp(), port);
+    return fd;
+}
+
+int client_send(int fd, char *text) {
+    size_t len = strlen(text);
+    while(len > 0) {
+	ssize_t n = write(fd, text, len);
+	if(n < 0)
+	    return -1;
+	text += n;
+	len -= n;
+    }
+    return 0;
+}
+
+int client_read_line(int fd, char *buf, int size, int msec) {
+    int len = 0;
+    while(len < size - 1) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if(poll(&pfd, 1, msec) != 1) {
+	    fprintf(stderr, "%s: [fd %d] Timeout reading a line\n", timestamp(), fd);
+	    return -1;
+	}
+	if(read(fd, buf + len, 1) != 1) {
+	    fprintf(stderr, "%s: [fd %d] EOF reading a line\n", timestamp(), fd);
+	    return -1;
+	}
+	if(buf[len++] == '\n')
+	    break;
+    }
+    buf[len] = '\0';
+    trim_eol(buf);
+    fprintf(stderr, "%s: [fd %d] Line from server: %s\n", timestamp(), fd, buf);
+    return strlen(buf);
+}
+
+int client_expect(int fd, char *line, int msec) {
+    char buf[MAX_MESSAGE_LEN];
+    if(client_read_line(fd, buf, sizeof(buf), msec) < 0)
+	return -1;
+    if(strcmp(buf, line) != 0) {
+	fprintf(stderr, "%s: [fd %d] Expected \"%s\"\n", timestamp(), fd, line);
+	return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,461 @@
+/*
+ * Tests of what the server does beyond the protocol, as set by its options:
+ * the limit on output queued for a client, call detail records and metrics,
+ * and of commands from several clients that race with each other.
+ * As with basecode_tests.c, these have to be run with -j1.
+ *
+ * A freshly started server gives out extensions in order, starting with 1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "cdr.h"
+
+static int server_pid;
+
+static void wait_for_server() {
+    int ret;
+    int i = 0;
+    do {
+        fprintf(stderr, "Waiting for server to start (i = %d)\n", i);
+	ret = system("netstat -an | grep 'LISTEN[ ]*$' | grep ':"SERVER_PORT_STR"'");
+	sleep(SERVER_STARTUP_SLEEP);
+    } while(++i < 30 && WEXITSTATUS(ret));
+}
+
+/*
+ * Start the server on the test port with the extra arguments that follow,
+ * up to a NULL, and wait for it to listen.
+ */
+static void start_server(char *what, ...) {
+    char *argv[16] = { "pbx", "-p", SERVER_PORT_STR };
+    int argc = 3;
+    va_list ap;
+    va_start(ap, what);
+    while(argc < 15 && (argv[argc] = va_arg(ap, char *)) != NULL)
+	argc++;
+    va_end(ap);
+    argv[argc] = NULL;
+    server_pid = 0;
+    fprintf(stderr, "***Starting %s...", what);
+    if((server_pid = fork()) == 0) {
+	execvp("bin/pbx", argv);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    fprintf(stderr, "pid = %d\n", server_pid);
+    wait_for_server();
+}
+
+static void fini() {
+    int ret;
+    cr_assert(server_pid != 0, "No server was started!\n");
+    kill(server_pid, SIGHUP);
+    sleep(SERVER_SHUTDOWN_SLEEP);
+    kill(server_pid, SIGKILL);
+    wait(&ret);
+    if(WIFSIGNALED(ret))
+	cr_assert_fail("***Server terminated ungracefully with signal %d\n", WTERMSIG(ret));
+    cr_assert_eq(WEXITSTATUS(ret), 0, "Server exit status was not 0");
+}
+
+//the socket of a client, and the line expected next on it
+#define EXPECT(fd, line) \
+    cr_assert_eq(client_expect(fd, line, 1000), 0, "expected \"%s\"\n", line)
+
+/*
+ * Have the client at extension caller call the one at extension callee and
+ * the callee answer.
+ */
+static void connect_call(int caller, int callee, int callee_ext, int caller_ext) {
+    char line[32];
+    client_send(caller, "pickup" EOL);
+    EXPECT(caller, "DIAL TONE");
+    sprintf(line, "dial %d" EOL, callee_ext);
+    client_send(caller, line);
+    EXPECT(caller, "RING BACK");
+    EXPECT(callee, "RINGING");
+    client_send(callee, "pickup" EOL);
+    sprintf(line, "CONNECTED %d", caller_ext);
+    EXPECT(callee, line);
+    sprintf(line, "CONNECTED %d", callee_ext);
+    EXPECT(caller, line);
+}
+
+#define SUITE server_suite
+
+#define OUTQ_LIMIT "4096"
+#define FLOOD_CHATS 10000
+#define FLOOD_LEN 1000
+
+/*
+ * Connect a client with a small receive buffer, so that little of what it
+ * does not read is held by the kernel and the rest has to be queued by
+ * the server.
+ */
+static int connect_slow_reader() {
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(SERVER_PORT),
+			      .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int size = 4096;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert(fd >= 0, "socket failed\n");
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    cr_assert_eq(connect(fd, (struct sockaddr *)&sa, sizeof(sa)), 0, "could not connect\n");
+    return fd;
+}
+
+/*
+ * Send FLOOD_CHATS chats of FLOOD_LEN characters from a client in a call,
+ * reading the replies as they come so that the sender never falls behind
+ * itself, and return how many of them said the call was still up.  The
+ * last reply is left in last.
+ */
+static int flood(int fd, char *last, int size) {
+    static char chat[FLOOD_LEN + 16];
+    char *line = malloc(size);
+    FILE *in = fdopen(dup(fd), "r");
+    int connected = 0;
+    cr_assert(line != NULL && in != NULL, "could not read replies\n");
+    strcpy(chat, "chat ");
+    memset(chat + 5, 'x', FLOOD_LEN);
+    strcpy(chat + 5 + FLOOD_LEN, EOL);
+    for(int i = 0; i < FLOOD_CHATS; i += 100) {
+	for(int j = 0; j < 100; j++)
+	    cr_assert_eq(client_send(fd, chat), 0, "could not send chat %d\n", i + j);
+	for(int j = 0; j < 100; j++) {
+	    cr_assert_not_null(fgets(line, size, in), "no reply to chat %d\n", i + j);
+	    if(strcmp(line, "CONNECTED 1" EOL) == 0)
+		connected++;
+	}
+    }
+    line[strcspn(line, EOL)] = '\0';
+    snprintf(last, size, "%s", line);
+    fclose(in);
+    free(line);
+    return connected;
+}
+
+/*
+ * Read the chats a client was sent until the server has nothing more to
+ * send it, checking that each arrived whole, and return how many there
+ * were.  The line that ended the reading, if any, is left in last.
+ */
+static int read_chats(int fd, char *last, int size) {
+    struct timeval tv = { 0, 500000 };
+    char *line = malloc(FLOOD_LEN + 16);
+    FILE *in = fdopen(dup(fd), "r");
+    int chats = 0;
+    cr_assert(line != NULL && in != NULL, "could not read chats\n");
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    *last = '\0';
+    while(fgets(line, FLOOD_LEN + 16, in) != NULL) {
+	if(strlen(line) != FLOOD_LEN + 7) {
+	    line[strcspn(line, EOL)] = '\0';
+	    snprintf(last, size, "%s", line);
+	    break;
+	}
+	cr_assert(strncmp(line, "CHAT x", 6) == 0, "chat %d was cut short\n", chats);
+	chats++;
+    }
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    fclose(in);
+    free(line);
+    return chats;
+}
+
+static void init_drop() {
+    start_server("server dropping output", "-q", OUTQ_LIMIT, "-Q", "drop", NULL);
+}
+
+static void init_disconnect() {
+    start_server("server disconnecting slow clients", "-q", OUTQ_LIMIT, "-Q", "disconnect", NULL);
+}
+
+/*
+ * A client that does not read misses the chats that did not fit in its
+ * queue, but stays connected, and gets what it is sent once it catches up.
+ */
+Test(SUITE, outq_drop_test, .init = init_drop, .fini = fini, .timeout = 60) {
+    char last[64];
+    int r = connect_slow_reader();
+    EXPECT(r, "ON HOOK 1");
+    int s = client_connect(SERVER_PORT);
+    cr_assert(s >= 0, "could not connect\n");
+    EXPECT(s, "ON HOOK 2");
+    connect_call(s, r, 1, 2);
+
+    int sent = flood(s, last, sizeof(last));
+    cr_assert_eq(sent, FLOOD_CHATS, "the sender's call ended, last reply \"%s\"\n", last);
+    int got = read_chats(r, last, sizeof(last));
+    cr_assert_eq(last[0], '\0', "unexpected \"%s\"\n", last);
+    cr_assert(got > 0 && got < FLOOD_CHATS, "%d of %d chats were received\n", got, FLOOD_CHATS);
+
+    client_send(s, "chat end" EOL);
+    EXPECT(s, "CONNECTED 1");
+    EXPECT(r, "CHAT end");
+    close(s);
+    close(r);
+}
+
+/*
+ * A client that does not read is disconnected once its queue is full,
+ * with whatever was still queued for it thrown away, and the other party
+ * is left with a dial tone.
+ */
+Test(SUITE, outq_disconnect_test, .init = init_disconnect, .fini = fini, .timeout = 60) {
+    char last[64];
+    int r = connect_slow_reader();
+    EXPECT(r, "ON HOOK 1");
+    int s = client_connect(SERVER_PORT);
+    cr_assert(s >= 0, "could not connect\n");
+    EXPECT(s, "ON HOOK 2");
+    connect_call(s, r, 1, 2);
+
+    int sent = flood(s, last, sizeof(last));
+    cr_assert(sent < FLOOD_CHATS, "the sender's call did not end\n");
+    cr_assert(strcmp(last, "DIAL TONE") == 0, "expected \"DIAL TONE\", was \"%s\"\n", last);
+    int got = read_chats(r, last, sizeof(last));
+    cr_assert_eq(last[0], '\0', "unexpected \"%s\"\n", last);
+    cr_assert(got <= sent, "%d of %d chats were received\n", got, sent);
+    char c;
+    cr_assert_eq(read(r, &c, 1), 0, "the client was not disconnected\n");
+    close(s);
+    close(r);
+}
+
+static void init_plain() {
+    start_server("server", NULL);
+}
+
+#define CROSSING_ROUNDS 100
+#define CROSSING_DIALS 100
+
+/*
+ * Two clients off hook dial each other at the same moment, over and over.
+ * Each dial locks both TUs, the two in opposite orders, so unless they are
+ * always locked in the same order the server sooner or later hangs.  Both
+ * find the other busy, and stay busy however often they dial again.
+ */
+Test(SUITE, crossing_dials_test, .init = init_plain, .fini = fini, .timeout = 60) {
+    char dials[2][CROSSING_DIALS * 8 + 1] = { "", "" };
+    int a = client_connect(SERVER_PORT), b = client_connect(SERVER_PORT);
+    cr_assert(a >= 0 && b >= 0, "could not connect\n");
+    EXPECT(a, "ON HOOK 1");
+    EXPECT(b, "ON HOOK 2");
+    client_send(a, "pickup" EOL);
+    client_send(b, "pickup" EOL);
+    EXPECT(a, "DIAL TONE");
+    EXPECT(b, "DIAL TONE");
+    for(int i = 0; i < CROSSING_DIALS; i++) {
+	strcat(dials[0], "dial 2" EOL);
+	strcat(dials[1], "dial 1" EOL);
+    }
+    for(int i = 0; i < CROSSING_ROUNDS; i++) {
+	client_send(a, dials[0]);
+	client_send(b, dials[1]);
+	for(int j = 0; j < CROSSING_DIALS; j++) {
+	    EXPECT(a, "BUSY SIGNAL");
+	    EXPECT(b, "BUSY SIGNAL");
+	}
+    }
+    client_send(a, "hangup" EOL);
+    client_send(b, "hangup" EOL);
+    EXPECT(a, "ON HOOK 1");
+    EXPECT(b, "ON HOOK 2");
+    close(b);
+    close(a);
+}
+
+#define CDR_PATH "/tmp/pbx_test_cdr"
+
+static void init_cdr() {
+    unlink(CDR_PATH);
+    start_server("server recording calls", "-c", CDR_PATH, NULL);
+}
+
+static int by_ring_time(const void *a, const void *b) {
+    const CDR_RECORD *ra = a, *rb = b;
+    return ra->ring_ns < rb->ring_ns ? -1 : ra->ring_ns > rb->ring_ns;
+}
+
+/*
+ * Check the record of a call from extension 1 to extension 2 that ended
+ * for the reason given.
+ */
+static void check_call(CDR_RECORD *rec, CDR_REASON reason, int answered) {
+    cr_assert_eq(rec->reason, reason, "expected reason %d, was %d\n", reason, rec->reason);
+    cr_assert(rec->caller == 1 && rec->callee == 2,
+	      "call from %d to %d, reason %d\n", rec->caller, rec->callee, reason);
+    cr_assert(rec->ring_ns > 0 && rec->ring_ns <= rec->end_ns, "bad times for reason %d\n", reason);
+    if(answered)
+	cr_assert(rec->answer_ns >= rec->ring_ns && rec->answer_ns <= rec->end_ns,
+		  "bad answer time for reason %d\n", reason);
+    else
+	cr_assert_eq(rec->answer_ns, 0, "unanswered call has an answer time, reason %d\n", reason);
+}
+
+/*
+ * One call of each kind, each making one record: answered and ended by the
+ * caller, cancelled by the caller, rejected by the callee, and made to a
+ * busy phone.  The records of different clients can be written in any
+ * order, but all are in the file once the server has shut down, and their
+ * ring times put them back in the order the calls were made.
+ */
+Test(SUITE, cdr_test, .init = init_cdr, .timeout = 30) {
+    int a = client_connect(SERVER_PORT), b = client_connect(SERVER_PORT);
+    cr_assert(a >= 0 && b >= 0, "could not connect\n");
+    EXPECT(a, "ON HOOK 1");
+    EXPECT(b, "ON HOOK 2");
+
+    connect_call(a, b, 2, 1);
+    client_send(a, "hangup" EOL);
+    EXPECT(a, "ON HOOK 1");
+    EXPECT(b, "DIAL TONE");
+    client_send(b, "hangup" EOL);
+    EXPECT(b, "ON HOOK 2");
+
+    client_send(a, "pickup" EOL "dial 2" EOL);
+    EXPECT(a, "DIAL TONE");
+    EXPECT(a, "RING BACK");
+    EXPECT(b, "RINGING");
+    client_send(a, "hangup" EOL);
+    EXPECT(a, "ON HOOK 1");
+    EXPECT(b, "ON HOOK 2");
+
+    client_send(a, "pickup" EOL "dial 2" EOL);
+    EXPECT(a, "DIAL TONE");
+    EXPECT(a, "RING BACK");
+    EXPECT(b, "RINGING");
+    client_send(b, "hangup" EOL);
+    EXPECT(b, "ON HOOK 2");
+    EXPECT(a, "DIAL TONE");
+
+    client_send(b, "pickup" EOL);
+    EXPECT(b, "DIAL TONE");
+    client_send(a, "dial 2" EOL);
+    EXPECT(a, "BUSY SIGNAL");
+    client_send(a, "hangup" EOL);
+    client_send(b, "hangup" EOL);
+    EXPECT(a, "ON HOOK 1");
+    EXPECT(b, "ON HOOK 2");
+    close(b);
+    close(a);
+    fini();
+
+    CDR_RECORD recs[5];
+    FILE *f = fopen(CDR_PATH, "r");
+    cr_assert_not_null(f, "no records were written\n");
+    int n = fread(recs, sizeof(CDR_RECORD), 5, f);
+    fclose(f);
+    cr_assert_eq(n, 4, "expected 4 records, there were %d\n", n);
+    qsort(recs, n, sizeof(CDR_RECORD), by_ring_time);
+    check_call(&recs[0], CDR_CALLER_HANGUP, 1);
+    check_call(&recs[1], CDR_CANCELLED, 0);
+    check_call(&recs[2], CDR_REJECTED, 0);
+    check_call(&recs[3], CDR_BUSY, 0);
+    for(int i = 0; i < n; i++) {
+	for(int j = i + 1; j < n; j++)
+	    cr_assert(recs[i].call_id != recs[j].call_id, "two calls have id %lu\n", recs[i].call_id);
+    }
+}
+
+#define METRICS_PORT 9998
+
+static void init_metrics() {
+    start_server("server with metrics", "-m", QUOTE(METRICS_PORT), NULL);
+}
+
+/*
+ * Fetch the metrics over HTTP into buf, returning the body.  Some counters
+ * are only updated once the client has been notified, so the server is
+ * given a moment to finish the last command first.
+ */
+static char *get_metrics(char *buf, int size) {
+    usleep(100000);
+    int fd = client_connect(METRICS_PORT);
+    int len = 0, n;
+    cr_assert(fd >= 0, "could not connect to the metrics port\n");
+    client_send(fd, "GET /metrics HTTP/1.0\r\n\r\n");
+    while(len < size - 1 && (n = read(fd, buf + len, size - 1 - len)) > 0)
+	len += n;
+    close(fd);
+    buf[len] = '\0';
+    cr_assert(strncmp(buf, "HTTP/1.0 200 OK\r\n", 17) == 0, "bad response to metrics request\n");
+    char *body = strstr(buf, "\r\n\r\n");
+    cr_assert_not_null(body, "metrics response has no body\n");
+    return body + 4;
+}
+
+/*
+ * Check that a line of the metrics gives the value expected for a metric,
+ * name including any labels.
+ */
+static void expect_metric(char *body, char *name, long value) {
+    size_t len = strlen(name);
+    for(char *line = body; *line != '\0'; line = strchr(line, '\n') + 1) {
+	if(strncmp(line, name, len) == 0 && line[len] == ' ') {
+	    long got = atol(line + len + 1);
+	    cr_assert_eq(got, value, "expected %s %ld, was %ld\n", name, value, got);
+	    return;
+	}
+	if(strchr(line, '\n') == NULL)
+	    break;
+    }
+    cr_assert_fail("metric %s is missing\n", name);
+}
+
+/*
+ * The counters add up the commands of all clients, and the state gauges
+ * follow the TUs both while they are in a call and after it.
+ */
+Test(SUITE, metrics_test, .init = init_metrics, .fini = fini, .timeout = 30) {
+    static char buf[16384];
+    int a = client_connect(SERVER_PORT), b = client_connect(SERVER_PORT);
+    cr_assert(a >= 0 && b >= 0, "could not connect\n");
+    EXPECT(a, "ON HOOK 1");
+    EXPECT(b, "ON HOOK 2");
+    char *body = get_metrics(buf, sizeof(buf));
+    expect_metric(body, "pbx_registrations_total", 2);
+    expect_metric(body, "pbx_dials_total", 0);
+    expect_metric(body, "pbx_tus{state=\"ON HOOK\"}", 2);
+
+    connect_call(a, b, 2, 1);
+    client_send(a, "chat hello" EOL);
+    EXPECT(b, "CHAT hello");
+    EXPECT(a, "CONNECTED 2");
+    body = get_metrics(buf, sizeof(buf));
+    expect_metric(body, "pbx_dials_total", 1);
+    expect_metric(body, "pbx_connects_total", 1);
+    expect_metric(body, "pbx_chats_total", 1);
+    expect_metric(body, "pbx_tus{state=\"ON HOOK\"}", 0);
+    expect_metric(body, "pbx_tus{state=\"CONNECTED\"}", 2);
+
+    client_send(b, "hangup" EOL);
+    EXPECT(b, "ON HOOK 2");
+    EXPECT(a, "DIAL TONE");
+    client_send(a, "dial 3" EOL);
+    EXPECT(a, "ERROR");
+    body = get_metrics(buf, sizeof(buf));
+    expect_metric(body, "pbx_dials_total", 2);
+    expect_metric(body, "pbx_dial_errors_total", 1);
+    expect_metric(body, "pbx_hangups_total", 1);
+    expect_metric(body, "pbx_tus{state=\"CONNECTED\"}", 0);
+    expect_metric(body, "pbx_tus{state=\"ON HOOK\"}", 1);
+    expect_metric(body, "pbx_tus{state=\"ERROR\"}", 1);
+
+    close(b);
+    close(a);
+}
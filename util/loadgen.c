@@ -0,0 +1,451 @@
+/*
+ * Load generator for the PBX server.
+ *
+ * Opens many concurrent TU connections, pairs them up and drives each pair
+ * through a realistic call cycle (pickup, dial, answer, a few chats, hangup
+ * by either party) as fast as the server answers.  At the end it reports
+ * completed calls per second, the latency from each command to every
+ * notification it causes (p50/p99/p999) and error counts.
+ *
+ * Usage: loadgen -p <port> [-h <host>] [-c <connections>] [-d <seconds>]
+ *                [-t <threads>] [-m <max chats per call>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+
+#define LG_BUF 1024
+#define LG_TIMEOUT_NS 5000000000ull  // a step not completed by then is an error
+
+//messages a connection can be waiting for
+#define W_ON_HOOK     (1<<TU_ON_HOOK)
+#define W_RINGING     (1<<TU_RINGING)
+#define W_DIAL_TONE   (1<<TU_DIAL_TONE)
+#define W_RING_BACK   (1<<TU_RING_BACK)
+#define W_CONNECTED   (1<<TU_CONNECTED)
+#define W_CHAT        (1<<(TU_ERROR+1))
+
+//steps of the call cycle a pair goes through
+typedef enum step {
+    S_IDLE, S_PICKUP, S_DIAL, S_ANSWER, S_CHAT, S_HANGUP, S_HANGUP_OTHER, S_DEAD
+} STEP;
+
+struct pair;
+
+typedef struct lconn {
+    int fd;
+    int ext;                 //extension assigned by the server
+    int waiting;             //bitmap of expected messages
+    struct pair *pair;
+    int len;
+    char buf[LG_BUF];
+} LCONN;
+
+typedef struct pair {
+    LCONN conn[2];           //conn[0] places calls, conn[1] answers them
+    STEP step;
+    int chats_left;
+    int hangup_by;           //index of the party that hangs up first
+    uint64_t sent_ns;        //when the command of the current step was sent
+    unsigned int seed;
+} PAIR;
+
+typedef struct worker {
+    pthread_t tid;
+    int epfd;
+    PAIR *pairs;
+    int npairs;
+    //results
+    uint64_t calls;
+    uint64_t commands;
+    uint64_t notifications;
+    uint64_t unexpected;
+    uint64_t timeouts;
+    uint64_t disconnects;
+    uint32_t *lat_us;        //latency samples in microseconds
+    size_t nlat, caplat;
+} WORKER;
+
+static char *host = "localhost";
+static char *port = NULL;
+static int nconns = 1000;
+static int duration = 10;
+static int nthreads = 1;
+static int max_chats = 3;
+static volatile int stop = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int connect_to_server(void) {
+    struct addrinfo hints = {0}, *res, *rp;
+    int fd = -1;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &res)!=0) {
+        return -1;
+    }
+    for (rp = res; rp!=NULL; rp = rp->ai_next) {
+        if ((fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol))<0) {
+            continue;
+        }
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen)==0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void record_latency(WORKER *w, uint64_t ns) {
+    if (w->nlat==w->caplat) {
+        w->caplat = w->caplat ? 2*w->caplat : 4096;
+        w->lat_us = realloc(w->lat_us, w->caplat*sizeof(uint32_t));
+        if (w->lat_us==NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t us = ns/1000;
+    w->lat_us[w->nlat++] = us>UINT32_MAX ? UINT32_MAX : us;
+}
+
+static void send_line(WORKER *w, LCONN *c, char *line) {
+    size_t len = strlen(line);
+    if (write(c->fd, line, len)!=(ssize_t)len) {
+        w->disconnects++;
+        c->pair->step = S_DEAD;
+        return;
+    }
+    w->commands++;
+}
+
+//start the next step of the call cycle for a pair
+static void advance(WORKER *w, PAIR *p) {
+    LCONN *a = &p->conn[0], *b = &p->conn[1];
+    char line[64];
+    switch (p->step) {
+        case S_IDLE:
+            if (stop) {
+                return;
+            }
+            p->step = S_PICKUP;
+            a->waiting = W_DIAL_TONE;
+            p->sent_ns = now_ns();
+            send_line(w, a, "pickup\r\n");
+            break;
+        case S_PICKUP:
+            p->step = S_DIAL;
+            a->waiting = W_RING_BACK;
+            b->waiting = W_RINGING;
+            snprintf(line, sizeof(line), "dial %d\r\n", b->ext);
+            p->sent_ns = now_ns();
+            send_line(w, a, line);
+            break;
+        case S_DIAL:
+            p->step = S_ANSWER;
+            a->waiting = W_CONNECTED;
+            b->waiting = W_CONNECTED;
+            p->chats_left = rand_r(&p->seed)%(max_chats+1);
+            p->sent_ns = now_ns();
+            send_line(w, b, "pickup\r\n");
+            break;
+        case S_ANSWER:
+        case S_CHAT:
+            if (p->chats_left>0) {
+                //alternate the talking party
+                LCONN *from = &p->conn[p->chats_left%2];
+                LCONN *to = &p->conn[1-p->chats_left%2];
+                p->chats_left--;
+                p->step = S_CHAT;
+                from->waiting = W_CONNECTED;
+                to->waiting = W_CHAT;
+                p->sent_ns = now_ns();
+                send_line(w, from, "chat load generator transcript line\r\n");
+                break;
+            }
+            p->step = S_HANGUP;
+            p->hangup_by = rand_r(&p->seed)%2;
+            p->conn[p->hangup_by].waiting = W_ON_HOOK;
+            p->conn[1-p->hangup_by].waiting = W_DIAL_TONE;
+            p->sent_ns = now_ns();
+            send_line(w, &p->conn[p->hangup_by], "hangup\r\n");
+            break;
+        case S_HANGUP:
+            p->step = S_HANGUP_OTHER;
+            p->conn[1-p->hangup_by].waiting = W_ON_HOOK;
+            p->sent_ns = now_ns();
+            send_line(w, &p->conn[1-p->hangup_by], "hangup\r\n");
+            break;
+        case S_HANGUP_OTHER:
+            w->calls++;
+            p->step = S_IDLE;
+            advance(w, p);
+            break;
+        case S_DEAD:
+            break;
+    }
+}
+
+//classify a message from the server as one of the W_ bits, or 0 if unknown
+static int classify(char *msg) {
+    if (strncmp(msg, "CHAT", 4)==0) {
+        return W_CHAT;
+    }
+    for (int i=0;i<=TU_ERROR;i++) {
+        size_t len = strlen(tu_state_names[i]);
+        if (strncmp(msg, tu_state_names[i], len)==0 && (msg[len]==' ' || msg[len]=='\r')) {
+            return 1<<i;
+        }
+    }
+    return 0;
+}
+
+static void handle_message(WORKER *w, LCONN *c, char *msg) {
+    PAIR *p = c->pair;
+    int kind = classify(msg);
+    w->notifications++;
+    if (p->step==S_DEAD) {
+        return;
+    }
+    if (!(kind & c->waiting)) {
+        w->unexpected++;
+        p->step = S_DEAD;
+        return;
+    }
+    record_latency(w, now_ns()-p->sent_ns);
+    c->waiting = 0;
+    if (p->conn[0].waiting==0 && p->conn[1].waiting==0) {
+        advance(w, p);
+    }
+}
+
+static void handle_input(WORKER *w, LCONN *c) {
+    int n = read(c->fd, c->buf+c->len, LG_BUF-1-c->len);
+    if (n<=0) {
+        if (n<0 && (errno==EINTR || errno==EAGAIN)) {
+            return;
+        }
+        if (c->pair->step!=S_DEAD) {
+            w->disconnects++;
+            c->pair->step = S_DEAD;
+        }
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        return;
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+    char *start = c->buf, *eol;
+    while ((eol = strchr(start, '\n'))!=NULL) {
+        *eol = '\0';
+        handle_message(w, c, start);
+        start = eol+1;
+    }
+    c->len -= start-c->buf;
+    memmove(c->buf, start, c->len);
+    if (c->len==LG_BUF-1) {
+        c->len = 0;
+    }
+}
+
+//connect a TU and wait for its extension
+static int open_tu(LCONN *c) {
+    char line[LG_BUF];
+    int n = 0;
+    if ((c->fd = connect_to_server())<0) {
+        return -1;
+    }
+    //the registration notification is read synchronously, before the pair starts
+    while (n<LG_BUF-1) {
+        int r = read(c->fd, line+n, LG_BUF-1-n);
+        if (r<=0) {
+            return -1;
+        }
+        n += r;
+        line[n] = '\0';
+        if (strchr(line, '\n')!=NULL) {
+            break;
+        }
+    }
+    if (sscanf(line, "ON HOOK %d", &c->ext)!=1) {
+        return -1;
+    }
+    return 0;
+}
+
+static void *worker_thread(void *arg) {
+    WORKER *w = arg;
+    struct epoll_event events[256];
+    for (int i=0;i<w->npairs;i++) {
+        advance(w, &w->pairs[i]);
+    }
+    int active = 1;
+    while (active) {
+        int n = epoll_wait(w->epfd, events, 256, 100);
+        for (int i=0;i<n;i++) {
+            handle_input(w, events[i].data.ptr);
+        }
+        //check for steps that take too long, and whether anything is still running
+        uint64_t now = now_ns();
+        active = 0;
+        for (int i=0;i<w->npairs;i++) {
+            PAIR *p = &w->pairs[i];
+            if (p->step==S_IDLE || p->step==S_DEAD) {
+                continue;
+            }
+            if (now-p->sent_ns>LG_TIMEOUT_NS) {
+                w->timeouts++;
+                p->step = S_DEAD;
+                continue;
+            }
+            active = 1;
+        }
+        active |= !stop;
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x<y ? -1 : x>y;
+}
+
+static uint32_t percentile(uint32_t *v, size_t n, double pct) {
+    if (n==0) {
+        return 0;
+    }
+    size_t i = (size_t)(pct/100.0*(n-1)+0.5);
+    return v[i];
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: loadgen -p <port> [-h <host>] [-c <connections>] [-d <seconds>]\n"
+                    "               [-t <threads>] [-m <max chats per call>]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "h:p:c:d:t:m:"))!=-1) {
+        switch (c) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': nconns = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 't': nthreads = atoi(optarg); break;
+            case 'm': max_chats = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (port==NULL || nconns<2 || duration<1 || nthreads<1 || max_chats<0) {
+        usage();
+    }
+    int npairs = nconns/2;
+    if (nthreads>npairs) {
+        nthreads = npairs;
+    }
+
+    //thousands of connections need more descriptors than the usual soft limit
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl)==0 && rl.rlim_cur<rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    WORKER *workers = calloc(nthreads, sizeof(WORKER));
+    PAIR *pairs = calloc(npairs, sizeof(PAIR));
+    if (workers==NULL || pairs==NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Opening %d connections to %s:%s...\n", 2*npairs, host, port);
+    uint64_t t0 = now_ns();
+    for (int i=0;i<npairs;i++) {
+        PAIR *p = &pairs[i];
+        p->seed = i+1;
+        for (int j=0;j<2;j++) {
+            p->conn[j].pair = p;
+            if (open_tu(&p->conn[j])<0) {
+                fprintf(stderr, "Failed to open connection %d: %s\n", 2*i+j, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    fprintf(stderr, "Registered %d TUs in %.3fs\n", 2*npairs, (now_ns()-t0)/1e9);
+
+    int per = npairs/nthreads, extra = npairs%nthreads, next = 0;
+    for (int i=0;i<nthreads;i++) {
+        WORKER *w = &workers[i];
+        w->pairs = &pairs[next];
+        w->npairs = per + (i<extra);
+        next += w->npairs;
+        if ((w->epfd = epoll_create1(0))<0) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+        for (int j=0;j<w->npairs;j++) {
+            for (int k=0;k<2;k++) {
+                struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &w->pairs[j].conn[k] };
+                epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->pairs[j].conn[k].fd, &ev);
+            }
+        }
+    }
+
+    t0 = now_ns();
+    for (int i=0;i<nthreads;i++) {
+        pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+    }
+    sleep(duration);
+    stop = 1;
+    //calls in progress are allowed to finish, and count towards the run
+    for (int i=0;i<nthreads;i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+    uint64_t elapsed = now_ns()-t0;
+
+    //merge the results of all workers
+    WORKER total = {0};
+    for (int i=0;i<nthreads;i++) {
+        WORKER *w = &workers[i];
+        total.calls += w->calls;
+        total.commands += w->commands;
+        total.notifications += w->notifications;
+        total.unexpected += w->unexpected;
+        total.timeouts += w->timeouts;
+        total.disconnects += w->disconnects;
+        for (size_t j=0;j<w->nlat;j++) {
+            record_latency(&total, (uint64_t)w->lat_us[j]*1000);
+        }
+        free(w->lat_us);
+    }
+    qsort(total.lat_us, total.nlat, sizeof(uint32_t), cmp_u32);
+
+    printf("connections:     %d (%d pairs, %d threads)\n", 2*npairs, npairs, nthreads);
+    printf("duration:        %.3fs\n", elapsed/1e9);
+    printf("calls completed: %lu (%.1f calls/sec)\n", total.calls, total.calls/(elapsed/1e9));
+    printf("commands sent:   %lu\n", total.commands);
+    printf("notifications:   %lu\n", total.notifications);
+    printf("latency (us):    p50 %u  p99 %u  p999 %u  max %u\n",
+           percentile(total.lat_us, total.nlat, 50), percentile(total.lat_us, total.nlat, 99),
+           percentile(total.lat_us, total.nlat, 99.9),
+           total.nlat ? total.lat_us[total.nlat-1] : 0);
+    printf("errors:          unexpected %lu  timeouts %lu  disconnects %lu\n",
+           total.unexpected, total.timeouts, total.disconnects);
+    return total.unexpected || total.timeouts || total.disconnects ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,284 @@
+/*
+ * In-process microbenchmark for the TU state machine.
+ *
+ * Drives the PBX and TU functions directly, without a server or network
+ * clients.  Every TU is attached to one end of a socketpair; the other end
+ * is drained between calls, outside the timed region.  Each thread runs
+ * complete call cycles (pickup, dial, answer, chat, hangup, hangup) on its
+ * own pairs of TUs, or with -s on pairs shared by all threads, and the cost
+ * of every transition is reported together with the lock contention and
+ * the number of allocations it caused.
+ *
+ * Usage: tubench [-t <threads>] [-n <cycles per thread>] [-P <pairs per thread>] [-s]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+
+//histogram buckets: 8 linear sub-buckets for every power of two of nanoseconds
+#define HIST_SUB 8
+#define HIST_BUCKETS (64*HIST_SUB)
+
+typedef enum op {
+    OP_PICKUP, OP_DIAL, OP_ANSWER, OP_CHAT, OP_HANGUP, OP_HANGUP_OTHER, NUM_OPS
+} OP;
+
+static char *op_names[NUM_OPS] = {
+    [OP_PICKUP]       "pickup",
+    [OP_DIAL]         "dial",
+    [OP_ANSWER]       "answer",
+    [OP_CHAT]         "chat",
+    [OP_HANGUP]       "hangup",
+    [OP_HANGUP_OTHER] "hangup (dial tone)"
+};
+
+typedef struct op_stats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t allocs;
+    TU_LOCK_STATS locks;
+    uint64_t hist[HIST_BUCKETS];
+} OP_STATS;
+
+typedef struct bench_pair {
+    TU *tu[2];
+    int ext[2];
+    int sink[2];             //our ends of the socketpairs
+} BENCH_PAIR;
+
+typedef struct worker {
+    pthread_t tid;
+    BENCH_PAIR *pairs;
+    int npairs;
+    OP_STATS ops[NUM_OPS];
+} WORKER;
+
+static int nthreads = 1;
+static long ncycles = 100000;
+static int pairs_per_thread = 1;
+static int shared = 0;
+static pthread_barrier_t start_barrier;
+
+/*
+ * Allocations made by the calling thread.  The benchmark is linked with
+ * --wrap for the allocator entry points, so that every call made by the
+ * server code passes through here.
+ */
+static __thread uint64_t alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    alloc_count++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    return __real_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns) {
+    if (ns<HIST_SUB) {
+        return ns;
+    }
+    int log = 63-__builtin_clzll(ns);
+    int sub = (ns>>(log-3)) & (HIST_SUB-1);
+    return (log-2)*HIST_SUB + sub;
+}
+
+//lower bound of the values in a bucket
+static uint64_t hist_value(int bucket) {
+    if (bucket<HIST_SUB) {
+        return bucket;
+    }
+    int log = bucket/HIST_SUB+2;
+    return (1ull<<log) + ((uint64_t)(bucket%HIST_SUB)<<(log-3));
+}
+
+static uint64_t hist_percentile(OP_STATS *s, double pct) {
+    uint64_t want = (uint64_t)(pct/100.0*s->count), seen = 0;
+    for (int i=0;i<HIST_BUCKETS;i++) {
+        seen += s->hist[i];
+        if (seen>want) {
+            return hist_value(i);
+        }
+    }
+    return s->max_ns;
+}
+
+//throw away whatever the TUs sent to the client side
+static void drain(BENCH_PAIR *p) {
+    char buf[4096];
+    for (int i=0;i<2;i++) {
+        while (recv(p->sink[i], buf, sizeof(buf), MSG_DONTWAIT)>0)
+            ;
+    }
+}
+
+static void run_op(WORKER *w, OP op, BENCH_PAIR *p) {
+    static char msg[] = "benchmark chat message";
+    TU_LOCK_STATS locks;
+    uint64_t allocs = alloc_count;
+    tu_lock_stats(&locks, 1);
+    uint64_t start = now_ns();
+    switch (op) {
+        case OP_PICKUP:       tu_pickup(p->tu[0]); break;
+        case OP_DIAL:         pbx_dial(pbx, p->tu[0], p->ext[1]); break;
+        case OP_ANSWER:       tu_pickup(p->tu[1]); break;
+        case OP_CHAT:         tu_chat(p->tu[0], msg); break;
+        case OP_HANGUP:       tu_hangup(p->tu[0]); break;
+        case OP_HANGUP_OTHER: tu_hangup(p->tu[1]); break;
+        default: break;
+    }
+    uint64_t ns = now_ns()-start;
+    OP_STATS *s = &w->ops[op];
+    s->allocs += alloc_count-allocs;
+    tu_lock_stats(&locks, 1);
+    s->locks.acquired += locks.acquired;
+    s->locks.contended += locks.contended;
+    s->locks.wait_ns += locks.wait_ns;
+    s->count++;
+    s->total_ns += ns;
+    if (ns>s->max_ns) {
+        s->max_ns = ns;
+    }
+    s->hist[hist_bucket(ns)]++;
+}
+
+static void *worker_thread(void *arg) {
+    WORKER *w = arg;
+    pthread_barrier_wait(&start_barrier);
+    for (long i=0;i<ncycles;i++) {
+        BENCH_PAIR *p = &w->pairs[i%w->npairs];
+        for (OP op=0;op<NUM_OPS;op++) {
+            run_op(w, op, p);
+        }
+        drain(p);
+    }
+    return NULL;
+}
+
+static void open_pair(BENCH_PAIR *p) {
+    for (int i=0;i<2;i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)<0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        if ((p->tu[i] = tu_init(sv[0]))==NULL || pbx_register(pbx, p->tu[i], PBX_ANY_EXTENSION)<0) {
+            fprintf(stderr, "Failed to register TU\n");
+            exit(EXIT_FAILURE);
+        }
+        p->sink[i] = sv[1];
+        p->ext[i] = tu_extension(p->tu[i]);
+    }
+    drain(p);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: tubench [-t <threads>] [-n <cycles per thread>] [-P <pairs per thread>] [-s]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "t:n:P:s"))!=-1) {
+        switch (c) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'n': ncycles = atol(optarg); break;
+            case 'P': pairs_per_thread = atoi(optarg); break;
+            case 's': shared = 1; break;
+            default: usage();
+        }
+    }
+    if (nthreads<1 || ncycles<1 || pairs_per_thread<1) {
+        usage();
+    }
+
+    pbx = pbx_init();
+    int npairs = shared ? pairs_per_thread : nthreads*pairs_per_thread;
+    BENCH_PAIR *pairs = calloc(npairs, sizeof(BENCH_PAIR));
+    WORKER *workers = calloc(nthreads, sizeof(WORKER));
+    if (pairs==NULL || workers==NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i=0;i<npairs;i++) {
+        open_pair(&pairs[i]);
+    }
+
+    //cost of reading the clock, included in every measurement below
+    uint64_t t0 = now_ns();
+    for (int i=0;i<1000000;i++) {
+        now_ns();
+    }
+    uint64_t clock_ns = (now_ns()-t0)/1000000;
+
+    pthread_barrier_init(&start_barrier, NULL, nthreads+1);
+    for (int i=0;i<nthreads;i++) {
+        workers[i].pairs = shared ? pairs : &pairs[i*pairs_per_thread];
+        workers[i].npairs = pairs_per_thread;
+        pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_ns();
+    for (int i=0;i<nthreads;i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+    uint64_t elapsed = now_ns()-t0;
+
+    printf("threads %d, %ld cycles per thread, %d %s pairs, clock overhead %luns\n",
+           nthreads, ncycles, npairs, shared ? "shared" : "private", clock_ns);
+    printf("%-20s %10s %8s %8s %8s %10s %8s %10s %10s\n", "transition", "ops", "ns/op", "p99",
+           "max", "locks/op", "cont%", "wait ns/op", "allocs/op");
+    for (OP op=0;op<NUM_OPS;op++) {
+        OP_STATS total = {0};
+        for (int i=0;i<nthreads;i++) {
+            OP_STATS *s = &workers[i].ops[op];
+            total.count += s->count;
+            total.total_ns += s->total_ns;
+            total.allocs += s->allocs;
+            total.locks.acquired += s->locks.acquired;
+            total.locks.contended += s->locks.contended;
+            total.locks.wait_ns += s->locks.wait_ns;
+            if (s->max_ns>total.max_ns) {
+                total.max_ns = s->max_ns;
+            }
+            for (int j=0;j<HIST_BUCKETS;j++) {
+                total.hist[j] += s->hist[j];
+            }
+        }
+        double n = total.count;
+        printf("%-20s %10lu %8.0f %8lu %8lu %10.2f %7.2f%% %10.0f %10.2f\n", op_names[op],
+               total.count, total.total_ns/n, hist_percentile(&total, 99), total.max_ns,
+               total.locks.acquired/n,
+               total.locks.acquired ? 100.0*total.locks.contended/total.locks.acquired : 0.0,
+               total.locks.wait_ns/n, total.allocs/n);
+    }
+    printf("total: %.3fs, %.0f cycles/sec\n", elapsed/1e9, nthreads*ncycles/(elapsed/1e9));
+    return EXIT_SUCCESS;
+}